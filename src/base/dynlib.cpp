@@ -0,0 +1,65 @@
+#ifdef _WIN32
+#include <windows.h>
+#include "base/string.h"
+#include "base/wstring.h"
+#else
+#include <dlfcn.h>
+#endif
+#include "dynlib.h"
+
+namespace dynlib
+{
+
+#ifdef _WIN32
+
+char const* extension = ".dll";
+char const pathsep = ';';
+char const dirsep = '\\';
+
+Handle open(char const* path)
+{
+  // do not pop up "missing dll" boxes while probing the search path
+  UINT mode = SetErrorMode(SEM_FAILCRITICALERRORS);
+  HMODULE lib = LoadLibraryEx(WideString(path), NULL, LOAD_WITH_ALTERED_SEARCH_PATH);
+  SetErrorMode(mode);
+  return lib;
+}
+void* symbol(Handle lib, char const* name)
+{
+  return GetProcAddress((HMODULE) lib, name);
+}
+void close(Handle lib)
+{
+  FreeLibrary((HMODULE) lib);
+}
+
+#else
+
+char const* extension = ".so";
+char const pathsep = ':';
+char const dirsep = '/';
+
+Handle open(char const* path)
+{
+  return dlopen(path, RTLD_NOW | RTLD_LOCAL);
+}
+void* symbol(Handle lib, char const* name)
+{
+  return dlsym(lib, name);
+}
+void close(Handle lib)
+{
+  dlclose(lib);
+}
+
+#endif
+
+bool haspath(char const* path)
+{
+  for (; *path; path++)
+    if (*path == '/' || *path == '\\' || *path == ':')
+      return true;
+  return false;
+}
+
+}
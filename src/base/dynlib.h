@@ -0,0 +1,28 @@
+#ifndef __BASE_DYNLIB__
+#define __BASE_DYNLIB__
+
+// thin portable wrapper over LoadLibrary/GetProcAddress and dlopen/dlsym
+// paths are UTF-8 on every platform
+
+namespace dynlib
+{
+
+typedef void* Handle;
+
+// default file extension for shared libraries, including the dot
+extern char const* extension;
+// path list separator used in ILUA_PATH
+extern char const pathsep;
+// separator between a directory and a file name
+extern char const dirsep;
+
+Handle open(char const* path);
+void* symbol(Handle lib, char const* name);
+void close(Handle lib);
+
+// true if the path names a file explicitly (contains a directory part)
+bool haspath(char const* path);
+
+}
+
+#endif // __BASE_DYNLIB__
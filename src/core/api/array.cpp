@@ -0,0 +1,682 @@
+#include <lua/lua.hpp>
+#include <emmintrin.h>
+#include "base/types.h"
+#include "ilua/ilua.h"
+#include "ilua/stream.h"
+#include "buffer.h"
+
+namespace api
+{
+
+// typed numeric arrays: a buffer whose contents are read as elements of one numeric type,
+// so they can be written to and filled from streams as they are (see stream:read)
+// bulk operations on f32/f64 use SSE2, integer types use plain loops
+enum {AT_I8, AT_U8, AT_I16, AT_U16, AT_I32, AT_U32, AT_F32, AT_F64};
+static char const* const array_types[] = {"i8", "u8", "i16", "u16", "i32", "u32", "f32", "f64", NULL};
+static int const array_sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+
+class TypedArray : public Buffer
+{
+public:
+  int m_type;
+
+  TypedArray(int type, int64 count)
+    : Buffer(count * array_sizes[type])
+    , m_type(type)
+  {
+  }
+
+  int elsize() const
+  {
+    return array_sizes[m_type];
+  }
+  int64 count() const
+  {
+    return m_size / array_sizes[m_type];
+  }
+
+  // the inherited stream methods work in whole elements: the position stays on an element
+  // boundary, and writes, resizes and copies leave out what does not make up a whole element
+  void seek(int64 pos, int rel)
+  {
+    Buffer::seek(pos, rel);
+    m_pos -= m_pos % elsize();
+  }
+  int putc(char c)
+  {
+    return (elsize() == 1 ? Buffer::putc(c) : 0);
+  }
+  int write(void const* buf, int count)
+  {
+    return Buffer::write(buf, count - count % elsize());
+  }
+  void resize(int64 newsize)
+  {
+    Buffer::resize(newsize - newsize % elsize());
+  }
+  int64 copy(Stream* stream, int64 count)
+  {
+    if (count == 0)
+      count = stream->size() - stream->tell();
+    count -= count % elsize();
+    if (count <= 0)
+      return 0;
+    int64 size = m_size;
+    int64 total = Buffer::copy(stream, count);
+    // a source that ends inside an element: its bytes are consumed but not kept
+    int64 extra = total % elsize();
+    m_pos -= extra;
+    if (m_size > size)
+      m_size = (m_pos > size ? m_pos : size);
+    return total - extra;
+  }
+};
+
+#define ARRAY_SWITCH(type, func, args)                  \
+  switch (type)                                         \
+  {                                                     \
+  case AT_I8:  func<sint8> args; break;                 \
+  case AT_U8:  func<uint8> args; break;                 \
+  case AT_I16: func<sint16> args; break;                \
+  case AT_U16: func<uint16> args; break;                \
+  case AT_I32: func<sint32> args; break;                \
+  case AT_U32: func<uint32> args; break;                \
+  case AT_F32: func<float> args; break;                 \
+  case AT_F64: func<double> args; break;                \
+  }
+
+template<class T>
+inline T from_number(lua_Number v)
+{
+  return T(int64(v));
+}
+template<>
+inline float from_number<float>(lua_Number v)
+{
+  return float(v);
+}
+template<>
+inline double from_number<double>(lua_Number v)
+{
+  return double(v);
+}
+
+////////////////////////////////// KERNELS ///////////////////////////////////
+
+template<class T>
+static void k_get(void const* p, int64 i, lua_Number* out)
+{
+  *out = lua_Number(((T const*) p)[i]);
+}
+template<class T>
+static void k_set(void* p, int64 i, lua_Number v)
+{
+  ((T*) p)[i] = from_number<T>(v);
+}
+template<class T>
+static void k_fill(void* p, int64 n, lua_Number v)
+{
+  T value = from_number<T>(v);
+  T* d = (T*) p;
+  for (int64 i = 0; i < n; i++)
+    d[i] = value;
+}
+
+template<class T>
+static void k_sum(void const* p, int64 n, double* out)
+{
+  T const* s = (T const*) p;
+  int64 sum = 0;
+  for (int64 i = 0; i < n; i++)
+    sum += s[i];
+  *out = double(sum);
+}
+template<>
+void k_sum<float>(void const* p, int64 n, double* out)
+{
+  float const* s = (float const*) p;
+  // accumulate in double precision, two lanes per register
+  __m128d a0 = _mm_setzero_pd(), a1 = _mm_setzero_pd();
+  int64 i = 0;
+  for (; i + 4 <= n; i += 4)
+  {
+    __m128 v = _mm_loadu_ps(s + i);
+    a0 = _mm_add_pd(a0, _mm_cvtps_pd(v));
+    a1 = _mm_add_pd(a1, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(a0, a1));
+  double sum = lanes[0] + lanes[1];
+  for (; i < n; i++)
+    sum += s[i];
+  *out = sum;
+}
+template<>
+void k_sum<double>(void const* p, int64 n, double* out)
+{
+  double const* s = (double const*) p;
+  __m128d a0 = _mm_setzero_pd(), a1 = _mm_setzero_pd();
+  int64 i = 0;
+  for (; i + 4 <= n; i += 4)
+  {
+    a0 = _mm_add_pd(a0, _mm_loadu_pd(s + i));
+    a1 = _mm_add_pd(a1, _mm_loadu_pd(s + i + 2));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(a0, a1));
+  double sum = lanes[0] + lanes[1];
+  for (; i < n; i++)
+    sum += s[i];
+  *out = sum;
+}
+
+// n > 0
+template<class T>
+static void k_range(void const* p, int64 n, double* lo, double* hi)
+{
+  T const* s = (T const*) p;
+  T mn = s[0], mx = s[0];
+  for (int64 i = 1; i < n; i++)
+  {
+    if (s[i] < mn) mn = s[i];
+    if (s[i] > mx) mx = s[i];
+  }
+  *lo = double(mn);
+  *hi = double(mx);
+}
+template<>
+void k_range<float>(void const* p, int64 n, double* lo, double* hi)
+{
+  float const* s = (float const*) p;
+  __m128 mn = _mm_set1_ps(s[0]), mx = mn;
+  int64 i = 0;
+  for (; i + 4 <= n; i += 4)
+  {
+    __m128 v = _mm_loadu_ps(s + i);
+    mn = _mm_min_ps(mn, v);
+    mx = _mm_max_ps(mx, v);
+  }
+  float a[4], b[4];
+  _mm_storeu_ps(a, mn);
+  _mm_storeu_ps(b, mx);
+  for (int j = 1; j < 4; j++)
+  {
+    if (a[j] < a[0]) a[0] = a[j];
+    if (b[j] > b[0]) b[0] = b[j];
+  }
+  for (; i < n; i++)
+  {
+    if (s[i] < a[0]) a[0] = s[i];
+    if (s[i] > b[0]) b[0] = s[i];
+  }
+  *lo = a[0];
+  *hi = b[0];
+}
+template<>
+void k_range<double>(void const* p, int64 n, double* lo, double* hi)
+{
+  double const* s = (double const*) p;
+  __m128d mn = _mm_set1_pd(s[0]), mx = mn;
+  int64 i = 0;
+  for (; i + 2 <= n; i += 2)
+  {
+    __m128d v = _mm_loadu_pd(s + i);
+    mn = _mm_min_pd(mn, v);
+    mx = _mm_max_pd(mx, v);
+  }
+  double a[2], b[2];
+  _mm_storeu_pd(a, mn);
+  _mm_storeu_pd(b, mx);
+  if (a[1] < a[0]) a[0] = a[1];
+  if (b[1] > b[0]) b[0] = b[1];
+  for (; i < n; i++)
+  {
+    if (s[i] < a[0]) a[0] = s[i];
+    if (s[i] > b[0]) b[0] = s[i];
+  }
+  *lo = a[0];
+  *hi = b[0];
+}
+
+// x = x * k + c
+template<class T>
+static void k_scale(void* p, int64 n, double k, double c)
+{
+  T* d = (T*) p;
+  for (int64 i = 0; i < n; i++)
+    d[i] = from_number<T>(d[i] * k + c);
+}
+template<>
+void k_scale<float>(void* p, int64 n, double k, double c)
+{
+  float* d = (float*) p;
+  __m128 vk = _mm_set1_ps(float(k)), vc = _mm_set1_ps(float(c));
+  int64 i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_ps(d + i, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(d + i), vk), vc));
+  for (; i < n; i++)
+    d[i] = d[i] * float(k) + float(c);
+}
+template<>
+void k_scale<double>(void* p, int64 n, double k, double c)
+{
+  double* d = (double*) p;
+  __m128d vk = _mm_set1_pd(k), vc = _mm_set1_pd(c);
+  int64 i = 0;
+  for (; i + 2 <= n; i += 2)
+    _mm_storeu_pd(d + i, _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(d + i), vk), vc));
+  for (; i < n; i++)
+    d[i] = d[i] * k + c;
+}
+
+// x += y * k
+template<class T>
+static void k_add(void* p, void const* q, int64 n, double k)
+{
+  T* d = (T*) p;
+  T const* s = (T const*) q;
+  for (int64 i = 0; i < n; i++)
+    d[i] = from_number<T>(d[i] + s[i] * k);
+}
+template<>
+void k_add<float>(void* p, void const* q, int64 n, double k)
+{
+  float* d = (float*) p;
+  float const* s = (float const*) q;
+  __m128 vk = _mm_set1_ps(float(k));
+  int64 i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_ps(d + i, _mm_add_ps(_mm_loadu_ps(d + i), _mm_mul_ps(_mm_loadu_ps(s + i), vk)));
+  for (; i < n; i++)
+    d[i] += s[i] * float(k);
+}
+template<>
+void k_add<double>(void* p, void const* q, int64 n, double k)
+{
+  double* d = (double*) p;
+  double const* s = (double const*) q;
+  __m128d vk = _mm_set1_pd(k);
+  int64 i = 0;
+  for (; i + 2 <= n; i += 2)
+    _mm_storeu_pd(d + i, _mm_add_pd(_mm_loadu_pd(d + i), _mm_mul_pd(_mm_loadu_pd(s + i), vk)));
+  for (; i < n; i++)
+    d[i] += s[i] * k;
+}
+
+template<class T>
+static void k_dot(void const* p, void const* q, int64 n, double* out)
+{
+  T const* a = (T const*) p;
+  T const* b = (T const*) q;
+  double sum = 0;
+  for (int64 i = 0; i < n; i++)
+    sum += double(a[i]) * double(b[i]);
+  *out = sum;
+}
+template<>
+void k_dot<float>(void const* p, void const* q, int64 n, double* out)
+{
+  float const* a = (float const*) p;
+  float const* b = (float const*) q;
+  __m128d a0 = _mm_setzero_pd(), a1 = _mm_setzero_pd();
+  int64 i = 0;
+  for (; i + 4 <= n; i += 4)
+  {
+    __m128 x = _mm_loadu_ps(a + i);
+    __m128 y = _mm_loadu_ps(b + i);
+    a0 = _mm_add_pd(a0, _mm_mul_pd(_mm_cvtps_pd(x), _mm_cvtps_pd(y)));
+    a1 = _mm_add_pd(a1, _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(x, x)), _mm_cvtps_pd(_mm_movehl_ps(y, y))));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(a0, a1));
+  double sum = lanes[0] + lanes[1];
+  for (; i < n; i++)
+    sum += double(a[i]) * double(b[i]);
+  *out = sum;
+}
+template<>
+void k_dot<double>(void const* p, void const* q, int64 n, double* out)
+{
+  double const* a = (double const*) p;
+  double const* b = (double const*) q;
+  __m128d a0 = _mm_setzero_pd(), a1 = _mm_setzero_pd();
+  int64 i = 0;
+  for (; i + 4 <= n; i += 4)
+  {
+    a0 = _mm_add_pd(a0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    a1 = _mm_add_pd(a1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(a0, a1));
+  double sum = lanes[0] + lanes[1];
+  for (; i < n; i++)
+    sum += a[i] * b[i];
+  *out = sum;
+}
+
+template<class D>
+static void k_convert_to(void* p, void const* q, int64 n, int from)
+{
+  D* d = (D*) p;
+  for (int64 i = 0; i < n; i++)
+  {
+    lua_Number v;
+    ARRAY_SWITCH(from, k_get, (q, i, &v));
+    d[i] = from_number<D>(v);
+  }
+}
+template<>
+void k_convert_to<float>(void* p, void const* q, int64 n, int from)
+{
+  float* d = (float*) p;
+  if (from == AT_F64)
+  {
+    double const* s = (double const*) q;
+    int64 i = 0;
+    for (; i + 4 <= n; i += 4)
+      _mm_storeu_ps(d + i, _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(s + i)), _mm_cvtpd_ps(_mm_loadu_pd(s + i + 2))));
+    for (; i < n; i++)
+      d[i] = float(s[i]);
+    return;
+  }
+  for (int64 i = 0; i < n; i++)
+  {
+    lua_Number v;
+    ARRAY_SWITCH(from, k_get, (q, i, &v));
+    d[i] = float(v);
+  }
+}
+
+// SSE2 has no byte shuffle: 4 and 8-byte elements swap their 16-bit words first, then every word
+// swaps its two bytes
+void byteswap_array(void* data, int64 count, int size)
+{
+  uint8* p = (uint8*) data;
+  int64 bytes = count * size;
+  int64 i = 0;
+  for (; i + 16 <= bytes; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((__m128i const*) (p + i));
+    if (size == 4)
+      v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+    else if (size == 8)
+      v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3)), _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    _mm_storeu_si128((__m128i*) (p + i), v);
+  }
+  for (; i + size <= bytes; i += size)
+  {
+    switch (size)
+    {
+    case 2:
+      *(uint16*) (p + i) = _byteswap_ushort(*(uint16*) (p + i));
+      break;
+    case 4:
+      *(uint32*) (p + i) = _byteswap_ulong(*(uint32*) (p + i));
+      break;
+    case 8:
+      *(unsigned long long*) (p + i) = _byteswap_uint64(*(unsigned long long*) (p + i));
+      break;
+    }
+  }
+}
+
+/////////////////////////////////// BINDS ////////////////////////////////////
+
+int array_elsize(lua_State* L, int index)
+{
+  TypedArray* a = ilua::toobject<TypedArray>(L, index, "array");
+  return (a ? a->elsize() : 0);
+}
+int array_typeof(lua_State* L, int index)
+{
+  TypedArray* a = ilua::toobject<TypedArray>(L, index, "array");
+  return (a ? a->m_type : -1);
+}
+static TypedArray* array_check(lua_State* L, int index)
+{
+  return ilua::checkobject<TypedArray>(L, index, "array");
+}
+// the contents are about to change: make sure they are not shared with a slice
+static void array_modify(lua_State* L, TypedArray* a)
+{
+  if (!a->reserve(a->m_size))
+    luaL_error(L, "not enough memory");
+}
+static int64 array_index(lua_State* L, TypedArray* a, int arg)
+{
+  lua_Number i = luaL_checknumber(L, arg);
+  if (i < 1 || i > lua_Number(a->count()))
+    luaL_argerror(L, arg, "index out of range");
+  return int64(i) - 1;
+}
+static TypedArray* array_push(lua_State* L, int type, int64 count)
+{
+  TypedArray* a = new(L, "array") TypedArray(type, count);
+  if (a->capacity() < count * a->elsize())
+    luaL_error(L, "not enough memory");
+  a->m_size = count * a->elsize();
+  memset(a->m_data, 0, size_t(a->m_size));
+  return a;
+}
+Buffer* array_create(lua_State* L, int type, int64 count)
+{
+  if (type < 0 || type >= int(sizeof array_sizes / sizeof array_sizes[0]))
+    return NULL;
+  return array_push(L, type, count);
+}
+
+// array.new(type, count | table | buffer)
+static int array_new(lua_State* L)
+{
+  int type = ilua::checkoption(L, 1, NULL, array_types);
+  if (lua_istable(L, 2))
+  {
+    int64 count = lua_rawlen(L, 2);
+    TypedArray* a = array_push(L, type, count);
+    for (int64 i = 0; i < count; i++)
+    {
+      lua_rawgeti(L, 2, int(i + 1));
+      ARRAY_SWITCH(type, k_set, (a->m_data, i, lua_tonumber(L, -1)));
+      lua_pop(L, 1);
+    }
+    return 1;
+  }
+  if (lua_type(L, 2) != LUA_TNUMBER && ilua::isbuffer(L, 2))
+  {
+    size_t length;
+    char const* data = ilua::checkbuffer(L, 2, &length);
+    int64 count = int64(length) / array_sizes[type];
+    TypedArray* a = array_push(L, type, count);
+    memcpy(a->m_data, data, size_t(a->m_size));
+    return 1;
+  }
+  lua_Number count = luaL_optnumber(L, 2, 0);
+  luaL_argcheck(L, count >= 0 && count * array_sizes[type] < 9.0e15, 2, "invalid count");
+  array_push(L, type, int64(count));
+  return 1;
+}
+
+static int array_type(lua_State* L)
+{
+  TypedArray* a = array_check(L, 1);
+  lua_pushstring(L, array_types[a->m_type]);
+  return 1;
+}
+static int array_count(lua_State* L)
+{
+  TypedArray* a = array_check(L, 1);
+  lua_pushnumber(L, lua_Number(a->count()));
+  return 1;
+}
+static int array_get(lua_State* L)
+{
+  TypedArray* a = array_check(L, 1);
+  int64 i = array_index(L, a, 2);
+  lua_Number v;
+  ARRAY_SWITCH(a->m_type, k_get, (a->m_data, i, &v));
+  lua_pushnumber(L, v);
+  return 1;
+}
+static int array_set(lua_State* L)
+{
+  TypedArray* a = array_check(L, 1);
+  int64 i = array_index(L, a, 2);
+  lua_Number v = luaL_checknumber(L, 3);
+  array_modify(L, a);
+  ARRAY_SWITCH(a->m_type, k_set, (a->m_data, i, v));
+  return 0;
+}
+static int array_fill(lua_State* L)
+{
+  TypedArray* a = array_check(L, 1);
+  lua_Number v = luaL_optnumber(L, 2, 0);
+  array_modify(L, a);
+  ARRAY_SWITCH(a->m_type, k_fill, (a->m_data, a->count(), v));
+  lua_settop(L, 1);
+  return 1;
+}
+static int array_totable(lua_State* L)
+{
+  TypedArray* a = array_check(L, 1);
+  int64 count = a->count();
+  lua_createtable(L, count < 0x7FFFFFFF ? int(count) : 0, 0);
+  for (int64 i = 0; i < count; i++)
+  {
+    lua_Number v;
+    ARRAY_SWITCH(a->m_type, k_get, (a->m_data, i, &v));
+    lua_pushnumber(L, v);
+    lua_rawseti(L, -2, int(i + 1));
+  }
+  return 1;
+}
+
+static int array_sum(lua_State* L)
+{
+  TypedArray* a = array_check(L, 1);
+  double sum = 0;
+  ARRAY_SWITCH(a->m_type, k_sum, (a->m_data, a->count(), &sum));
+  lua_pushnumber(L, sum);
+  return 1;
+}
+// min, max (nil for an empty array)
+static int array_range(lua_State* L)
+{
+  TypedArray* a = array_check(L, 1);
+  if (a->count() == 0)
+    return 0;
+  double lo, hi;
+  ARRAY_SWITCH(a->m_type, k_range, (a->m_data, a->count(), &lo, &hi));
+  lua_pushnumber(L, lo);
+  lua_pushnumber(L, hi);
+  return 2;
+}
+static int array_min(lua_State* L)
+{
+  if (!array_range(L))
+    return 0;
+  lua_pop(L, 1);
+  return 1;
+}
+static int array_max(lua_State* L)
+{
+  return (array_range(L) ? 1 : 0);
+}
+// a:scale(k[, c]) sets every element to x * k + c
+static int array_scale(lua_State* L)
+{
+  TypedArray* a = array_check(L, 1);
+  double k = luaL_checknumber(L, 2);
+  double c = luaL_optnumber(L, 3, 0);
+  array_modify(L, a);
+  ARRAY_SWITCH(a->m_type, k_scale, (a->m_data, a->count(), k, c));
+  lua_settop(L, 1);
+  return 1;
+}
+// a:add(b[, k]) adds b * k elementwise (b an array of the same type) or the number b
+static int array_add(lua_State* L)
+{
+  TypedArray* a = array_check(L, 1);
+  if (lua_type(L, 2) == LUA_TNUMBER)
+  {
+    array_modify(L, a);
+    ARRAY_SWITCH(a->m_type, k_scale, (a->m_data, a->count(), 1.0, lua_tonumber(L, 2)));
+    lua_settop(L, 1);
+    return 1;
+  }
+  TypedArray* b = array_check(L, 2);
+  double k = luaL_optnumber(L, 3, 1);
+  luaL_argcheck(L, b->m_type == a->m_type, 2, "array types differ");
+  int64 count = (a->count() < b->count() ? a->count() : b->count());
+  array_modify(L, a);
+  ARRAY_SWITCH(a->m_type, k_add, (a->m_data, b->m_data, count, k));
+  lua_settop(L, 1);
+  return 1;
+}
+static int array_dot(lua_State* L)
+{
+  TypedArray* a = array_check(L, 1);
+  TypedArray* b = array_check(L, 2);
+  luaL_argcheck(L, b->m_type == a->m_type, 2, "array types differ");
+  int64 count = (a->count() < b->count() ? a->count() : b->count());
+  double sum = 0;
+  ARRAY_SWITCH(a->m_type, k_dot, (a->m_data, b->m_data, count, &sum));
+  lua_pushnumber(L, sum);
+  return 1;
+}
+// reverse the byte order of every element
+static int array_byteswap(lua_State* L)
+{
+  TypedArray* a = array_check(L, 1);
+  array_modify(L, a);
+  byteswap_array(a->m_data, a->count(), a->elsize());
+  lua_settop(L, 1);
+  return 1;
+}
+// new array with the elements converted to another type
+static int array_convert(lua_State* L)
+{
+  TypedArray* a = array_check(L, 1);
+  int type = ilua::checkoption(L, 2, NULL, array_types);
+  TypedArray* d = array_push(L, type, a->count());
+  if (type == a->m_type)
+    memcpy(d->m_data, a->m_data, size_t(d->m_size));
+  else
+    ARRAY_SWITCH(type, k_convert_to, (d->m_data, a->m_data, a->count(), a->m_type));
+  return 1;
+}
+static int array_len(lua_State* L)
+{
+  TypedArray* a = array_check(L, 1);
+  lua_pushnumber(L, lua_Number(a->count()));
+  return 1;
+}
+
+void bind_array(lua_State* L)
+{
+  ilua::newtype<TypedArray>(L, "array", "buffer");
+  ilua::bindmethod(L, "type", array_type);
+  ilua::bindmethod(L, "count", array_count);
+  ilua::bindmethod(L, "get", array_get);
+  ilua::bindmethod(L, "set", array_set);
+  ilua::bindmethod(L, "fill", array_fill);
+  ilua::bindmethod(L, "totable", array_totable);
+  ilua::bindmethod(L, "sum", array_sum);
+  ilua::bindmethod(L, "min", array_min);
+  ilua::bindmethod(L, "max", array_max);
+  ilua::bindmethod(L, "range", array_range);
+  ilua::bindmethod(L, "scale", array_scale);
+  ilua::bindmethod(L, "add", array_add);
+  ilua::bindmethod(L, "dot", array_dot);
+  ilua::bindmethod(L, "byteswap", array_byteswap);
+  ilua::bindmethod(L, "convert", array_convert);
+  lua_pop(L, 1);
+  ilua::bindmethod(L, "__len", array_len);
+  lua_pop(L, 1);
+
+  ilua::openlib(L, "array");
+  ilua::bindmethod(L, "new", array_new);
+  lua_pop(L, 1);
+}
+
+}
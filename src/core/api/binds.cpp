@@ -95,6 +95,12 @@ static int global_after(lua_State* L)
 
 static int global_clock(lua_State* L)
 {
+  Engine* e = engine(L);
+  if (e->virtualclock())
+  {
+    lua_pushnumber(L, double(e->clock()) * 0.001);
+    return 1;
+  }
   static union {
     uint64 time64;
     struct {
@@ -166,6 +172,14 @@ static int thread_unlock(lua_State* L)
   }
   return 0;
 }
+static int thread_virtualclock(lua_State* L)
+{
+  Engine* e = engine(L);
+  lua_pushboolean(L, e->virtualclock());
+  if (!lua_isnone(L, 1))
+    e->setVirtualClock(lua_toboolean(L, 1) != 0);
+  return 1;
+}
 static int thread_yield(lua_State* L)
 {
   Engine* e = engine(L);
@@ -647,6 +661,7 @@ void Engine::bind(lua_State* L)
   ilua::bindmethod(L, "lock", thread_lock);
   ilua::bindmethod(L, "unlock", thread_unlock);
   ilua::bindmethod(L, "yield", thread_yield);
+  ilua::bindmethod(L, "virtualclock", thread_virtualclock);
   lua_pop(L, 1);
 
   ilua::newtype<Thread>(L, "thread", "object");
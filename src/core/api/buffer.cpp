@@ -0,0 +1,93 @@
+#include "buffer.h"
+#include "base/thread.h"
+
+namespace api
+{
+
+#define POOL_CLASSES      11        // 64 bytes to BUFFER_POOLED
+#define POOL_LIMIT        0x1000000
+
+// free stores are linked through their data
+static BufferStore* pool_first[POOL_CLASSES];
+static thread::Lock pool_lock;
+static BufferPoolStats pool_stats = {0, 0, 0, 0, POOL_LIMIT};
+
+int64 store_size(int64 sz)
+{
+  if (sz > BUFFER_POOLED)
+    return sz;
+  int64 res = 64;
+  while (res < sz)
+    res *= 2;
+  return res;
+}
+BufferStore* store_alloc(int64 sz)
+{
+  if (sz > BUFFER_POOLED)
+  {
+    BufferStore* store = (BufferStore*) malloc(sizeof(BufferStore) + size_t(sz));
+    if (store)
+      store->pool = -1;
+    return store;
+  }
+  int pool = 0;
+  while ((int64(64) << pool) < sz)
+    pool++;
+  pool_lock.acquire();
+  BufferStore* store = pool_first[pool];
+  if (store)
+  {
+    pool_first[pool] = *(BufferStore**) store->data();
+    pool_stats.retained -= sz;
+    pool_stats.hits++;
+  }
+  else
+    pool_stats.misses++;
+  pool_lock.release();
+  if (store == NULL)
+    store = (BufferStore*) malloc(sizeof(BufferStore) + size_t(sz));
+  if (store)
+    store->pool = pool;
+  return store;
+}
+void store_free(BufferStore* store)
+{
+  if (store->pool >= 0)
+  {
+    int64 sz = int64(64) << store->pool;
+    thread::Lock::Holder locker(&pool_lock);
+    if (pool_stats.retained + sz <= pool_stats.limit)
+    {
+      *(BufferStore**) store->data() = pool_first[store->pool];
+      pool_first[store->pool] = store;
+      pool_stats.retained += sz;
+      return;
+    }
+    pool_stats.dropped++;
+  }
+  free(store);
+}
+
+void store_stats(BufferPoolStats* stats)
+{
+  thread::Lock::Holder locker(&pool_lock);
+  *stats = pool_stats;
+}
+// lowering the limit releases pooled stores, largest first
+void store_limit(int64 limit)
+{
+  thread::Lock::Holder locker(&pool_lock);
+  pool_stats.limit = (limit > 0 ? limit : 0);
+  for (int pool = POOL_CLASSES - 1; pool >= 0 && pool_stats.retained > pool_stats.limit; pool--)
+  {
+    while (pool_first[pool] && pool_stats.retained > pool_stats.limit)
+    {
+      BufferStore* store = pool_first[pool];
+      pool_first[pool] = *(BufferStore**) store->data();
+      pool_stats.retained -= int64(64) << pool;
+      free(store);
+    }
+  }
+}
+
+}
@@ -1 +1,272 @@
-#ifndef __BUFFER
\ No newline at end of file
+#ifndef __API_BUFFER__
+#define __API_BUFFER__
+
+#include <lua/lua.hpp>
+#include <stdlib.h>
+#include "base/types.h"
+#include "ilua/stream.h"
+
+namespace api
+{
+
+// stores of up to BUFFER_POOLED bytes come in power-of-two sizes and are recycled through per-size
+// free lists, so buffers created and collected for every request do not go back to the heap;
+// the memory kept in the lists is capped (see buffer.poollimit)
+#define BUFFER_POOLED     65536
+// larger sizes are refused outright; nothing can allocate them, and growth steps past it overflow
+#define BUFFER_MAXSIZE    (int64(1) << 48)
+
+struct BufferStore;
+// capacity allocated for a request of `sz' bytes
+int64 store_size(int64 sz);
+// `sz' has to be a value returned by store_size
+BufferStore* store_alloc(int64 sz);
+void store_free(BufferStore* store);
+
+struct BufferPoolStats
+{
+  int64 hits;       // stores taken from the pool
+  int64 misses;     // stores allocated from the heap
+  int64 dropped;    // stores freed because the pool was full
+  int64 retained;   // bytes kept in the pool
+  int64 limit;
+};
+void store_stats(BufferPoolStats* stats);
+void store_limit(int64 limit);
+
+// backing store of a buffer, shared with its slices
+// a buffer copies its data before modifying a store that is still referenced by a slice
+struct BufferStore
+{
+  int ref;
+  int pool;   // size class, -1 if the store is not pooled
+  int pad[2]; // keep data 16-byte aligned
+
+  char* data()
+  {
+    return (char*) (this + 1);
+  }
+  void addref()
+  {
+    ref++;
+  }
+  void release()
+  {
+    if (--ref == 0)
+      store_free(this);
+  }
+};
+
+class Buffer : public ilua::Stream
+{
+  int64 alloc_size;
+public:
+  BufferStore* m_store;
+  int64 m_size;
+  int64 m_pos;
+  char* m_data;
+
+  // powers of two up to 64 KB, then grow by half of the current capacity
+  // so that a sequence of appends costs amortized constant time per byte
+  // steps are clamped at BUFFER_MAXSIZE; `sz' above it comes back as is and fails in setcapacity
+  static int64 buf_size(int64 sz, int64 cur = 0)
+  {
+    if (sz > BUFFER_MAXSIZE)
+      return sz;
+    int64 res = (cur < 64 ? 64 : cur);
+    while (res < sz)
+    {
+      int64 step = (res < 65536 ? res : res / 2);
+      res = (res > BUFFER_MAXSIZE - step ? BUFFER_MAXSIZE : res + step);
+    }
+    return (res + 63) & ~int64(63);
+  }
+
+  Buffer(int64 sz = 64)
+    : alloc_size(0)
+    , m_store(NULL)
+    , m_size(0)
+    , m_pos(0)
+    , m_data(NULL)
+  {
+    setcapacity(buf_size(sz));
+  }
+  ~Buffer()
+  {
+    if (m_store)
+      m_store->release();
+  }
+
+  // make room for at least `sz' bytes and make sure the store is not shared with a slice
+  // has to be called before every modification; returns false if out of memory
+  // or `sz' is above BUFFER_MAXSIZE
+  bool reserve(int64 sz)
+  {
+    if (sz > BUFFER_MAXSIZE)
+      return false;
+    if (sz <= alloc_size)
+      return (m_store && m_store->ref > 1 ? setcapacity(alloc_size) : true);
+    return setcapacity(buf_size(sz, alloc_size));
+  }
+  // release unused capacity
+  void shrink()
+  {
+    if (store_size(m_size) < alloc_size)
+      setcapacity(m_size);
+  }
+  bool setcapacity(int64 sz)
+  {
+    if (sz < 0 || sz > BUFFER_MAXSIZE) return false;
+    if (uint64(sz) > uint64(size_t(-1) - sizeof(BufferStore))) return false;
+    sz = store_size(sz);
+    BufferStore* store;
+    if (sz <= BUFFER_POOLED || (m_store && (m_store->ref > 1 || m_store->pool >= 0)))
+    {
+      store = store_alloc(sz);
+      if (store == NULL) return false;
+      if (m_store)
+      {
+        memcpy(store->data(), m_data, size_t(m_size < sz ? m_size : sz));
+        m_store->release();
+      }
+    }
+    else
+    {
+      // realloc can often extend the block in place, avoiding the copy
+      store = (BufferStore*) ::realloc(m_store, sizeof(BufferStore) + size_t(sz));
+      if (store == NULL) return false;
+      store->pool = -1;
+    }
+    store->ref = 1;
+    m_store = store;
+    m_data = store->data();
+    alloc_size = sz;
+    return true;
+  }
+  int64 capacity() const
+  {
+    return alloc_size;
+  }
+
+  char getc()
+  {
+    return (m_pos < m_size ? m_data[m_pos++] : 0);
+  }
+  char const* peek(int* count)
+  {
+    int64 avail = m_size - m_pos;
+    *count = (avail > 0x7FFFFFFF ? 0x7FFFFFFF : int(avail));
+    return (*count > 0 ? m_data + m_pos : NULL);
+  }
+  int putc(char c)
+  {
+    if (!reserve(m_pos + 1))
+      return 0;
+    m_data[m_pos++] = c;
+    if (m_pos > m_size)
+      m_size = m_pos;
+    return 1;
+  }
+
+  int read(void* buf, int count)
+  {
+    if (count > m_size - m_pos)
+      count = int(m_size - m_pos);
+    memcpy(buf, m_data + m_pos, count);
+    m_pos += count;
+    return count;
+  }
+  int write(void const* buf, int count)
+  {
+    if (!reserve(m_pos + count))
+      return 0;
+    memcpy(m_data + m_pos, buf, count);
+    m_pos += count;
+    if (m_pos > m_size)
+      m_size = m_pos;
+    return count;
+  }
+
+  void seek(int64 pos, int rel)
+  {
+    switch (rel)
+    {
+    case SEEK_SET:
+      m_pos = pos;
+      break;
+    case SEEK_CUR:
+      m_pos += pos;
+      break;
+    case SEEK_END:
+      m_pos = m_size + pos;
+      break;
+    }
+    if (m_pos < 0) m_pos = 0;
+    if (m_pos > m_size) m_pos = m_size;
+  }
+  int64 tell() const
+  {
+    return m_pos;
+  }
+  int64 size() const
+  {
+    return m_size;
+  }
+
+  bool eof() const
+  {
+    return m_pos >= m_size;
+  }
+  void resize(int64 newsize)
+  {
+    if (newsize < 0 || !reserve(newsize))
+      return;
+    if (newsize > m_size)
+      memset(m_data + m_size, 0, newsize - m_size);
+    m_size = newsize;
+  }
+
+  int64 copy(Stream* stream, int64 count)
+  {
+    if (count == 0)
+      count = stream->size() - stream->tell();
+    if (!reserve(m_pos + count))
+      return 0;
+    int64 total = 0;
+    while (count > 0)
+    {
+      int chunk = (count > 0x40000000 ? 0x40000000 : int(count));
+      int done = stream->read(m_data + m_pos, chunk);
+      if (done <= 0)
+        break;
+      m_pos += done;
+      total += done;
+      count -= done;
+      if (done < chunk)
+        break;
+    }
+    if (m_pos > m_size)
+      m_size = m_pos;
+    return total;
+  }
+
+  const char* tolstring(size_t* len)
+  {
+    if (len) *len = size_t(m_size);
+    return m_data;
+  }
+};
+
+// reverse the byte order of `count' elements of `size' (2, 4 or 8) bytes in place
+void byteswap_array(void* data, int64 count, int size);
+// element size of the typed array at `index', 0 if it is not one
+int array_elsize(lua_State* L, int index);
+// element type of the typed array at `index' (its position in the list of array type names),
+// -1 if it is not one
+int array_typeof(lua_State* L, int index);
+// push a new zero-filled typed array of `count' elements; NULL (nothing pushed) for an unknown type
+Buffer* array_create(lua_State* L, int type, int64 count);
+
+}
+
+#endif // __API_BUFFER__
@@ -13,7 +13,12 @@ void bind_sync(lua_State* L);
 void bind_utf8(lua_State* L);
 void bind_re(lua_State* L);
 void bind_stream(lua_State* L);
+void bind_array(lua_State* L);
+void bind_zstream(lua_State* L);
+void bind_pipe(lua_State* L);
 void bind_co(lua_State* L);
+void mark_natives(lua_State* L);
+void register_natives(lua_State* L);
 
 // Thread
 
@@ -74,6 +79,11 @@ int Thread::sleep(int time, lua_CFunction cont, int ctx)
   ((Engine*) e)->sleep(this, time);
   return lua_yieldk(L, 0, ctx, cont);
 }
+int Thread::wait(uint32 timeout, lua_CFunction cont, int ctx)
+{
+  ((Engine*) e)->wait(this, timeout);
+  return lua_yieldk(L, 0, ctx, cont);
+}
 void Thread::resume(Object* rc)
 {
   e->lock();
@@ -103,9 +113,27 @@ Engine::Engine()
   , hasBreakpoints(false)
   , hThread(NULL)
   , hasKeepalive(false)
+  , virtualClock(false)
   , L(NULL)
 {
   resetvar();
+
+  add_module_path(String(getAppPath()));
+  WideString env = WideString::getenv(L"ILUA_PATH");
+  if (env.length())
+  {
+    String path(env);
+    int start = 0;
+    for (int i = 0; i <= path.length(); i++)
+    {
+      if (i == path.length() || path[i] == dynlib::pathsep)
+      {
+        if (i > start)
+          add_module_path(path.substring(start, i));
+        start = i + 1;
+      }
+    }
+  }
 }
 Engine::~Engine()
 {
@@ -280,6 +308,7 @@ void Engine::resetvar()
   dbgDepth = 0;
   dbgThread = NULL;
   thread_count = 0;
+  vclock = 0;
 }
 void Engine::start()
 {
@@ -331,7 +360,11 @@ void Engine::start()
   bind_utf8(L);
   bind_re(L);
   bind_stream(L);
+  bind_array(L);
+  bind_zstream(L);
+  bind_pipe(L);
   bind_co(L);
+  register_natives(L);
 
   lua_pushlightuserdata(L, this);
   lua_setfield(L, LUA_REGISTRYINDEX, "ilua_engine");
@@ -353,7 +386,8 @@ void Engine::finish()
     PostMessage(handler, WM_ENGINEHALT, 0, (LPARAM) this);
 
   for (uint32 cur = modules.enumStart(); cur; cur = modules.enumNext(cur))
-    FreeModule(modules.enumGetValue(cur));
+    if (modules.enumGetValue(cur))
+      dynlib::close(modules.enumGetValue(cur));
   modules.clear();
 
   resetvar();
@@ -402,7 +436,9 @@ int Engine::core_thread()
       }
 
       cur_thread = first_thread;
-      if (sleep_first && sleep_first->waketime < GetTickCount())
+      if (sleep_first && first_thread == NULL && virtualClock && sleep_first->waketime > vclock)
+        vclock = sleep_first->waketime;
+      if (sleep_first && sleep_first->waketime <= clock())
         cur_thread = sleep_first;
       if (cur_thread)
       {
@@ -572,11 +608,15 @@ void Engine::terminate(Thread* t)
   t->release();
 }
 void Engine::sleep(Thread* t, uint32 time)
+{
+  sleepuntil(t, clock() + time);
+}
+void Engine::sleepuntil(Thread* t, uint32 waketime)
 {
   dequeue(t);
-  t->waketime = GetTickCount() + time;
+  t->waketime = waketime;
   Thread* pos = sleep_first;
-  while (pos && pos->waketime < t->waketime)
+  while (pos && pos->waketime <= t->waketime)
     pos = pos->next;
   t->next = pos;
   if (pos)
@@ -595,6 +635,23 @@ void Engine::sleep(Thread* t, uint32 time)
     sleep_first = t;
   nonEmptyQueue.set();
 }
+void Engine::wait(Thread* t, uint32 timeout)
+{
+  // a polling thread keeps the run queue busy, which would stop virtual time;
+  // once nothing else is runnable, park it until something else can happen
+  if (!virtualClock || (first_thread && (first_thread != t || t->next)))
+  {
+    enqueue(t);
+    return;
+  }
+  Thread* next = (sleep_first == t ? t->next : sleep_first);
+  if (next && next->waketime < timeout)
+    timeout = next->waketime;
+  if (timeout == uint32(-1))
+    enqueue(t);
+  else
+    sleepuntil(t, timeout);
+}
 void Engine::suspend(Thread* t)
 {
   dequeue(t);
@@ -614,6 +671,56 @@ bool Engine::suspended(Thread* t)
   return false;
 }
 
+void Engine::rebase(uint32 from, uint32 to)
+{
+  for (Thread* t = sleep_first; t; t = t->next)
+    t->waketime = (t->waketime > from ? t->waketime - from : 0) + to;
+}
+void Engine::setVirtualClock(bool enable)
+{
+  if (L)
+  {
+    lock();
+    if (enable && !virtualClock)
+    {
+      vclock = 0;
+      rebase(GetTickCount(), 0);
+    }
+    else if (!enable && virtualClock)
+      rebase(vclock, GetTickCount());
+    virtualClock = enable;
+    unlock();
+  }
+  else
+    virtualClock = enable;
+}
+
+void Engine::add_module_path(char const* path)
+{
+  for (int i = 0; i < modulePath.length(); i++)
+    if (!modulePath[i].icompare(path))
+      return;
+  modulePath.push(path);
+}
+dynlib::Handle Engine::open_module(char const* name)
+{
+  String file(name);
+  if (String::getExtension(file).length() == 0)
+    file += dynlib::extension;
+  if (dynlib::haspath(file))
+    return dynlib::open(file);
+  for (int i = 0; i < modulePath.length(); i++)
+  {
+    String dir(modulePath[i]);
+    if (dir.length() && dir[dir.length() - 1] != '/' && dir[dir.length() - 1] != '\\')
+      dir += dynlib::dirsep;
+    dynlib::Handle lib = dynlib::open(dir + file);
+    if (lib)
+      return lib;
+  }
+  // fall back to the system search order
+  return dynlib::open(file);
+}
 bool Engine::load_module(char const* name, char const* entry)
 {
   lock();
@@ -623,28 +730,35 @@ bool Engine::load_module(char const* name, char const* entry)
     unlock();
     return true;
   }
-  WideString path(name);
-  path.setExtension(L".dll");
-  HMODULE module = LoadLibrary(path);
-  if (module)
+
+  bool success = false;
+  if (ilua::ModuleEntry bf = ilua::StaticModule::find(name, entry))
+  {
+    // linked into the executable, nothing to open
+    modules.set(name, NULL);
+    mark_natives(cur_state());
+    bf(cur_state());
+    register_natives(cur_state());
+    success = true;
+  }
+  else if (dynlib::Handle module = open_module(name))
   {
-    typedef void (*Binder)(lua_State*);
-    Binder bf = (Binder) GetProcAddress(module, entry ? entry : "StartModule");
+    ilua::ModuleEntry bf = (ilua::ModuleEntry) dynlib::symbol(module, entry ? entry : "StartModule");
     if (bf)
     {
-      modules.set(name, module);  
+      modules.set(name, module);
+      mark_natives(cur_state());
       bf(cur_state());
+      register_natives(cur_state());
+      success = true;
     }
     else
-    {
-      FreeLibrary(module);
-      module = NULL;
-    }
+      dynlib::close(module);
   }
 
   unlock();
 
-  return module != NULL;
+  return success;
 }
 void Engine::sethook(lua_State* L)
 {
@@ -8,6 +8,7 @@
 #include "base/types.h"
 #include "base/array.h"
 #include "base/wstring.h"
+#include "base/dynlib.h"
 #include <lua/lua.hpp>
 #include <windows.h>
 
@@ -70,6 +71,9 @@ public:
   void suspend();
   int yield(lua_CFunction cont = NULL, int ctx = 0);
   int sleep(int time, lua_CFunction cont = NULL, int ctx = 0);
+  // same as yield for polling waits; with a virtual clock the thread is parked
+  // until `timeout' or the next sleeping thread is due, whichever comes first
+  int wait(uint32 timeout, lua_CFunction cont = NULL, int ctx = 0);
   void resume(Object* rc = NULL);
   void terminate();
 
@@ -138,10 +142,6 @@ private:
   Thread* cur_thread;
   int cur_counter;
   uint32 thread_count;
-  lua_State* cur_state()
-  {
-    return cur_thread ? cur_thread->state() : L;
-  }
 
   HANDLE hThread;
   thread::Lock luaLock;
@@ -149,7 +149,9 @@ private:
   thread::Event nonEmptyQueue;
   thread::Event bpRun;
 
-  Dictionary<HMODULE> modules;
+  Dictionary<dynlib::Handle> modules;
+  Array<String> modulePath;
+  dynlib::Handle open_module(char const* name);
   HWND handler;
 
   BreakpointHandler bpHandler;
@@ -165,6 +167,10 @@ private:
   int exitCode;
   void dequeue(Thread* t);
 
+  bool virtualClock;
+  uint32 vclock;
+  void rebase(uint32 from, uint32 to);
+
   void sethook(lua_State* L);
 
   void resetvar();
@@ -184,6 +190,8 @@ public:
   bool load_function(lua_State* cL, char const* file);
   ilua::Thread* load(char const* file);
   bool load_module(char const* name, char const* entry = NULL);
+  // directories searched by load_module, in order of addition
+  void add_module_path(char const* path);
 
   lua_State* lock();
   void unlock();
@@ -195,6 +203,11 @@ public:
   {
     return cur_thread;
   }
+  // state of the running Lua thread, or the main state
+  lua_State* cur_state()
+  {
+    return cur_thread ? cur_thread->state() : L;
+  }
 
   void setHandler(HWND hWnd)
   {
@@ -205,6 +218,8 @@ public:
   void enqueue(Thread* t);
   void suspend(Thread* t);
   void sleep(Thread* t, uint32 time);
+  void sleepuntil(Thread* t, uint32 waketime);
+  void wait(Thread* t, uint32 timeout);
   void terminate(Thread* t);
   bool suspended(Thread* t);
   void keepalive()
@@ -212,6 +227,19 @@ public:
     hasKeepalive = true;
   }
 
+  // scheduler time in milliseconds
+  // in virtual clock mode time starts at 0 and jumps straight to the next wake time
+  // whenever every thread is asleep, so timed scripts run deterministically and without delay
+  uint32 clock() const
+  {
+    return virtualClock ? vclock : GetTickCount();
+  }
+  void setVirtualClock(bool enable);
+  bool virtualclock() const
+  {
+    return virtualClock;
+  }
+
   void setBreakpointHandler(BreakpointHandler handler, void* opaque);
   void setBreakpoints(bool bp);
 
@@ -0,0 +1,438 @@
+#include <windows.h>
+#include <lua/lua.hpp>
+#include "base/types.h"
+#include "base/thread.h"
+#include "ilua/ilua.h"
+#include "ilua/stream.h"
+#include "engine.h"
+
+namespace api
+{
+
+// stream.pipe([capacity]) returns a reader and a writer sharing a ring buffer of `capacity' bytes,
+// so a producer and a consumer can run side by side in constant memory
+// native code (e.g. a SlowOperation worker) may use either end as a plain stream; its reads and
+// writes block until they complete. Lua threads are suspended by the engine instead:
+//   reader:read([n]) waits for data and returns up to n bytes, nil once the writer is closed
+//   writer:write(...) waits for room until everything is written, false if the reader is closed
+//   wait([n]) waits until n bytes can be read or written
+//   close() closes an end, which wakes the other one; collecting an end closes it as well
+// the engine thread cannot wait inside the other stream methods (or streams reading through a
+// pipe, like zstream.inflate), so rather than return a short count that reads as the end of the
+// data, they raise a "would block" error unless the whole request (at most the capacity) can be
+// moved at once or the other end is closed; wait() first, or feed the pipe from native code
+
+#define PIPE_CAPACITY     0x10000
+
+enum {PIPE_READ, PIPE_WRITE};
+enum {PARK_READY, PARK_SUSPENDED, PARK_BUSY};
+
+class Pipe
+{
+  thread::Lock m_lock;
+  thread::Event m_ready[2];     // set while a side can make progress, for native threads
+  ilua::Thread* m_waiter[2];    // Lua thread suspended on a side, with the amount it waits for
+  int m_want[2];
+  bool m_closed[2];
+  char* m_data;
+  int m_capacity;
+  int m_head;
+  int m_count;
+  DWORD m_owner;
+  long volatile m_ref;
+
+  int avail(int side) const
+  {
+    return (side == PIPE_READ ? m_count : m_capacity - m_count);
+  }
+  bool ready(int side, int want) const
+  {
+    return avail(side) >= want || m_closed[PIPE_READ] || m_closed[PIPE_WRITE];
+  }
+  // caller holds the lock
+  int transfer(int side, char* buf, int count)
+  {
+    if (m_closed[side] || (side == PIPE_WRITE && m_closed[PIPE_READ]))
+      return 0;
+    int done = 0;
+    while (done < count && avail(side))
+    {
+      int pos = (side == PIPE_READ ? m_head : (m_head + m_count) % m_capacity);
+      int chunk = avail(side);
+      if (chunk > m_capacity - pos)
+        chunk = m_capacity - pos;
+      if (chunk > count - done)
+        chunk = count - done;
+      if (side == PIPE_READ)
+      {
+        memcpy(buf + done, m_data + pos, chunk);
+        m_head = (m_head + chunk) % m_capacity;
+        m_count -= chunk;
+      }
+      else
+      {
+        memcpy(m_data + pos, buf + done, chunk);
+        m_count += chunk;
+      }
+      done += chunk;
+    }
+    return done;
+  }
+  // caller holds the lock; updates the events and takes the Lua threads that can continue, which
+  // have to be resumed after the lock is released (resuming locks the engine)
+  void signal(ilua::Thread** wake)
+  {
+    for (int i = 0; i < 2; i++)
+    {
+      if (ready(i, 1))
+        m_ready[i].set();
+      else
+        m_ready[i].reset();
+      wake[i] = NULL;
+      if (m_waiter[i] && ready(i, m_want[i]))
+      {
+        wake[i] = m_waiter[i];
+        m_waiter[i] = NULL;
+      }
+    }
+  }
+  static void resume(ilua::Thread** wake)
+  {
+    for (int i = 0; i < 2; i++)
+    {
+      if (wake[i])
+      {
+        wake[i]->resume();
+        wake[i]->release();
+      }
+    }
+  }
+public:
+  Pipe(int capacity)
+    : m_capacity(capacity)
+    , m_head(0)
+    , m_count(0)
+    , m_owner(GetCurrentThreadId())
+    , m_ref(2)
+  {
+    m_data = (char*) malloc(capacity);
+    for (int i = 0; i < 2; i++)
+    {
+      m_waiter[i] = NULL;
+      m_want[i] = 0;
+      m_closed[i] = false;
+    }
+    m_ready[PIPE_READ].reset();
+  }
+  ~Pipe()
+  {
+    for (int i = 0; i < 2; i++)
+      if (m_waiter[i])
+        m_waiter[i]->release();
+    free(m_data);
+  }
+  bool valid() const
+  {
+    return m_data != NULL;
+  }
+  // pipes are created on the engine thread, which must never wait for a Lua thread
+  bool canblock() const
+  {
+    return GetCurrentThreadId() != m_owner;
+  }
+  // each end holds one reference
+  void release()
+  {
+    if (InterlockedDecrement(&m_ref) == 0)
+      delete this;
+  }
+
+  // move up to `count' bytes through `side'; with `block' set, waits until everything is moved
+  // or the other end is closed
+  int io(int side, char* buf, int count, bool block)
+  {
+    int done = 0;
+    while (true)
+    {
+      ilua::Thread* wake[2];
+      m_lock.acquire();
+      done += transfer(side, buf + done, count - done);
+      bool stop = (done >= count || m_closed[PIPE_READ] || m_closed[PIPE_WRITE]);
+      signal(wake);
+      m_lock.release();
+      resume(wake);
+      if (stop || !block)
+        return done;
+      m_ready[side].wait();
+    }
+  }
+  void close(int side)
+  {
+    ilua::Thread* wake[2];
+    m_lock.acquire();
+    m_closed[side] = true;
+    if (side == PIPE_READ)
+      m_count = 0;
+    signal(wake);
+    m_lock.release();
+    resume(wake);
+  }
+  int available(int side)
+  {
+    thread::Lock::Holder hold(&m_lock);
+    return avail(side);
+  }
+  bool closed(int side)
+  {
+    thread::Lock::Holder hold(&m_lock);
+    return m_closed[side];
+  }
+  // whether `count' bytes cannot all be moved through `side' right now (reads of more than the
+  // capacity only need a full pipe)
+  bool wouldblock(int side, int count)
+  {
+    thread::Lock::Holder hold(&m_lock);
+    if (side == PIPE_READ && count > m_capacity)
+      count = m_capacity;
+    return !ready(side, count);
+  }
+
+  // suspend the calling Lua thread until `want' bytes can be moved through `side' or either end
+  // is closed; if another thread already waits on this side, the caller has to poll instead
+  int park(lua_State* L, int side, int want)
+  {
+    if (want > m_capacity)
+      want = m_capacity;
+    Thread* t = engine(L)->current_thread();
+    m_lock.acquire();
+    if (ready(side, want))
+    {
+      m_lock.release();
+      return PARK_READY;
+    }
+    if (t == NULL || t->locked || t->state() != L)
+    {
+      m_lock.release();
+      luaL_error(L, "pipe operation would block outside of a thread");
+    }
+    if (m_waiter[side])
+    {
+      m_lock.release();
+      return PARK_BUSY;
+    }
+    m_waiter[side] = t;
+    m_want[side] = want;
+    t->addref();
+    t->suspend();
+    m_lock.release();
+    return PARK_SUSPENDED;
+  }
+};
+
+class PipeEnd : public ilua::Stream
+{
+  Pipe* m_pipe;
+  int m_side;
+  int64 m_pos;
+  Engine* m_engine;
+public:
+  PipeEnd(Pipe* pipe, int side, Engine* e)
+    : m_pipe(pipe)
+    , m_side(side)
+    , m_pos(0)
+    , m_engine(e)
+  {}
+  ~PipeEnd()
+  {
+    m_pipe->close(m_side);
+    m_pipe->release();
+  }
+
+  int transfer(void* buf, int count, bool block)
+  {
+    if (count <= 0)
+      return 0;
+    int done = m_pipe->io(m_side, (char*) buf, count, block);
+    m_pos += done;
+    return done;
+  }
+  int park(lua_State* L, int want)
+  {
+    return m_pipe->park(L, m_side, want);
+  }
+  int available()
+  {
+    return m_pipe->available(m_side);
+  }
+  bool broken()
+  {
+    return m_pipe->closed(m_side) || (m_side == PIPE_WRITE && m_pipe->closed(PIPE_READ));
+  }
+  void close()
+  {
+    m_pipe->close(m_side);
+  }
+
+  // called on the engine thread, so the running Lua state is the caller
+  void checkblock(int count)
+  {
+    if (count > 0 && m_pipe->wouldblock(m_side, count))
+    {
+      lua_State* L = m_engine->cur_state();
+      luaL_error(L, m_side == PIPE_READ ? "pipe read would block" : "pipe write would block");
+    }
+  }
+
+  int read(void* buf, int count)
+  {
+    if (m_side != PIPE_READ)
+      return 0;
+    bool block = m_pipe->canblock();
+    if (!block)
+      checkblock(count);
+    return transfer(buf, count, block);
+  }
+  int write(void const* buf, int count)
+  {
+    if (m_side != PIPE_WRITE)
+      return 0;
+    bool block = m_pipe->canblock();
+    if (!block)
+      checkblock(count);
+    return transfer((void*) buf, count, block);
+  }
+  int64 tell() const
+  {
+    return m_pos;
+  }
+  bool eof() const
+  {
+    return m_side == PIPE_READ && m_pipe->available(PIPE_READ) == 0 && m_pipe->closed(PIPE_WRITE);
+  }
+};
+
+static int pipe_yield(lua_State* L, int how, lua_CFunction cont, int ctx)
+{
+  if (how == PARK_SUSPENDED)
+    return lua_yieldk(L, 0, ctx, cont);
+  return engine(L)->current_thread()->yield(cont, ctx);
+}
+static PipeEnd* pipe_check(lua_State* L, int index)
+{
+  PipeEnd* s = ilua::toobject<PipeEnd>(L, index, "pipe.reader");
+  return (s ? s : ilua::checkobject<PipeEnd>(L, index, "pipe.writer"));
+}
+
+static int pipe_create(lua_State* L)
+{
+  int capacity = luaL_optint(L, 1, PIPE_CAPACITY);
+  luaL_argcheck(L, capacity > 0, 1, "capacity must be positive");
+  Pipe* pipe = new Pipe(capacity);
+  if (!pipe->valid())
+  {
+    pipe->release();
+    pipe->release();
+    luaL_error(L, "not enough memory");
+  }
+  new(L, "pipe.reader") PipeEnd(pipe, PIPE_READ, engine(L));
+  new(L, "pipe.writer") PipeEnd(pipe, PIPE_WRITE, engine(L));
+  return 2;
+}
+static int pipe_read(lua_State* L)
+{
+  PipeEnd* s = ilua::checkobject<PipeEnd>(L, 1, "pipe.reader");
+  int count = luaL_optint(L, 2, PIPE_CAPACITY);
+  luaL_argcheck(L, count > 0, 2, "count must be positive");
+  if (int how = s->park(L, 1))
+    return pipe_yield(L, how, pipe_read, 0);
+  luaL_Buffer b;
+  char* p = luaL_buffinitsize(L, &b, count);
+  int got = s->transfer(p, count, false);
+  luaL_pushresultsize(&b, got);
+  if (got == 0)
+  {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+  }
+  return 1;
+}
+static int pipe_write(lua_State* L)
+{
+  PipeEnd* s = ilua::checkobject<PipeEnd>(L, 1, "pipe.writer");
+  // bytes written before the thread was suspended
+  int done = 0;
+  lua_getctx(L, &done);
+  int n = lua_gettop(L);
+  int offset = 0;
+  for (int i = 2; i <= n; i++)
+  {
+    size_t len;
+    char const* str = ilua::checkbuffer(L, i, &len);
+    while (done < offset + int(len))
+    {
+      done += s->transfer((void*) (str + done - offset), offset + int(len) - done, false);
+      if (done < offset + int(len))
+      {
+        if (s->broken())
+        {
+          lua_pushboolean(L, 0);
+          return 1;
+        }
+        if (int how = s->park(L, 1))
+          return pipe_yield(L, how, pipe_write, done);
+      }
+    }
+    offset += int(len);
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+static int pipe_wait(lua_State* L)
+{
+  PipeEnd* s = pipe_check(L, 1);
+  int want = luaL_optint(L, 2, 1);
+  if (int how = s->park(L, want))
+    return pipe_yield(L, how, pipe_wait, 0);
+  lua_pushinteger(L, s->available());
+  return 1;
+}
+static int pipe_available(lua_State* L)
+{
+  lua_pushinteger(L, pipe_check(L, 1)->available());
+  return 1;
+}
+static int pipe_close(lua_State* L)
+{
+  pipe_check(L, 1)->close();
+  return 0;
+}
+
+void bind_pipe(lua_State* L)
+{
+  ilua::newtype<PipeEnd>(L, "pipe.reader", "stream");
+  ilua::stream_nowrite(L);
+  ilua::settabsn(L, "seek");
+  ilua::settabsn(L, "size");
+  ilua::bindmethod(L, "read", pipe_read);
+  ilua::bindmethod(L, "wait", pipe_wait);
+  ilua::bindmethod(L, "available", pipe_available);
+  ilua::bindmethod(L, "close", pipe_close);
+  lua_pop(L, 2);
+
+  ilua::newtype<PipeEnd>(L, "pipe.writer", "stream");
+  ilua::stream_noread(L);
+  ilua::settabsn(L, "seek");
+  ilua::settabsn(L, "size");
+  ilua::settabsn(L, "resize");
+  ilua::bindmethod(L, "write", pipe_write);
+  ilua::bindmethod(L, "wait", pipe_wait);
+  ilua::bindmethod(L, "available", pipe_available);
+  ilua::bindmethod(L, "close", pipe_close);
+  lua_pop(L, 2);
+
+  ilua::openlib(L, "stream");
+  ilua::bindmethod(L, "pipe", pipe_create);
+  lua_pop(L, 1);
+}
+
+}
@@ -1,5 +1,6 @@
 #include <lua/lua.hpp>
 #include "ilua/ilua.h"
+#include "ilua/stream.h"
 #include "base/string.h"
 #define PCRE_STATIC
 #include "pcre/pcre.h"
@@ -145,7 +146,7 @@ static int re_compile(lua_State* L)
 static int re_dosearch(lua_State* L, ReProg* prog, int pos, int flags)
 {
   size_t length;
-  char const* text = luaL_checklstring(L, 2, &length);
+  char const* text = ilua::checkbuffer(L, 2, &length);
   if (pos < 0)
     pos += length + 1;
   int ovecsize = (prog->captures + 1) * 3;
@@ -200,7 +201,7 @@ static int re_split(lua_State* L)
   ReProg* prog = getprog(L, 1, luaL_optinteger(L, 4, 0));
   int maxsplit = luaL_optinteger(L, 3, 0);
   size_t length;
-  char const* text = luaL_checklstring(L, 2, &length);
+  char const* text = ilua::checkbuffer(L, 2, &length);
 
   int ovecsize = (prog->captures + 1) * 3;
   int* ovector = new int[ovecsize];
@@ -228,7 +229,7 @@ static int re_split(lua_State* L)
 static int re_dofindall(lua_State* L, ReProg* prog, int pos, int flags)
 {
   size_t length;
-  char const* text = luaL_checklstring(L, 2, &length);
+  char const* text = ilua::checkbuffer(L, 2, &length);
   if (pos < 0)
     pos += length + 1;
   int ovecsize = (prog->captures + 1) * 3;
@@ -299,7 +300,7 @@ static int re_finditercb(lua_State* L)
 static int re_dofinditer(lua_State* L, ReProg* prog, int pos, int flags)
 {
   size_t length;
-  char const* text = luaL_checklstring(L, 2, &length);
+  char const* text = ilua::checkbuffer(L, 2, &length);
   if (pos < 0)
     pos += length + 1;
   int ovecsize = (prog->captures + 1) * 3;
@@ -482,7 +483,7 @@ static int re_sub(lua_State* L)
   ReProg* prog = getprog(L, 1, luaL_optinteger(L, 5, RE_LIST));
   int maxcount = luaL_optinteger(L, 4, 0);
   size_t length;
-  char const* text = luaL_checklstring(L, 3, &length);
+  char const* text = ilua::checkbuffer(L, 3, &length);
   int ovecsize = (prog->captures + 1) * 3;
   int* ovector = new int[ovecsize];
   for (int i = 0; i < ovecsize; i++)
@@ -1,82 +1,47 @@
 #include <lua/lua.hpp>
+#include <stdlib.h>
 #include "base/types.h"
 #include "ilua/ilua.h"
 #include "ilua/stream.h"
+#include "buffer.h"
+#include "base/array.h"
+#include "engine.h"
 
 namespace api
 {
 
-class Buffer : public ilua::Stream
+// read-only stream over a block of memory owned by someone else
+class MemoryView : public ilua::Stream
 {
-  int alloc_size;
-public:
-  int m_size;
-  int m_pos;
-  char* m_data;
-
-  static size_t buf_size(int sz)
-  {
-    if (sz < 65536)
-    {
-      size_t res = 1;
-      while (res < sz) res <<= 1;
-      return res;
-    }
-    return (sz + 65535) & (~65535);
-  }
+protected:
+  char const* m_data;
+  int64 m_size;
+  int64 m_pos;
 
-  Buffer(int sz = 64)
-    : m_size(0)
+  MemoryView(char const* data, int64 size)
+    : m_data(data)
+    , m_size(size)
     , m_pos(0)
-    , alloc_size(buf_size(sz))
-  {
-    m_data = new char[alloc_size];
-  }
-  ~Buffer()
-  {
-    delete[] m_data;
-  }
-
-  void realloc(int sz)
-  {
-    if (sz <= alloc_size) return;
-    alloc_size = buf_size(sz);
-    char* temp = new char[alloc_size];
-    memcpy(temp, m_data, m_size);
-    delete[] m_data;
-    m_data = temp;
-  }
-
+  {}
+public:
   char getc()
   {
     return (m_pos < m_size ? m_data[m_pos++] : 0);
   }
-  int putc(char c)
+  char const* peek(int* count)
   {
-    realloc(m_pos + 1);
-    m_data[m_pos++] = c;
-    if (m_pos > m_size)
-      m_size = m_pos;
-    return 1;
+    int64 avail = m_size - m_pos;
+    *count = (avail > 0x7FFFFFFF ? 0x7FFFFFFF : int(avail));
+    return (*count > 0 ? m_data + m_pos : NULL);
   }
-
   int read(void* buf, int count)
   {
     if (count > m_size - m_pos)
-      count = m_size - m_pos;
+      count = int(m_size - m_pos);
     memcpy(buf, m_data + m_pos, count);
     m_pos += count;
     return count;
   }
-  int write(void const* buf, int count)
-  {
-    realloc(m_pos + count);
-    memcpy(m_data + m_pos, buf, count);
-    m_pos += count;
-    if (m_pos > m_size)
-      m_size = m_pos;
-    return count;
-  }
 
   void seek(int64 pos, int rel)
   {
@@ -103,35 +68,98 @@ public:
   {
     return m_size;
   }
-
   bool eof() const
   {
     return m_pos >= m_size;
   }
-  void resize(int64 newsize)
+
+  const char* tolstring(size_t* len)
   {
-    realloc(newsize);
-    if (newsize > m_size)
-      memset(m_data + m_size, 0, newsize - m_size);
-    m_size = newsize;
+    if (len) *len = size_t(m_size);
+    return (m_data ? m_data : "");
   }
+};
+
+// read-only view of a SharedBlock; every view has its own position
+class SharedBuffer : public MemoryView
+{
+public:
+  ilua::SharedBlock* m_block;
 
-  int64 copy(Stream* stream, int64 count)
+  SharedBuffer(ilua::SharedBlock* block)
+    : MemoryView(block->data(), block->size())
+    , m_block(block)
   {
-    if (count == 0)
-      count = stream->size() - stream->tell();
-    realloc(m_pos + count);
-    count = stream->read(m_data + m_pos, count);
-    m_pos += count;
-    if (m_pos > m_size)
-      m_size = m_pos;
-    return count;
+    m_block->addref();
+  }
+  ~SharedBuffer()
+  {
+    m_block->release();
   }
+};
 
-  const char* tolstring(size_t* len)
+// zero-copy range of a buffer; keeps the original contents if the buffer is modified later
+class BufferSlice : public MemoryView
+{
+  BufferStore* m_store;
+public:
+  BufferSlice(BufferStore* store, char const* data, int64 size)
+    : MemoryView(data, size)
+    , m_store(store)
+  {
+    if (m_store)
+      m_store->addref();
+  }
+  ~BufferSlice()
+  {
+    if (m_store)
+      m_store->release();
+  }
+
+  BufferStore* store() const
+  {
+    return m_store;
+  }
+};
+
+// read-only view of a whole file mapped into memory; pages are loaded as they are touched,
+// and the contents are visible to buffer consumers without a copy
+class MappedBuffer : public MemoryView
+{
+public:
+  MappedBuffer(char const* data, int64 size)
+    : MemoryView(data, size)
+  {}
+  ~MappedBuffer()
+  {
+    if (m_data)
+      UnmapViewOfFile(m_data);
+  }
+
+  // returns false if the file cannot be opened or does not fit in the address space
+  static bool map(char const* path, char const** data, int64* size)
   {
-    if (len) *len = m_size;
-    return m_data;
+    HANDLE hFile = CreateFile(WideString(path), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+      FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+      return false;
+    LARGE_INTEGER length;
+    bool ok = (GetFileSizeEx(hFile, &length) && uint64(length.QuadPart) <= size_t(-1));
+    *data = NULL;
+    *size = (ok ? length.QuadPart : 0);
+    if (ok && *size > 0)
+    {
+      // the view keeps the mapping alive after both handles are closed
+      HANDLE hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+      if (hMap)
+      {
+        *data = (char const*) MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(hMap);
+      }
+      ok = (*data != NULL);
+    }
+    CloseHandle(hFile);
+    return ok;
   }
 };
 
@@ -141,6 +169,31 @@ static int stream_read(lua_State* L)
   int n = lua_gettop(L);
   for (int i = 2; i <= n; i++)
   {
+    // buffers (and typed arrays) are filled in place from their position up to their size
+    if (Buffer* buf = ilua::toobject<Buffer>(L, i, "buffer"))
+    {
+      if (!buf->reserve(buf->m_size))
+        luaL_error(L, "not enough memory");
+      int64 total = 0;
+      while (buf->m_pos < buf->m_size)
+      {
+        int64 left = buf->m_size - buf->m_pos;
+        int chunk = (left > 0x40000000 ? 0x40000000 : int(left));
+        int got = stream->read(buf->m_data + buf->m_pos, chunk);
+        buf->m_pos += got;
+        total += got;
+        if (got < chunk)
+          break;
+      }
+      // an array only takes whole elements; the bytes of a partial one are consumed but dropped
+      if (int elsize = array_elsize(L, i))
+      {
+        buf->m_pos -= total % elsize;
+        total -= total % elsize;
+      }
+      lua_pushnumber(L, lua_Number(total));
+      continue;
+    }
     int count = luaL_checkinteger(L, i);
     luaL_Buffer b;
     char* p = luaL_buffinitsize(L, &b, count);
@@ -263,14 +316,31 @@ static int stream_readdouble(lua_State* L)
   }
   return 1;
 }
-static int stream_readstr(lua_State* L)
+static void read_cstring(lua_State* L, ilua::Stream* stream)
 {
-  ilua::Stream* stream = ilua::checkobject<ilua::Stream>(L, 1, "stream");
   luaL_Buffer b;
   luaL_buffinit(L, &b);
+  int avail;
+  while (char const* span = stream->peek(&avail))
+  {
+    char const* end = (char const*) memchr(span, 0, avail);
+    int len = (end ? end - span : avail);
+    luaL_addlstring(&b, span, len);
+    stream->seek(end ? len + 1 : len, SEEK_CUR);
+    if (end)
+    {
+      luaL_pushresult(&b);
+      return;
+    }
+  }
   while (int c = stream->getc())
     luaL_addchar(&b, c);
   luaL_pushresult(&b);
+}
+static int stream_readstr(lua_State* L)
+{
+  ilua::Stream* stream = ilua::checkobject<ilua::Stream>(L, 1, "stream");
+  read_cstring(L, stream);
   return 1;
 }
 static int stream_readbuf(lua_State* L)
@@ -278,6 +348,8 @@ static int stream_readbuf(lua_State* L)
   ilua::Stream* stream = ilua::checkobject<ilua::Stream>(L, 1, "stream");
   size_t size = stream->read32();
   Buffer* buffer = new(L, "buffer") Buffer(size);
+  if (!buffer->reserve(size))
+    luaL_error(L, "not enough memory");
   buffer->m_pos = buffer->m_size = stream->read(buffer->m_data, size);
   return 1;
 }
@@ -327,229 +399,1633 @@ static int stream_writebuf(lua_State* L)
   return 0;
 }
 
-static Buffer* buf_get(lua_State* L, int idx)
+// bulk versions of read16/read32/readfloat/readdouble and the matching writers, plus 64-bit ones:
+// stream:read32array(n[, big[, t]]) reads n values into t (or a new table) and returns it with the
+// number of values read; if t is a buffer or a typed array the values are stored in it as they
+// are, from its position on. stream:write32array(t[, big]) writes the values of a table, or all
+// elements of a buffer. Integers are unsigned; byte order is converted in blocks
+enum {EL_16, EL_32, EL_64, EL_FLOAT, EL_DOUBLE};
+static int const el_sizes[] = {2, 4, 8, 4, 8};
+#define ARRAYIO_BLOCK     16384
+
+static lua_Number el_get(char const* p, int kind)
 {
-  if (Buffer* buf = ilua::toobject<Buffer>(L, idx, "buffer"))
-    return buf;
-  if (lua_isnoneornil(L, idx))
+  switch (kind)
   {
-    Buffer* buf = new(L, "buffer") Buffer();
-    if (lua_gettop(L) > idx)
-      lua_replace(L, idx);
-    return buf;
+  case EL_16:
+    return *(uint16*) p;
+  case EL_32:
+    return *(uint32*) p;
+  case EL_64:
+    return lua_Number(*(uint64*) p);
+  case EL_FLOAT:
+    return *(float*) p;
+  default:
+    return *(double*) p;
   }
-  size_t length;
-  char const* ptr = ilua::tobuffer(L, idx, &length);
-  if (ptr == NULL)
-    luaL_argerror(L, idx, "buffer expected");
-  Buffer* buf = new(L, "buffer") Buffer(length);
-  buf->write(ptr, length);
-  lua_replace(L, idx);
-  return buf;
 }
-
-static int buf_create(lua_State* L)
-{
-  buf_get(L, 1);
-  lua_settop(L, 1);
-  return 1;
-}
-static int buf_tostring(lua_State* L)
+static void el_set(char* p, int kind, lua_Number v)
 {
-  Buffer* buf = buf_get(L, 1);
-  lua_pushlstring(L, buf->m_data, buf->m_size);
-  return 1;
+  switch (kind)
+  {
+  case EL_16:
+    *(uint16*) p = uint16(int64(v));
+    break;
+  case EL_32:
+    *(uint32*) p = uint32(int64(v));
+    break;
+  case EL_64:
+    *(uint64*) p = (v >= 9223372036854775808.0 ? uint64(v) : uint64(int64(v)));
+    break;
+  case EL_FLOAT:
+    *(float*) p = float(v);
+    break;
+  default:
+    *(double*) p = double(v);
+    break;
+  }
 }
-static int buf_concat(lua_State* L)
+static Buffer* arrayio_buffer(lua_State* L, int index, int size)
 {
-  size_t len1, len2;
-  char const* buf1 = ilua::checkbuffer(L, 1, &len1);
-  char const* buf2 = ilua::checkbuffer(L, 1, &len2);
-  Buffer* buf = new(L, "buffer") Buffer(len1 + len2);
-  buf->write(buf1, len1);
-  buf->write(buf2, len2);
-  return 1;
+  Buffer* buf = ilua::toobject<Buffer>(L, index, "buffer");
+  if (buf)
+  {
+    int elsize = array_elsize(L, index);
+    luaL_argcheck(L, elsize == 0 || elsize == size, index, "array element size does not match");
+  }
+  return buf;
 }
-static int buf_length(lua_State* L)
+static int stream_readarray(lua_State* L)
 {
-  size_t len;
-  char const* buf = ilua::checkbuffer(L, 1, &len);
-  lua_pushinteger(L, len);
-  return 1;
+  ilua::Stream* stream = ilua::checkobject<ilua::Stream>(L, 1, "stream");
+  int kind = lua_tointeger(L, lua_upvalueindex(1));
+  int size = el_sizes[kind];
+  int64 n = int64(luaL_checknumber(L, 2));
+  luaL_argcheck(L, n >= 0, 2, "count must not be negative");
+  bool big = (lua_toboolean(L, 3) != 0);
+  int64 got = 0;
+  if (Buffer* buf = arrayio_buffer(L, 4, size))
+  {
+    // n * size must not overflow before reserve gets to refuse it
+    if (n > (BUFFER_MAXSIZE - buf->m_pos) / size || !buf->reserve(buf->m_pos + n * size))
+      luaL_error(L, "not enough memory");
+    char* data = buf->m_data + buf->m_pos;
+    int64 total = 0;
+    while (total < n * size)
+    {
+      int64 left = n * size - total;
+      int chunk = (left > 0x40000000 ? 0x40000000 : int(left));
+      int done = stream->read(data + total, chunk);
+      total += done;
+      if (done < chunk)
+        break;
+    }
+    got = total / size;
+    if (big)
+      byteswap_array(data, got, size);
+    buf->m_pos += got * size;
+    if (buf->m_pos > buf->m_size)
+      buf->m_size = buf->m_pos;
+    lua_settop(L, 4);
+  }
+  else
+  {
+    if (lua_istable(L, 4))
+      lua_settop(L, 4);
+    else
+    {
+      lua_settop(L, 3);
+      lua_createtable(L, int(n < 0x100000 ? n : 0x100000), 0);
+    }
+    double block[ARRAYIO_BLOCK / sizeof(double)];
+    char* tmp = (char*) block;
+    int per = ARRAYIO_BLOCK / size;
+    while (got < n)
+    {
+      int count = (n - got > per ? per : int(n - got));
+      int done = stream->read(tmp, count * size) / size;
+      if (big)
+        byteswap_array(tmp, done, size);
+      for (int i = 0; i < done; i++)
+      {
+        lua_pushnumber(L, el_get(tmp + i * size, kind));
+        lua_rawseti(L, 4, int(got + i + 1));
+      }
+      got += done;
+      if (done < count)
+        break;
+    }
+  }
+  lua_pushnumber(L, lua_Number(got));
+  return 2;
 }
-
-#define RAW_TNIL            0         // 0 bytes
-#define RAW_TBOOLEAN        1         // 1 byte
-#define RAW_TNUMBER         3         // 8 bytes
-#define RAW_TSTRING         4         // 4 bytes + N
-#define RAW_TTABLE          5         // 4 bytes + N pairs of <var> + (<var> metatable)
-#define RAW_TFUNCTION       6         // 4 bytes + N
-#define RAW_TBUFFER         0x0F      // 4 bytes + N
-#define RAW_HASMETATABLE    0x80U
-#define RAW_TREPEAT         0xFFU
-
-static int stream_writer(lua_State* L, const void* p, size_t sz, void* ud)
+static int stream_writearray(lua_State* L)
 {
-  ((ilua::Stream*) ud)->write(p, sz);
+  ilua::Stream* stream = ilua::checkobject<ilua::Stream>(L, 1, "stream");
+  int kind = lua_tointeger(L, lua_upvalueindex(1));
+  int size = el_sizes[kind];
+  bool big = (lua_toboolean(L, 3) != 0);
+  double block[ARRAYIO_BLOCK / sizeof(double)];
+  char* tmp = (char*) block;
+  int per = ARRAYIO_BLOCK / size;
+  if (Buffer* buf = arrayio_buffer(L, 2, size))
+  {
+    int64 total = (buf->m_size / size) * size;
+    for (int64 pos = 0; pos < total;)
+    {
+      int64 left = total - pos;
+      if (!big)
+      {
+        int chunk = (left > 0x40000000 ? 0x40000000 : int(left));
+        if (stream->write(buf->m_data + pos, chunk) != chunk)
+          break;
+        pos += chunk;
+        continue;
+      }
+      int chunk = (left > per * size ? per * size : int(left));
+      memcpy(tmp, buf->m_data + pos, chunk);
+      byteswap_array(tmp, chunk / size, size);
+      if (stream->write(tmp, chunk) != chunk)
+        break;
+      pos += chunk;
+    }
+    return 0;
+  }
+  luaL_checktype(L, 2, LUA_TTABLE);
+  int n = lua_rawlen(L, 2);
+  for (int pos = 0; pos < n;)
+  {
+    int count = (n - pos > per ? per : n - pos);
+    for (int i = 0; i < count; i++)
+    {
+      lua_rawgeti(L, 2, pos + i + 1);
+      el_set(tmp + i * size, kind, lua_tonumber(L, -1));
+      lua_pop(L, 1);
+    }
+    if (big)
+      byteswap_array(tmp, count, size);
+    if (stream->write(tmp, count * size) != count * size)
+      break;
+    pos += count;
+  }
   return 0;
 }
-static int buf_writer(lua_State* L, const void* p, size_t sz, void* ud)
+static void bind_arrayio(lua_State* L, char const* read, char const* write, int kind)
 {
-  luaL_addlstring((luaL_Buffer*) ud, (const char*) p, sz);
-  return 0;
+  lua_pushinteger(L, kind);
+  lua_pushcclosure(L, stream_readarray, 1);
+  lua_setfield(L, -2, read);
+  lua_pushinteger(L, kind);
+  lua_pushcclosure(L, stream_writearray, 1);
+  lua_setfield(L, -2, write);
 }
-struct stream_reader_info
+
+// binary records in a single call
+// stream:unpack(fmt) returns the fields of one record, stream:unpack(fmt, count[, t]) reads up
+// to `count' records into t (or a new table), one table per record or the values themselves if
+// the format has a single field; stream:pack(fmt, ...) writes the arguments, repeating the format
+// while arguments remain
+// format: < little endian (default), > big endian, b/B h/H i/I q/Q signed/unsigned 8, 16, 32 and
+// 64-bit integers, f float, d double, x padding byte, z zero-terminated string, s string with a
+// 32-bit length, c fixed-length string; a number before a code repeats it (c: sets the length)
+struct PackItem
 {
-  ilua::Stream* stream;
-  uint32 remains;
-  char buf[BUFSIZ];
+  char code;
+  bool big;
+  int count;
 };
-static const char* stream_reader(lua_State* L, void* data, size_t* size)
+#define PACK_MAXITEMS     64
+#define PACK_BUFFER       4096
+// records of a fixed size up to this fit the int counts of Stream::read
+#define PACK_MAXSIZE      0x7FFFFFFF
+struct PackFormat
 {
-  stream_reader_info* info = (stream_reader_info*) data;
-  if (info->remains == 0)
-    return NULL;
-  *size = BUFSIZ;
-  if (*size > info->remains)
-    *size = info->remains;
-  *size = info->stream->read(info->buf, *size);
-  if (*size == 0)
-    return NULL;
-  info->remains -= *size;
-  return info->buf;
+  PackItem items[PACK_MAXITEMS];
+  int length;
+  int fields;   // values per record
+  int size;     // bytes per record, -1 if it contains variable-length strings
+};
+static int pack_size(char code)
+{
+  switch (code)
+  {
+  case 'b': case 'B': case 'x':
+    return 1;
+  case 'h': case 'H':
+    return 2;
+  case 'i': case 'I': case 'f':
+    return 4;
+  case 'q': case 'Q': case 'd':
+    return 8;
+  default:
+    return 0;
+  }
 }
-
-static void do_serialize(ilua::Stream* stream, lua_State* L, int index, int cache)
+static void pack_parse(lua_State* L, char const* fmt, PackFormat* pf)
 {
-  switch (lua_type(L, index))
+  bool big = false;
+  pf->length = 0;
+  pf->fields = 0;
+  pf->size = 0;
+  for (; *fmt; fmt++)
   {
-  case LUA_TNIL:
-    stream->putc(RAW_TNIL);
-    break;
-  case LUA_TBOOLEAN:
-    stream->putc(RAW_TBOOLEAN);
-    stream->putc(lua_toboolean(L, index));
-    break;
-  case LUA_TNUMBER:
+    if (*fmt == ' ')
+      continue;
+    if (*fmt == '<' || *fmt == '>')
     {
-      stream->putc(RAW_TNUMBER);
-      lua_Number num = lua_tonumber(L, index);
-      stream->write(&num, 8);
+      big = (*fmt == '>');
+      continue;
+    }
+    int count = 1;
+    if (*fmt >= '0' && *fmt <= '9')
+    {
+      count = 0;
+      while (*fmt >= '0' && *fmt <= '9')
+      {
+        count = count * 10 + (*fmt++ - '0');
+        if (count > 0xFFFFFF)
+          luaL_error(L, "format count is too large");
+      }
+    }
+    char code = *fmt;
+    if (code == 0 || !strchr("bBhHiIqQfdxzsc", code))
+      luaL_error(L, "invalid format option '%c'", code ? code : '?');
+    if (pf->length >= PACK_MAXITEMS)
+      luaL_error(L, "format is too long");
+    PackItem& item = pf->items[pf->length++];
+    item.code = code;
+    item.big = big;
+    item.count = count;
+    if (code == 'c')
+      pf->fields++;
+    else if (code != 'x')
+      pf->fields += count;
+    if (pf->fields > 0xFFFFFF)
+      luaL_error(L, "format count is too large");
+    if (code == 'z' || code == 's')
+      pf->size = -1;
+    else if (pf->size >= 0)
+    {
+      int64 size = pf->size + int64(code == 'c' ? count : count * pack_size(code));
+      pf->size = (size > PACK_MAXSIZE ? -1 : int(size));
     }
+  }
+}
+// push a numeric field stored at `p'
+static void unpack_number(lua_State* L, char code, bool big, char const* p)
+{
+  switch (code)
+  {
+  case 'b':
+    lua_pushinteger(L, *(signed char const*) p);
     break;
-  case LUA_TSTRING:
+  case 'B':
+    lua_pushinteger(L, *(unsigned char const*) p);
+    break;
+  case 'h':
+  case 'H':
     {
-      stream->putc(RAW_TSTRING);
-      size_t len;
-      char const* ptr = lua_tolstring(L, index, &len);
-      stream->write32(len);
-      stream->write(ptr, len);
+      unsigned short v;
+      memcpy(&v, p, 2);
+      if (big) v = _byteswap_ushort(v);
+      lua_pushinteger(L, code == 'h' ? int(short(v)) : int(v));
     }
     break;
-  case LUA_TTABLE:
+  case 'i':
+  case 'I':
+  case 'f':
     {
-      lua_pushvalue(L, index);
-      lua_rawget(L, cache);
-      if (lua_isnumber(L, -1))
+      uint32 v;
+      memcpy(&v, p, 4);
+      if (big) v = _byteswap_ulong(v);
+      if (code == 'f')
       {
-        stream->putc(RAW_TREPEAT);
-        stream->write32(stream->tell() - (int64) lua_tonumber(L, -1));
-        lua_pop(L, 1);
+        float f;
+        memcpy(&f, &v, 4);
+        lua_pushnumber(L, lua_Number(f));
       }
       else
-      {
-        int type = RAW_TTABLE;
-        if (lua_getmetatable(L, index))
-        {
-          lua_pop(L, 1);
-          type |= RAW_HASMETATABLE;
-        }
-        stream->putc(type);
-        lua_pop(L, 1);
-        lua_pushvalue(L, index);
-        lua_pushnumber(L, (lua_Number) stream->tell());
-        lua_rawset(L, cache);
-        uint32 count = 0;
-        lua_pushnil(L);
-        while (lua_next(L, index))
-        {
-          count++;
-          lua_pop(L, 1);
-        }
-        stream->write32(count);
-        lua_pushnil(L);
-        while (lua_next(L, index))
-        {
-          do_serialize(stream, L, lua_gettop(L) - 1, cache);
-          do_serialize(stream, L, lua_gettop(L), cache);
-          lua_pop(L, 1);
-        }
-        if (lua_getmetatable(L, index))
-        {
-          do_serialize(stream, L, lua_gettop(L), cache);
-          lua_pop(L, 1);
-        }
-      }
+        lua_pushnumber(L, code == 'i' ? lua_Number(int32(v)) : lua_Number(v));
     }
     break;
-  case LUA_TFUNCTION:
-    if (lua_iscfunction(L, index))
-      luaL_error(L, "unable to serialize C function");
-    else
+  case 'q':
+  case 'Q':
+  case 'd':
     {
-      lua_pushvalue(L, index);
-      lua_rawget(L, cache);
-      if (lua_isnumber(L, -1))
+      unsigned long long v;
+      memcpy(&v, p, 8);
+      if (big) v = _byteswap_uint64(v);
+      if (code == 'd')
       {
-        stream->putc(RAW_TREPEAT);
-        stream->write32(stream->tell() - (int64) lua_tonumber(L, -1));
-        lua_pop(L, 1);
+        double d;
+        memcpy(&d, &v, 8);
+        lua_pushnumber(L, d);
       }
       else
-      {
-        stream->putc(RAW_TFUNCTION);
-        lua_pop(L, 1);
-        lua_pushvalue(L, index);
-        lua_pushnumber(L, (lua_Number) stream->tell());
-        lua_rawset(L, cache);
-        lua_pushvalue(L, index);
-        luaL_Buffer b;
-        luaL_buffinit(L, &b);
-        int code = lua_dump(L, buf_writer, &b);
-        luaL_pushresult(&b);
-        if (code == 0)
-        {
-          size_t length;
-          char const* ptr = lua_tolstring(L, -1, &length);
-          stream->write32(length);
-          stream->write(ptr, length);
-        }
-        else
-          stream->write32(0);
-        lua_pop(L, 2);
-      }
+        lua_pushnumber(L, code == 'q' ? lua_Number(int64(v)) : lua_Number(v));
     }
     break;
-  case LUA_TUSERDATA:
-    if (Buffer* buf = ilua::toobject<Buffer>(L, index, "buffer"))
+  }
+}
+// push the fields of a fixed-size record stored at `p'
+static void unpack_fixed(lua_State* L, PackFormat* pf, char const* p)
+{
+  for (int i = 0; i < pf->length; i++)
+  {
+    PackItem& item = pf->items[i];
+    if (item.code == 'c')
     {
-      stream->putc(RAW_TBUFFER);
-      stream->write32(buf->m_size);
-      stream->write(buf->m_data, buf->m_size);
-      break;
+      lua_pushlstring(L, p, item.count);
+      p += item.count;
+      continue;
     }
-  default:
-    luaL_error(L, "unable to serialize %s", lua_typename(L, lua_type(L, index)));
+    int size = pack_size(item.code);
+    if (item.code != 'x')
+      for (int j = 0; j < item.count; j++)
+        unpack_number(L, item.code, item.big, p + j * size);
+    p += item.count * size;
   }
 }
-static void do_deserialize(ilua::Stream* stream, lua_State* L, int cache)
+// read one record, returns the number of fields pushed (less than pf->fields if the stream ended)
+static int unpack_record(lua_State* L, ilua::Stream* stream, PackFormat* pf, char* tmp)
 {
-  if (stream->eof())
+  if (pf->size >= 0 && pf->size <= PACK_BUFFER)
   {
-    lua_pushnil(L);
-    return;
-  }
-  uint8 type = stream->getc();
+    int avail;
+    char const* span = stream->peek(&avail);
+    if (span && avail >= pf->size)
+    {
+      unpack_fixed(L, pf, span);
+      stream->seek(pf->size, SEEK_CUR);
+    }
+    else if (stream->read(tmp, pf->size) == pf->size)
+      unpack_fixed(L, pf, tmp);
+    else
+      return 0;
+    return pf->fields;
+  }
+  int pushed = 0;
+  for (int i = 0; i < pf->length; i++)
+  {
+    PackItem& item = pf->items[i];
+    if (item.code == 'c' || item.code == 's')
+    {
+      uint32 length = item.count;
+      if (item.code == 's')
+      {
+        if (stream->read(&length, 4) != 4)
+          return pushed;
+        if (item.big) length = _byteswap_ulong(length);
+        int64 size = stream->size();
+        if ((size > 0 && length > uint64(size - stream->tell())) || length > PACK_MAXSIZE)
+          return pushed;
+      }
+      luaL_Buffer b;
+      char* p = luaL_buffinitsize(L, &b, length);
+      int got = stream->read(p, int(length));
+      luaL_pushresultsize(&b, got);
+      if (got != int(length))
+      {
+        lua_pop(L, 1);
+        return pushed;
+      }
+      pushed++;
+      continue;
+    }
+    for (int j = 0; j < item.count; j++)
+    {
+      if (item.code == 'z')
+      {
+        if (stream->eof())
+          return pushed;
+        read_cstring(L, stream);
+        pushed++;
+        continue;
+      }
+      int size = pack_size(item.code);
+      if (stream->read(tmp, size) != size)
+        return pushed;
+      if (item.code != 'x')
+      {
+        unpack_number(L, item.code, item.big, tmp);
+        pushed++;
+      }
+    }
+  }
+  return pushed;
+}
+static int stream_unpack(lua_State* L)
+{
+  ilua::Stream* stream = ilua::checkobject<ilua::Stream>(L, 1, "stream");
+  PackFormat pf;
+  pack_parse(L, luaL_checkstring(L, 2), &pf);
+  char tmp[PACK_BUFFER];
+  if (lua_isnoneornil(L, 3))
+  {
+    luaL_checkstack(L, pf.fields + 1, "too many fields");
+    int pushed = unpack_record(L, stream, &pf, tmp);
+    if (pushed < pf.fields)
+    {
+      lua_pushnil(L);
+      pushed++;
+    }
+    return pushed;
+  }
+  int count = luaL_checkint(L, 3);
+  luaL_argcheck(L, count >= 0, 3, "count must be non-negative");
+  luaL_checkstack(L, pf.fields + 2, "too many fields");
+  lua_settop(L, 4);
+  if (!lua_istable(L, 4))
+  {
+    int hint = count;
+    int64 size = stream->size();
+    if (pf.size > 0 && size > 0 && (size - stream->tell()) / pf.size < hint)
+      hint = int((size - stream->tell()) / pf.size);
+    lua_createtable(L, hint > 0 ? hint : 0, 0);
+    lua_replace(L, 4);
+  }
+  bool flat = (pf.fields == 1);
+  int done = 0;
+  while (done < count)
+  {
+    // decode as many fixed-size records as the stream exposes in one go
+    int avail;
+    char const* span = (pf.size > 0 ? stream->peek(&avail) : NULL);
+    if (span && avail >= pf.size)
+    {
+      int fit = avail / pf.size;
+      if (fit > count - done)
+        fit = count - done;
+      for (int i = 0; i < fit; i++)
+      {
+        if (!flat)
+          lua_createtable(L, pf.fields, 0);
+        unpack_fixed(L, &pf, span + i * pf.size);
+        if (!flat)
+          for (int j = pf.fields; j >= 1; j--)
+            lua_rawseti(L, 5, j);
+        lua_rawseti(L, 4, ++done);
+      }
+      stream->seek(fit * pf.size, SEEK_CUR);
+      continue;
+    }
+    if (!flat)
+      lua_createtable(L, pf.fields, 0);
+    int pushed = unpack_record(L, stream, &pf, tmp);
+    if (pushed < pf.fields)
+    {
+      lua_settop(L, 4);
+      break;
+    }
+    if (!flat)
+      for (int j = pf.fields; j >= 1; j--)
+        lua_rawseti(L, 5, j);
+    lua_rawseti(L, 4, ++done);
+  }
+  lua_pushinteger(L, done);
+  return 2;
+}
+
+// records are assembled in a small buffer and written out in large pieces
+struct PackOutput
+{
+  ilua::Stream* stream;
+  int used;
+  char data[PACK_BUFFER];
+};
+static void pack_write(PackOutput* out, void const* data, int length)
+{
+  if (out->used + length > PACK_BUFFER)
+  {
+    if (out->used)
+      out->stream->write(out->data, out->used);
+    out->used = 0;
+    if (length >= PACK_BUFFER)
+    {
+      out->stream->write(data, length);
+      return;
+    }
+  }
+  memcpy(out->data + out->used, data, length);
+  out->used += length;
+}
+static int pack_number(lua_State* L, PackOutput* out, char code, bool big, int arg)
+{
+  char p[8];
+  lua_Number value = luaL_checknumber(L, arg);
+  switch (code)
+  {
+  case 'b':
+  case 'B':
+    p[0] = char(int64(value));
+    break;
+  case 'h':
+  case 'H':
+    {
+      unsigned short v = (unsigned short) int64(value);
+      if (big) v = _byteswap_ushort(v);
+      memcpy(p, &v, 2);
+    }
+    break;
+  case 'i':
+  case 'I':
+  case 'f':
+    {
+      uint32 v;
+      if (code == 'f')
+      {
+        float f = float(value);
+        memcpy(&v, &f, 4);
+      }
+      else
+        v = uint32(int64(value));
+      if (big) v = _byteswap_ulong(v);
+      memcpy(p, &v, 4);
+    }
+    break;
+  case 'q':
+  case 'Q':
+  case 'd':
+    {
+      unsigned long long v;
+      if (code == 'd')
+        memcpy(&v, &value, 8);
+      else if (code == 'Q' && value >= 9223372036854775808.0)
+        v = (unsigned long long) value;
+      else
+        v = (unsigned long long) int64(value);
+      if (big) v = _byteswap_uint64(v);
+      memcpy(p, &v, 8);
+    }
+    break;
+  }
+  int size = pack_size(code);
+  pack_write(out, p, size);
+  return size;
+}
+static int stream_pack(lua_State* L)
+{
+  ilua::Stream* stream = ilua::checkobject<ilua::Stream>(L, 1, "stream");
+  PackFormat pf;
+  pack_parse(L, luaL_checkstring(L, 2), &pf);
+  int n = lua_gettop(L);
+  int arg = 3;
+  PackOutput out;
+  out.stream = stream;
+  out.used = 0;
+  static char const zeros[16] = {0};
+  do
+  {
+    for (int i = 0; i < pf.length; i++)
+    {
+      PackItem& item = pf.items[i];
+      if (item.code == 'c')
+      {
+        size_t length;
+        char const* str = luaL_checklstring(L, arg++, &length);
+        if (length > size_t(item.count))
+          length = item.count;
+        pack_write(&out, str, int(length));
+        for (int pad = item.count - int(length); pad > 0; pad -= int(sizeof zeros))
+          pack_write(&out, zeros, pad < int(sizeof zeros) ? pad : int(sizeof zeros));
+        continue;
+      }
+      for (int j = 0; j < item.count; j++)
+      {
+        if (item.code == 'x')
+          pack_write(&out, zeros, 1);
+        else if (item.code == 'z' || item.code == 's')
+        {
+          size_t length;
+          char const* str = luaL_checklstring(L, arg++, &length);
+          if (item.code == 'z')
+            length = strlen(str) + 1;
+          else
+          {
+            uint32 prefix = uint32(length);
+            if (item.big) prefix = _byteswap_ulong(prefix);
+            pack_write(&out, &prefix, 4);
+          }
+          pack_write(&out, str, int(length));
+        }
+        else
+          pack_number(L, &out, item.code, item.big, arg++);
+      }
+    }
+  } while (arg <= n && pf.fields > 0);
+  if (out.used)
+    stream->write(out.data, out.used);
+  return 0;
+}
+
+static Buffer* buf_get(lua_State* L, int idx)
+{
+  if (Buffer* buf = ilua::toobject<Buffer>(L, idx, "buffer"))
+    return buf;
+  if (lua_isnoneornil(L, idx))
+  {
+    Buffer* buf = new(L, "buffer") Buffer();
+    if (lua_gettop(L) > idx)
+      lua_replace(L, idx);
+    return buf;
+  }
+  size_t length;
+  char const* ptr = ilua::tobuffer(L, idx, &length);
+  if (ptr == NULL)
+    luaL_argerror(L, idx, "buffer expected");
+  Buffer* buf = new(L, "buffer") Buffer(length);
+  buf->write(ptr, length);
+  lua_replace(L, idx);
+  return buf;
+}
+
+static int buf_create(lua_State* L)
+{
+  buf_get(L, 1);
+  lua_settop(L, 1);
+  return 1;
+}
+// buffer.poolstats() returns the counters of the store pool
+static int buf_poolstats(lua_State* L)
+{
+  BufferPoolStats stats;
+  store_stats(&stats);
+  lua_createtable(L, 0, 5);
+  lua_pushnumber(L, lua_Number(stats.hits));
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, lua_Number(stats.misses));
+  lua_setfield(L, -2, "misses");
+  lua_pushnumber(L, lua_Number(stats.dropped));
+  lua_setfield(L, -2, "dropped");
+  lua_pushnumber(L, lua_Number(stats.retained));
+  lua_setfield(L, -2, "retained");
+  lua_pushnumber(L, lua_Number(stats.limit));
+  lua_setfield(L, -2, "limit");
+  return 1;
+}
+// buffer.poollimit(bytes) sets how much memory the pool may keep
+static int buf_poollimit(lua_State* L)
+{
+  store_limit(int64(luaL_checknumber(L, 1)));
+  return 0;
+}
+static int buf_tostring(lua_State* L)
+{
+  Buffer* buf = buf_get(L, 1);
+  lua_pushlstring(L, buf->m_data, buf->m_size);
+  return 1;
+}
+static int buf_concat(lua_State* L)
+{
+  size_t len1, len2;
+  char const* buf1 = ilua::checkbuffer(L, 1, &len1);
+  char const* buf2 = ilua::checkbuffer(L, 2, &len2);
+  Buffer* buf = new(L, "buffer") Buffer(len1 + len2);
+  buf->write(buf1, len1);
+  buf->write(buf2, len2);
+  return 1;
+}
+static int buf_reserve(lua_State* L)
+{
+  Buffer* buf = ilua::checkobject<Buffer>(L, 1, "buffer");
+  if (!buf->reserve(int64(luaL_checknumber(L, 2))))
+    luaL_error(L, "not enough memory");
+  lua_pushnumber(L, lua_Number(buf->capacity()));
+  return 1;
+}
+static int buf_shrink(lua_State* L)
+{
+  Buffer* buf = ilua::checkobject<Buffer>(L, 1, "buffer");
+  buf->shrink();
+  lua_pushnumber(L, lua_Number(buf->capacity()));
+  return 1;
+}
+static int buf_capacity(lua_State* L)
+{
+  Buffer* buf = ilua::checkobject<Buffer>(L, 1, "buffer");
+  lua_pushnumber(L, lua_Number(buf->capacity()));
+  return 1;
+}
+static int buf_length(lua_State* L)
+{
+  size_t len;
+  char const* buf = ilua::checkbuffer(L, 1, &len);
+  lua_pushinteger(L, len);
+  return 1;
+}
+
+static int buf_slice(lua_State* L)
+{
+  BufferStore* store;
+  char const* data;
+  int64 size;
+  if (Buffer* buf = ilua::toobject<Buffer>(L, 1, "buffer"))
+  {
+    store = buf->m_store;
+    data = buf->m_data;
+    size = buf->m_size;
+  }
+  else
+  {
+    BufferSlice* slice = ilua::checkobject<BufferSlice>(L, 1, "buffer.slice");
+    store = slice->store();
+    data = slice->tolstring(NULL);
+    size = slice->size();
+  }
+  int64 offset = int64(luaL_optnumber(L, 2, 0));
+  if (offset < 0) offset = 0;
+  if (offset > size) offset = size;
+  int64 length = int64(luaL_optnumber(L, 3, lua_Number(size - offset)));
+  if (length < 0) length = 0;
+  if (length > size - offset) length = size - offset;
+  new(L, "buffer.slice") BufferSlice(store, data ? data + offset : NULL, length);
+  return 1;
+}
+// tostring for the read-only views (slices, mapped files and shared buffers)
+static int view_tostring(lua_State* L)
+{
+  ilua::Stream* view = ilua::checkobject<ilua::Stream>(L, 1, "stream");
+  size_t length;
+  char const* data = view->tolstring(&length);
+  lua_pushlstring(L, data, length);
+  return 1;
+}
+
+// buffer.map(path) returns a read-only buffer over the file's contents, or nil
+static int buf_map(lua_State* L)
+{
+  char const* path = luaL_checkstring(L, 1);
+  char const* data;
+  int64 size;
+  if (MappedBuffer::map(path, &data, &size))
+    new(L, "buffer.mapped") MappedBuffer(data, size);
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
+static int shared_create(lua_State* L)
+{
+  if (ilua::SharedBlock* block = ilua::toshared(L, 1))
+  {
+    new(L, "shared.buffer") SharedBuffer(block);
+    return 1;
+  }
+  size_t length;
+  char const* ptr = ilua::checkbuffer(L, 1, &length);
+  ilua::SharedBlock* block = ilua::SharedBlock::create(ptr, length);
+  if (block == NULL)
+    luaL_error(L, "not enough memory");
+  new(L, "shared.buffer") SharedBuffer(block);
+  block->release();
+  return 1;
+}
+static int shared_refcount(lua_State* L)
+{
+  SharedBuffer* buf = ilua::checkobject<SharedBuffer>(L, 1, "shared.buffer");
+  lua_pushinteger(L, buf->m_block->refcount());
+  return 1;
+}
+
+#define RAW_TNIL            0         // 0 bytes
+#define RAW_TBOOLEAN        1         // 1 byte
+#define RAW_TNUMBER         3         // 8 bytes
+#define RAW_TSTRING         4         // 4 bytes + N
+#define RAW_TTABLE          5         // 4 bytes + N pairs of <var> + (<var> metatable)
+#define RAW_TFUNCTION       6         // 4 bytes + N
+#define RAW_TCLOSURE        7         // 4 bytes + N + 1 byte + N upvalues
+#define RAW_TNATIVE         8         // 4 bytes + N (path)
+#define RAW_TNATIVETABLE    9         // 4 bytes + N (path) + 4 bytes + N pairs of <var>
+#define RAW_TBUFFER         0x0F      // 4 bytes + N
+#define RAW_HASMETATABLE    0x80U
+#define RAW_TREPEAT         0xFFU
+
+#define RAW_UPVALUE         0         // <var>
+#define RAW_UPVALUEJOIN     1         // 4 bytes (function) + 1 byte (upvalue index); v2: varint (id) + 1 byte
+
+// v2 encoding: lengths and counts are LEB128 varints, repeated values are referenced by id
+// in the order they were first written; v1 values can still be read
+#define RAW2_TFALSE         0x10      // 0 bytes
+#define RAW2_TTRUE          0x11      // 0 bytes
+#define RAW2_TINTEGER       0x12      // varint (zigzag)
+#define RAW2_TSTRING        0x13      // varint + N
+#define RAW2_TTABLE         0x14      // varint narr + varint nhash + narr <var> + nhash pairs of <var> + (<var> metatable)
+#define RAW2_TFUNCTION      0x15      // varint + N
+#define RAW2_TCLOSURE       0x16      // varint + N + 1 byte + N upvalues
+#define RAW2_TNATIVE        0x17      // varint + N (path)
+#define RAW2_TNATIVETABLE   0x18      // varint + N (path) + table contents as in RAW2_TTABLE
+#define RAW2_TBUFFER        0x19      // varint + N
+#define RAW2_TSTRINGID      0x1A      // varint + N, assigned an id like tables
+#define RAW2_TARRAY         0x1B      // 1 byte (element type) + varint + N
+#define RAW2_TREF           0x1F      // varint (id)
+
+#define SNAPSHOT_MAGIC      0x504E5349
+#define NATIVE_SEPARATOR    '\x1F'
+#define NATIVE_DEPTH        4
+#define STRING_MINREF       4         // shorter strings are cheaper to repeat than to reference
+#define ILUA_TABLE_NATIVES  "ilua_natives"
+
+static int stream_writer(lua_State* L, const void* p, size_t sz, void* ud)
+{
+  ((ilua::Stream*) ud)->write(p, sz);
+  return 0;
+}
+struct stream_reader_info
+{
+  ilua::Stream* stream;
+  uint32 remains;
+  char buf[BUFSIZ];
+};
+static const char* stream_reader(lua_State* L, void* data, size_t* size)
+{
+  stream_reader_info* info = (stream_reader_info*) data;
+  if (info->remains == 0)
+    return NULL;
+  *size = BUFSIZ;
+  if (*size > info->remains)
+    *size = info->remains;
+  *size = info->stream->read(info->buf, *size);
+  if (*size == 0)
+    return NULL;
+  info->remains -= *size;
+  return info->buf;
+}
+
+// native values (C functions, library tables and type metatables) cannot be serialized,
+// so in snapshot mode they are written by path and looked up again when restoring
+// paths are registered when the engine starts and whenever a module is loaded; tables that
+// existed before the module entry ran and were not native then belong to scripts, and are
+// neither registered nor entered, so snapshots keep storing them by value
+#define ILUA_TABLE_PREVIOUS "ilua_natives_prev"
+
+// pushes the path of the value on top of the stack under the key below it, if the key is a
+// plain string that can be part of one; returns false otherwise
+static bool natives_path(lua_State* L, int path)
+{
+  size_t length;
+  char const* key = (lua_type(L, -2) == LUA_TSTRING ? lua_tolstring(L, -2, &length) : NULL);
+  if (key == NULL || strlen(key) != length || strchr(key, NATIVE_SEPARATOR) ||
+      !(lua_istable(L, -1) || lua_iscfunction(L, -1)))
+    return false;
+  lua_pushfstring(L, "%s%c%s", lua_tostring(L, path), NATIVE_SEPARATOR, key);
+  return true;
+}
+// pops a path and registers the value at `index' (and what it holds) under it
+static void natives_walk(lua_State* L, int natives, int previous, int visited, int index, int depth)
+{
+  index = lua_absindex(L, index);
+  int path = lua_gettop(L);
+  lua_pushvalue(L, index);
+  lua_rawget(L, visited);
+  bool seen = !lua_isnil(L, -1);
+  lua_pop(L, 1);
+  if (!seen)
+  {
+    lua_pushvalue(L, index);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, visited);
+    lua_pushvalue(L, index);
+    lua_rawget(L, natives);
+    bool known = !lua_isnil(L, -1);
+    lua_pop(L, 1);
+    bool script = false;
+    if (!known && previous && lua_istable(L, index))
+    {
+      lua_pushvalue(L, index);
+      lua_rawget(L, previous);
+      script = !lua_isnil(L, -1);
+      lua_pop(L, 1);
+    }
+    if (!known && !script)
+    {
+      lua_pushvalue(L, index);
+      lua_pushvalue(L, path);
+      lua_rawset(L, natives);
+    }
+    // native tables are entered again to pick up functions added to existing libraries
+    if (!script && lua_istable(L, index) && depth < NATIVE_DEPTH)
+    {
+      lua_pushnil(L);
+      while (lua_next(L, index))
+      {
+        if (natives_path(L, path))
+          natives_walk(L, natives, previous, visited, -2, depth + 1);
+        lua_pop(L, 1);
+      }
+    }
+  }
+  lua_pop(L, 1);
+}
+// collects the tables register_natives would reach into the table at `tables'
+static void natives_mark(lua_State* L, int tables, int index, int depth)
+{
+  index = lua_absindex(L, index);
+  int path = lua_gettop(L);
+  lua_pushvalue(L, index);
+  lua_rawget(L, tables);
+  bool seen = !lua_isnil(L, -1);
+  lua_pop(L, 1);
+  if (!seen && lua_istable(L, index))
+  {
+    lua_pushvalue(L, index);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, tables);
+    if (depth < NATIVE_DEPTH)
+    {
+      lua_pushnil(L);
+      while (lua_next(L, index))
+      {
+        if (natives_path(L, path))
+          natives_mark(L, tables, -2, depth + 1);
+        lua_pop(L, 1);
+      }
+    }
+  }
+  lua_pop(L, 1);
+}
+// pushes meta and _G with their paths, so _G is walked first
+static void natives_roots(lua_State* L)
+{
+  lua_getfield(L, LUA_REGISTRYINDEX, ILUA_TABLE_META);
+  lua_pushstring(L, "meta");
+  lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+  lua_pushstring(L, "_G");
+}
+// call before running a module entry, so register_natives can tell its tables from the scripts'
+void mark_natives(lua_State* L)
+{
+  lua_newtable(L);
+  int tables = lua_gettop(L);
+  natives_roots(L);
+  natives_mark(L, tables, -2, 0);
+  natives_mark(L, tables, -2, 0);
+  lua_pop(L, 2);
+  lua_setfield(L, LUA_REGISTRYINDEX, ILUA_TABLE_PREVIOUS);
+}
+void register_natives(lua_State* L)
+{
+  lua_getfield(L, LUA_REGISTRYINDEX, ILUA_TABLE_NATIVES);
+  if (!lua_istable(L, -1))
+  {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushstring(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, ILUA_TABLE_NATIVES);
+  }
+  int natives = lua_gettop(L);
+  // without a mark (when the engine starts) everything reachable is native
+  lua_getfield(L, LUA_REGISTRYINDEX, ILUA_TABLE_PREVIOUS);
+  int previous = (lua_istable(L, -1) ? lua_gettop(L) : 0);
+  lua_newtable(L);
+  int visited = lua_gettop(L);
+  natives_roots(L);
+  natives_walk(L, natives, previous, visited, -2, 0);
+  natives_walk(L, natives, previous, visited, -2, 0);
+  lua_pop(L, 5);
+  lua_pushnil(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, ILUA_TABLE_PREVIOUS);
+}
+static void push_native(lua_State* L, char const* path, size_t length)
+{
+  char const* end = path + length;
+  char const* sep = (char const*) memchr(path, NATIVE_SEPARATOR, length);
+  if (sep == NULL)
+    sep = end;
+  if (sep - path == 2 && !memcmp(path, "_G", 2))
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+  else if (sep - path == 4 && !memcmp(path, "meta", 4))
+    lua_getfield(L, LUA_REGISTRYINDEX, ILUA_TABLE_META);
+  else
+    lua_pushnil(L);
+  while (sep < end && lua_istable(L, -1))
+  {
+    char const* key = sep + 1;
+    sep = (char const*) memchr(key, NATIVE_SEPARATOR, end - key);
+    if (sep == NULL)
+      sep = end;
+    lua_pushlstring(L, key, sep - key);
+    lua_rawget(L, -2);
+    lua_remove(L, -2);
+  }
+  if (sep < end)
+  {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+  }
+}
+
+// state shared by the serializer and the deserializer
+// v1 streams refer to repeated values by byte offset, v2 streams by sequential id;
+// v2 ids are stored as negative keys in the read cache so both can be decoded together
+struct SerialState
+{
+  lua_State* L;
+  ilua::Stream* stream;   // input when reading
+  Buffer* out;            // output when writing
+  ilua::Stream* target;   // stream the output is passed on to as it fills up, or NULL
+  int open;               // placeholders not filled in yet; output cannot be passed on before
+  int cache;              // value -> id when writing, offset or -id -> value when reading
+  int natives;            // native value paths in snapshot mode, otherwise 0
+  uint32 count;           // number of ids assigned so far
+};
+
+// output staged for a target that is not the output buffer itself is passed on in pieces
+// of about this size; a partial result is left in the target if serialization fails
+#define SERIAL_CHUNK      0x10000
+
+static void out_target(SerialState* s, void const* data, int64 size)
+{
+  char const* ptr = (char const*) data;
+  while (size > 0)
+  {
+    int chunk = (size > 0x40000000 ? 0x40000000 : int(size));
+    if (s->target->write(ptr, chunk) != chunk)
+      luaL_error(s->L, "serialize: stream write failed");
+    ptr += chunk;
+    size -= chunk;
+  }
+}
+static void out_flush(SerialState* s)
+{
+  if (s->target == NULL)
+    return;
+  Buffer* out = s->out;
+  out_target(s, out->m_data, out->m_size);
+  out->m_pos = out->m_size = 0;
+}
+static void out_write(SerialState* s, void const* data, size_t size)
+{
+  Buffer* out = s->out;
+  if (s->target && s->open == 0 && out->m_pos + size > SERIAL_CHUNK)
+  {
+    out_flush(s);
+    if (size >= SERIAL_CHUNK)
+    {
+      out_target(s, data, size);
+      return;
+    }
+  }
+  if (!out->reserve(out->m_pos + size))
+    luaL_error(s->L, "not enough memory");
+  memcpy(out->m_data + out->m_pos, data, size);
+  out->m_pos += size;
+  if (out->m_pos > out->m_size)
+    out->m_size = out->m_pos;
+}
+static void out_putc(SerialState* s, uint8 c)
+{
+  out_write(s, &c, 1);
+}
+static int encode_varint(uint8* buf, uint64 value)
+{
+  int length = 0;
+  while (value >= 0x80)
+  {
+    buf[length++] = uint8(value) | 0x80;
+    value >>= 7;
+  }
+  buf[length++] = uint8(value);
+  return length;
+}
+static void out_varint(SerialState* s, uint64 value)
+{
+  uint8 buf[10];
+  out_write(s, buf, encode_varint(buf, value));
+}
+// a length that is only known after the contents are written is stored as a varint padded
+// to a fixed width, so it can be filled in without moving what follows
+#define PLACEHOLDER_SIZE  5
+
+static int64 out_placeholder(SerialState* s)
+{
+  static uint8 const zeros[PLACEHOLDER_SIZE] = {0};
+  out_write(s, zeros, PLACEHOLDER_SIZE);
+  s->open++;
+  return s->out->m_pos - PLACEHOLDER_SIZE;
+}
+static void out_patch(SerialState* s, int64 at, uint64 value)
+{
+  if (value >> (7 * PLACEHOLDER_SIZE))
+    luaL_error(s->L, "serialize: value is too large");
+  uint8* ptr = (uint8*) s->out->m_data + at;
+  for (int i = 0; i < PLACEHOLDER_SIZE - 1; i++, value >>= 7)
+    ptr[i] = uint8(value & 0x7F) | 0x80;
+  ptr[PLACEHOLDER_SIZE - 1] = uint8(value);
+  s->open--;
+}
+static int out_writer(lua_State* L, const void* p, size_t sz, void* ud)
+{
+  out_write((SerialState*) ud, p, sz);
+  return 0;
+}
+
+static bool in_varint(ilua::Stream* stream, uint64* value)
+{
+  uint64 result = 0;
+  int avail;
+  uint8 const* span = (uint8 const*) stream->peek(&avail);
+  if (span && avail >= 10)
+  {
+    for (int i = 0; i < 10; i++)
+    {
+      result |= uint64(span[i] & 0x7F) << (i * 7);
+      if (!(span[i] & 0x80))
+      {
+        stream->seek(i + 1, SEEK_CUR);
+        *value = result;
+        return true;
+      }
+    }
+    return false;
+  }
+  for (int i = 0; i < 10; i++)
+  {
+    uint8 c;
+    if (stream->read(&c, 1) != 1)
+      return false;
+    result |= uint64(c & 0x7F) << (i * 7);
+    if (!(c & 0x80))
+    {
+      *value = result;
+      return true;
+    }
+  }
+  return false;
+}
+// clamp a decoded element count so that corrupt input cannot request huge tables
+static int size_hint(ilua::Stream* stream, uint64 count)
+{
+  int64 size = stream->size();
+  uint64 limit = (size > 0 ? uint64(size - stream->tell()) : 4096);
+  if (limit > 0x7FFFFFFF)
+    limit = 0x7FFFFFFF;
+  return int(count < limit ? count : limit);
+}
+
+static void do_serialize(SerialState* s, int index);
+static bool write_repeat(SerialState* s, int index)
+{
+  lua_State* L = s->L;
+  lua_pushvalue(L, index);
+  lua_rawget(L, s->cache);
+  bool found = (lua_isnumber(L, -1) != 0);
+  if (found)
+  {
+    out_putc(s, RAW2_TREF);
+    out_varint(s, uint32(lua_tointeger(L, -1)));
+  }
+  lua_pop(L, 1);
+  return found;
+}
+static void write_mark(SerialState* s, int index)
+{
+  lua_State* L = s->L;
+  lua_pushvalue(L, index);
+  lua_pushinteger(L, ++s->count);
+  lua_rawset(L, s->cache);
+}
+static bool in_array(lua_State* L, int key, int narr)
+{
+  if (lua_type(L, key) != LUA_TNUMBER)
+    return false;
+  lua_Number n = lua_tonumber(L, key);
+  return n >= 1 && n <= narr && n == lua_Number(int(n));
+}
+// array part 1..#t first, then the remaining pairs; the pairs are counted beforehand so the
+// count can precede them
+static void write_table(SerialState* s, int index)
+{
+  lua_State* L = s->L;
+  int narr = lua_rawlen(L, index);
+  uint64 count = 0;
+  lua_pushnil(L);
+  while (lua_next(L, index))
+  {
+    lua_pop(L, 1);
+    if (!in_array(L, -1, narr))
+      count++;
+  }
+  out_varint(s, narr);
+  out_varint(s, count);
+  for (int i = 1; i <= narr; i++)
+  {
+    lua_rawgeti(L, index, i);
+    do_serialize(s, lua_gettop(L));
+    lua_pop(L, 1);
+  }
+  uint64 nhash = 0;
+  lua_pushnil(L);
+  while (lua_next(L, index))
+  {
+    if (in_array(L, -2, narr))
+    {
+      lua_pop(L, 1);
+      continue;
+    }
+    do_serialize(s, lua_gettop(L) - 1);
+    do_serialize(s, lua_gettop(L));
+    lua_pop(L, 1);
+    nhash++;
+  }
+  if (nhash != count)
+    luaL_error(L, "serialize: table changed while it was written");
+}
+static bool write_native(SerialState* s, int index)
+{
+  lua_State* L = s->L;
+  if (s->natives == 0)
+    return false;
+  lua_pushvalue(L, index);
+  lua_rawget(L, s->natives);
+  if (!lua_isstring(L, -1))
+  {
+    lua_pop(L, 1);
+    return false;
+  }
+  bool table = (lua_istable(L, index) != 0);
+  out_putc(s, table ? RAW2_TNATIVETABLE : RAW2_TNATIVE);
+  write_mark(s, index);
+  size_t length;
+  char const* path = lua_tolstring(L, -1, &length);
+  out_varint(s, length);
+  out_write(s, path, length);
+  lua_pop(L, 1);
+  // library tables may have been extended by scripts, so their contents are stored as well
+  if (table)
+    write_table(s, index);
+  return true;
+}
+static void write_upvalues(SerialState* s, int index)
+{
+  lua_State* L = s->L;
+  int count = 0;
+  while (lua_getupvalue(L, index, count + 1))
+  {
+    lua_pop(L, 1);
+    count++;
+  }
+  lua_pushvalue(L, index);
+  lua_rawget(L, s->cache);
+  uint32 self = uint32(lua_tointeger(L, -1));
+  lua_pop(L, 1);
+  out_putc(s, count);
+  for (int i = 1; i <= count; i++)
+  {
+    // upvalues shared between closures are written once and joined on load
+    lua_pushlightuserdata(L, lua_upvalueid(L, index, i));
+    lua_rawget(L, s->cache);
+    if (lua_isnumber(L, -1))
+    {
+      int64 ref = (int64) lua_tonumber(L, -1);
+      out_putc(s, RAW_UPVALUEJOIN);
+      out_varint(s, uint64(ref / 256));
+      out_putc(s, uint8(ref % 256));
+      lua_pop(L, 1);
+    }
+    else
+    {
+      lua_pop(L, 1);
+      lua_pushlightuserdata(L, lua_upvalueid(L, index, i));
+      lua_pushnumber(L, lua_Number(int64(self) * 256 + i));
+      lua_rawset(L, s->cache);
+      out_putc(s, RAW_UPVALUE);
+      lua_getupvalue(L, index, i);
+      do_serialize(s, lua_gettop(L));
+      lua_pop(L, 1);
+    }
+  }
+}
+
+static void do_serialize(SerialState* s, int index)
+{
+  lua_State* L = s->L;
+  switch (lua_type(L, index))
+  {
+  case LUA_TNIL:
+    out_putc(s, RAW_TNIL);
+    break;
+  case LUA_TBOOLEAN:
+    out_putc(s, lua_toboolean(L, index) ? RAW2_TTRUE : RAW2_TFALSE);
+    break;
+  case LUA_TNUMBER:
+    {
+      lua_Number num = lua_tonumber(L, index);
+      // integral values (except -0) are written as zigzag varints
+      if (num >= -9007199254740992.0 && num <= 9007199254740992.0 &&
+          num == lua_Number(int64(num)) && (num != 0 || 1 / num > 0))
+      {
+        int64 value = int64(num);
+        out_putc(s, RAW2_TINTEGER);
+        out_varint(s, (uint64(value) << 1) ^ uint64(value >> 63));
+      }
+      else
+      {
+        out_putc(s, RAW_TNUMBER);
+        out_write(s, &num, 8);
+      }
+    }
+    break;
+  case LUA_TSTRING:
+    {
+      size_t length;
+      char const* ptr = lua_tolstring(L, index, &length);
+      if (length < STRING_MINREF)
+        out_putc(s, RAW2_TSTRING);
+      else if (write_repeat(s, index))
+        break;
+      else
+      {
+        out_putc(s, RAW2_TSTRINGID);
+        write_mark(s, index);
+      }
+      out_varint(s, length);
+      out_write(s, ptr, length);
+    }
+    break;
+  case LUA_TTABLE:
+    if (!write_repeat(s, index) && !write_native(s, index))
+    {
+      int type = RAW2_TTABLE;
+      if (lua_getmetatable(L, index))
+      {
+        lua_pop(L, 1);
+        type |= RAW_HASMETATABLE;
+      }
+      out_putc(s, type);
+      write_mark(s, index);
+      write_table(s, index);
+      if (lua_getmetatable(L, index))
+      {
+        do_serialize(s, lua_gettop(L));
+        lua_pop(L, 1);
+      }
+    }
+    break;
+  case LUA_TFUNCTION:
+    if (write_repeat(s, index) || write_native(s, index))
+      break;
+    if (lua_iscfunction(L, index))
+      luaL_error(L, "unable to serialize C function");
+    else
+    {
+      out_putc(s, s->natives ? RAW2_TCLOSURE : RAW2_TFUNCTION);
+      write_mark(s, index);
+      // the byte code goes straight to the output, its length is patched in afterwards
+      int64 at = out_placeholder(s);
+      lua_pushvalue(L, index);
+      int code = lua_dump(L, out_writer, s);
+      lua_pop(L, 1);
+      if (code != 0)
+      {
+        s->out->m_pos = s->out->m_size = at + PLACEHOLDER_SIZE;
+        out_patch(s, at, 0);
+      }
+      else
+        out_patch(s, at, uint64(s->out->m_size - at - PLACEHOLDER_SIZE));
+      if (s->natives)
+        write_upvalues(s, index);
+    }
+    break;
+  case LUA_TUSERDATA:
+    if (ilua::iskindof(L, index, "array"))
+    {
+      size_t length;
+      ilua::tobuffer(L, index, &length);
+      if (s->target == NULL && !s->out->reserve(s->out->m_pos + length + 12))
+        luaL_error(L, "not enough memory");
+      char const* data = ilua::tobuffer(L, index, &length);
+      out_putc(s, RAW2_TARRAY);
+      out_putc(s, char(array_typeof(L, index)));
+      out_varint(s, length);
+      out_write(s, data, length);
+      break;
+    }
+    // slices and shared buffers are stored by contents and come back as plain buffers
+    if (ilua::iskindof(L, index, "buffer") || ilua::iskindof(L, index, "buffer.slice") ||
+        ilua::iskindof(L, index, "shared.buffer"))
+    {
+      size_t length;
+      ilua::tobuffer(L, index, &length);
+      // make room first, the value may be the output buffer itself (a temporary one never is)
+      if (s->target == NULL && !s->out->reserve(s->out->m_pos + length + 11))
+        luaL_error(L, "not enough memory");
+      char const* data = ilua::tobuffer(L, index, &length);
+      out_putc(s, RAW2_TBUFFER);
+      out_varint(s, length);
+      out_write(s, data, length);
+      break;
+    }
+  default:
+    luaL_error(L, "unable to serialize %s", lua_typename(L, lua_type(L, index)));
+  }
+}
+
+// remember a v2 value under its id
+static void read_mark(SerialState* s)
+{
+  lua_pushvalue(s->L, -1);
+  lua_rawseti(s->L, s->cache, -int(++s->count));
+}
+// read `length' bytes of byte code and load them as a function (nil on failure)
+static void read_function(SerialState* s, uint32 length)
+{
+  lua_State* L = s->L;
+  int top = lua_gettop(L);
+  stream_reader_info info;
+  info.stream = s->stream;
+  info.remains = length;
+  if (lua_load(L, stream_reader, &info, "=(stream)", "b") != LUA_OK)
+  {
+    lua_settop(L, top);
+    lua_pushnil(L);
+  }
+  // skip whatever the loader left unread by reading it, so sources that cannot seek work too
+  size_t size;
+  while (info.remains && stream_reader(L, &info, &size))
+    ;
+}
+// read a native path and push the value it refers to
+static void read_native(SerialState* s, uint32 length, bool table)
+{
+  lua_State* L = s->L;
+  luaL_Buffer b;
+  char* p = luaL_buffinitsize(L, &b, size_hint(s->stream, length));
+  int got = s->stream->read(p, size_hint(s->stream, length));
+  luaL_pushresultsize(&b, got);
+  size_t plength;
+  char const* path = lua_tolstring(L, -1, &plength);
+  push_native(L, path, plength);
+  // native tables missing from this engine are rebuilt from the stored contents
+  if (table && !lua_istable(L, -1))
+  {
+    lua_pop(L, 1);
+    lua_newtable(L);
+  }
+  lua_remove(L, -2);
+}
+
+// the decoder works without recursion so that it can stop after a bounded number of values
+// and let other threads run; containers being filled stay on the Lua stack, one frame each
+enum {PHASE_ARRAY, PHASE_HASH, PHASE_META, PHASE_UPVALUES};
+struct DecodeFrame
+{
+  int index;          // stack slot of the container
+  int phase;
+  uint64 remaining;   // entries left in the current phase
+  uint64 nhash;       // pairs following the array part
+  int item;           // next array index or upvalue number
+  bool key;           // the key of the current pair is on the stack
+  bool meta;          // a metatable follows the pairs
+  bool v2;
+};
+
+#define DECODE_STEP       4096    // values decoded between yields
+#define DECODE_DEPTH      256     // default nesting limit
+
+struct Deserializer
+{
+  SerialState s;
+  Array<DecodeFrame> frames;
+  int64 start;          // stream position of the first value
+  uint64 values;        // top-level values left to decode
+  uint64 elements;      // values decoded so far
+  uint64 maxElements;   // 0 = unlimited
+  uint64 maxBytes;      // 0 = unlimited
+  int maxDepth;
+};
+
+static void decode_open(Deserializer* d, int phase, uint64 count, uint64 nhash, bool meta, bool v2)
+{
+  lua_State* L = d->s.L;
+  if (d->frames.length() >= d->maxDepth)
+    luaL_error(L, "deserialize: data is nested too deeply");
+  luaL_checkstack(L, 4, "deserialize: data is nested too deeply");
+  DecodeFrame& f = d->frames.push();
+  f.index = lua_gettop(L);
+  f.phase = phase;
+  f.remaining = count;
+  f.nhash = nhash;
+  f.item = 1;
+  f.key = false;
+  f.meta = meta;
+  f.v2 = v2;
+}
+// move on to the next phase once the current one is finished; false when the container is done
+static bool decode_advance(DecodeFrame& f)
+{
+  while (f.remaining == 0)
+  {
+    switch (f.phase)
+    {
+    case PHASE_ARRAY:
+      f.phase = PHASE_HASH;
+      f.remaining = f.nhash;
+      break;
+    case PHASE_HASH:
+      f.phase = PHASE_META;
+      f.remaining = (f.meta ? 1 : 0);
+      break;
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+// store the value on top of the stack into the innermost container
+static void decode_complete(Deserializer* d)
+{
+  lua_State* L = d->s.L;
+  if (d->frames.length() == 0)
+  {
+    d->values--;
+    return;
+  }
+  DecodeFrame& f = d->frames.top();
+  switch (f.phase)
+  {
+  case PHASE_ARRAY:
+    if (!lua_isnil(L, -1))
+      lua_rawseti(L, f.index, f.item);
+    else
+      lua_pop(L, 1);
+    f.item++;
+    break;
+  case PHASE_HASH:
+    if (!f.key)
+    {
+      f.key = true;
+      return;
+    }
+    // nil and NaN keys are dropped
+    if (!lua_isnil(L, -2) && lua_rawequal(L, -2, -2))
+      lua_rawset(L, f.index);
+    else
+      lua_pop(L, 2);
+    f.key = false;
+    break;
+  case PHASE_META:
+    if (lua_istable(L, -1))
+      lua_setmetatable(L, f.index);
+    else
+      lua_pop(L, 1);
+    break;
+  case PHASE_UPVALUES:
+    if (!lua_isfunction(L, f.index) || lua_iscfunction(L, f.index) || !lua_setupvalue(L, f.index, f.item))
+      lua_pop(L, 1);
+    f.item++;
+    break;
+  }
+  f.remaining--;
+}
+// joined upvalues refer to an upvalue of an earlier function; false if a plain value follows
+static bool decode_upvalue(Deserializer* d, DecodeFrame& f)
+{
+  lua_State* L = d->s.L;
+  ilua::Stream* stream = d->s.stream;
+  if (stream->getc() != RAW_UPVALUEJOIN)
+    return false;
+  if (f.v2)
+  {
+    uint64 id = 0;
+    in_varint(stream, &id);
+    lua_rawgeti(L, d->s.cache, -int(id));
+  }
+  else
+  {
+    int64 pos = stream->tell();
+    uint32 offset = stream->read32();
+    lua_rawgeti(L, d->s.cache, int(pos - offset));
+  }
+  int n = (uint8) stream->getc();
+  if (lua_isfunction(L, f.index) && !lua_iscfunction(L, f.index) &&
+      lua_isfunction(L, -1) && !lua_iscfunction(L, -1) &&
+      lua_getupvalue(L, -1, n) && lua_getupvalue(L, f.index, f.item))
+  {
+    lua_pop(L, 2);
+    lua_upvaluejoin(L, f.index, f.item, -1, n);
+  }
+  lua_settop(L, f.index);
+  f.item++;
+  f.remaining--;
+  return true;
+}
+// read one value; containers open a new frame instead of being completed right away
+static void decode_value(Deserializer* d)
+{
+  SerialState* s = &d->s;
+  lua_State* L = s->L;
+  ilua::Stream* stream = s->stream;
+  if (stream->eof())
+  {
+    lua_pushnil(L);
+    decode_complete(d);
+    return;
+  }
+  uint8 type = stream->getc();
   switch (type)
   {
   case RAW_TNIL:
@@ -561,6 +2037,10 @@ static void do_deserialize(ilua::Stream* stream, lua_State* L, int cache)
     else
       lua_pushboolean(L, stream->getc());
     break;
+  case RAW2_TFALSE:
+  case RAW2_TTRUE:
+    lua_pushboolean(L, type == RAW2_TTRUE);
+    break;
   case RAW_TNUMBER:
     {
       lua_Number val;
@@ -570,23 +2050,83 @@ static void do_deserialize(ilua::Stream* stream, lua_State* L, int cache)
         lua_pushnil(L);
     }
     break;
+  case RAW2_TINTEGER:
+    {
+      uint64 value;
+      if (in_varint(stream, &value))
+        lua_pushnumber(L, lua_Number(int64(value >> 1) ^ -int64(value & 1)));
+      else
+        lua_pushnil(L);
+    }
+    break;
   case RAW_TSTRING:
+  case RAW2_TSTRING:
+  case RAW2_TSTRINGID:
+  case RAW_TBUFFER:
+  case RAW2_TBUFFER:
     {
-      size_t count;
-      if (stream->read(&count, 4) == 4)
+      uint64 count = 0;
+      bool valid;
+      if (type == RAW_TSTRING || type == RAW_TBUFFER)
+        valid = (stream->read(&count, 4) == 4);
+      else
+        valid = in_varint(stream, &count);
+      int64 size = stream->size();
+      if (!valid || (size > 0 && count > uint64(size - stream->tell())) || count > 0x7FFFFFFF)
       {
-        luaL_Buffer b;
-        char* p = luaL_buffinitsize(L, &b, count);
-        int got = stream->read(p, count);
-        luaL_pushresultsize(&b, got);
-        if (got != count)
-        {
-          lua_pop(L, 1);
-          lua_pushnil(L);
-        }
+        lua_pushnil(L);
+        if (type == RAW2_TSTRINGID)
+          read_mark(s);
+        break;
       }
-      else
+      if (d->maxBytes && uint64(stream->tell() - d->start) + count > d->maxBytes)
+        luaL_error(L, "deserialize: data exceeds %f bytes", lua_Number(d->maxBytes));
+      if (type == RAW_TBUFFER || type == RAW2_TBUFFER)
+      {
+        Buffer* buf = new(L, "buffer") Buffer();
+        if (!buf->reserve(count))
+          luaL_error(L, "not enough memory");
+        buf->m_size = stream->read(buf->m_data, int(count));
+        break;
+      }
+      luaL_Buffer b;
+      char* p = luaL_buffinitsize(L, &b, size_t(count));
+      int got = stream->read(p, int(count));
+      luaL_pushresultsize(&b, got);
+      if (got != count)
+      {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+      }
+      if (type == RAW2_TSTRINGID)
+        read_mark(s);
+    }
+    break;
+  case RAW2_TARRAY:
+    {
+      int elem = (unsigned char) stream->getc();
+      uint64 count = 0;
+      bool valid = in_varint(stream, &count);
+      int64 size = stream->size();
+      if (!valid || (size > 0 && count > uint64(size - stream->tell())) || count > 0x7FFFFFFF)
+      {
+        lua_pushnil(L);
+        break;
+      }
+      if (d->maxBytes && uint64(stream->tell() - d->start) + count > d->maxBytes)
+        luaL_error(L, "deserialize: data exceeds %f bytes", lua_Number(d->maxBytes));
+      Buffer* buf = array_create(L, elem, 0);
+      if (buf == NULL)
+      {
+        stream->seek(int64(count), SEEK_CUR);
         lua_pushnil(L);
+        break;
+      }
+      int elsize = array_elsize(L, -1);
+      if (!buf->reserve(count))
+        luaL_error(L, "not enough memory");
+      buf->m_size = stream->read(buf->m_data, int(count));
+      buf->m_size -= buf->m_size % elsize;
     }
     break;
   case RAW_TTABLE:
@@ -600,34 +2140,87 @@ static void do_deserialize(ilua::Stream* stream, lua_State* L, int cache)
         break;
       }
       lua_newtable(L);
-      int index = lua_gettop(L);
-      for (uint32 i = 0; i < count && !stream->eof(); i++)
-      {
-        do_deserialize(stream, L, cache);
-        do_deserialize(stream, L, cache);
-        lua_rawset(L, index);
-      }
-      if ((type & RAW_HASMETATABLE) && !stream->eof())
+      // cache before reading the contents so that cycles resolve to this table
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, s->cache, int(offset));
+      decode_open(d, PHASE_HASH, count, 0, (type & RAW_HASMETATABLE) != 0, false);
+    }
+    return;
+  case RAW2_TTABLE:
+  case RAW2_TTABLE | RAW_HASMETATABLE:
+    {
+      uint64 narr, nhash;
+      if (!in_varint(stream, &narr) || !in_varint(stream, &nhash))
       {
-        do_deserialize(stream, L, cache);
-        lua_setmetatable(L, index);
+        lua_pushnil(L);
+        break;
       }
-      lua_pushvalue(L, index);
-      lua_rawseti(L, cache, offset);
+      lua_createtable(L, size_hint(stream, narr), size_hint(stream, nhash));
+      read_mark(s);
+      decode_open(d, PHASE_ARRAY, narr, nhash, (type & RAW_HASMETATABLE) != 0, true);
     }
-    break;
+    return;
   case RAW_TFUNCTION:
+  case RAW_TCLOSURE:
     {
       int64 offset = stream->tell();
-      stream_reader_info info;
-      info.stream = stream;
-      if (stream->read(&info.remains, 4) != 4 || lua_load(L, stream_reader, &info, "=(stream)", "b") != LUA_OK)
+      uint32 length;
+      if (stream->read(&length, 4) == 4)
+        read_function(s, length);
+      else
+        lua_pushnil(L);
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, s->cache, int(offset));
+      if (type == RAW_TCLOSURE)
       {
-        lua_pop(L, 1);
+        decode_open(d, PHASE_UPVALUES, (uint8) stream->getc(), 0, false, false);
+        return;
+      }
+    }
+    break;
+  case RAW2_TFUNCTION:
+  case RAW2_TCLOSURE:
+    {
+      uint64 length;
+      if (in_varint(stream, &length) && length <= 0xFFFFFFFF)
+        read_function(s, uint32(length));
+      else
         lua_pushnil(L);
+      read_mark(s);
+      if (type == RAW2_TCLOSURE)
+      {
+        decode_open(d, PHASE_UPVALUES, (uint8) stream->getc(), 0, false, true);
+        return;
       }
+    }
+    break;
+  case RAW_TNATIVE:
+  case RAW_TNATIVETABLE:
+    {
+      int64 offset = stream->tell();
+      read_native(s, stream->read32(), type == RAW_TNATIVETABLE);
       lua_pushvalue(L, -1);
-      lua_rawseti(L, cache, offset);
+      lua_rawseti(L, s->cache, int(offset));
+      if (type == RAW_TNATIVETABLE)
+      {
+        decode_open(d, PHASE_HASH, stream->read32(), 0, false, false);
+        return;
+      }
+    }
+    break;
+  case RAW2_TNATIVE:
+  case RAW2_TNATIVETABLE:
+    {
+      uint64 length = 0;
+      in_varint(stream, &length);
+      read_native(s, uint32(length), type == RAW2_TNATIVETABLE);
+      read_mark(s);
+      uint64 narr, nhash;
+      if (type == RAW2_TNATIVETABLE && in_varint(stream, &narr) && in_varint(stream, &nhash))
+      {
+        decode_open(d, PHASE_ARRAY, narr, nhash, false, true);
+        return;
+      }
     }
     break;
   case RAW_TREPEAT:
@@ -637,10 +2230,141 @@ static void do_deserialize(ilua::Stream* stream, lua_State* L, int cache)
       if (stream->read(&offset, 4) != 4)
         lua_pushnil(L);
       else
-        lua_rawgeti(L, cache, pos - offset);
+        lua_rawgeti(L, s->cache, int(pos - offset));
     }
     break;
+  case RAW2_TREF:
+    {
+      uint64 id;
+      if (in_varint(stream, &id) && id > 0 && id <= s->count)
+        lua_rawgeti(L, s->cache, -int(id));
+      else
+        lua_pushnil(L);
+    }
+    break;
+  default:
+    lua_pushnil(L);
+    break;
+  }
+  decode_complete(d);
+}
+// decode up to `budget' values; returns true once all top-level values are on the stack
+static bool decode_run(Deserializer* d, int budget)
+{
+  lua_State* L = d->s.L;
+  ilua::Stream* stream = d->s.stream;
+  while (true)
+  {
+    if (d->frames.length())
+    {
+      DecodeFrame& f = d->frames.top();
+      if (!decode_advance(f))
+      {
+        lua_settop(L, f.index);
+        d->frames.pop();
+        decode_complete(d);
+        continue;
+      }
+      if (stream->eof())
+      {
+        // truncated input: keep whatever the container got so far
+        if (f.key)
+          lua_pop(L, 1);
+        f.key = false;
+        f.remaining = f.nhash = 0;
+        f.meta = false;
+        continue;
+      }
+    }
+    else if (d->values == 0)
+      return true;
+    if (budget-- <= 0)
+      return false;
+    if (++d->elements > d->maxElements && d->maxElements)
+      luaL_error(L, "deserialize: data has more than %f elements", lua_Number(d->maxElements));
+    if (d->maxBytes && uint64(stream->tell() - d->start) > d->maxBytes)
+      luaL_error(L, "deserialize: data exceeds %f bytes", lua_Number(d->maxBytes));
+    if (d->frames.length())
+    {
+      DecodeFrame& f = d->frames.top();
+      if (f.phase == PHASE_UPVALUES && decode_upvalue(d, f))
+        continue;
+    }
+    decode_value(d);
+  }
+}
+
+// serialized data is assembled in a buffer: either the destination itself, if it is a buffer
+// positioned at its end, or a temporary one (at `temp') that is passed on to the destination
+// whenever it fills up
+static void serial_begin(SerialState* s, lua_State* L, ilua::Stream* stream, int cache, int natives, int temp)
+{
+  s->L = L;
+  s->stream = NULL;
+  s->target = NULL;
+  s->open = 0;
+  s->cache = cache;
+  s->natives = natives;
+  s->count = 0;
+  s->out = ilua::toobject<Buffer>(L, 1, "buffer");
+  if (s->out == NULL || s->out->m_pos != s->out->m_size)
+  {
+    s->out = new(L, "buffer") Buffer();
+    s->target = stream;
+    lua_replace(L, temp);
+  }
+}
+static void serial_end(SerialState* s)
+{
+  out_flush(s);
+}
+static uint64 limit_field(lua_State* L, int limits, char const* name, uint64 def)
+{
+  lua_getfield(L, limits, name);
+  if (lua_isnumber(L, -1))
+  {
+    lua_Number value = lua_tonumber(L, -1);
+    def = (value > 0 ? uint64(value) : 0);
   }
+  lua_pop(L, 1);
+  return def;
+}
+// pushes the id cache and the decoder state; `limits' is an optional table with
+// depth (default 256), elements and bytes (default unlimited)
+static Deserializer* deserial_begin(lua_State* L, ilua::Stream* stream, int limits, uint64 values)
+{
+  lua_newtable(L);
+  Deserializer* d = ilua::newstruct<Deserializer>(L);
+  d->s.L = L;
+  d->s.stream = stream;
+  d->s.out = NULL;
+  d->s.target = NULL;
+  d->s.open = 0;
+  d->s.cache = lua_gettop(L) - 1;
+  d->s.natives = 0;
+  d->s.count = 0;
+  d->start = stream->tell();
+  d->values = values;
+  d->elements = 0;
+  d->maxDepth = DECODE_DEPTH;
+  d->maxElements = 0;
+  d->maxBytes = 0;
+  if (lua_istable(L, limits))
+  {
+    uint64 depth = limit_field(L, limits, "depth", DECODE_DEPTH);
+    d->maxDepth = (depth > 0x7FFFFFFF ? 0x7FFFFFFF : int(depth));
+    d->maxElements = limit_field(L, limits, "elements", 0);
+    d->maxBytes = limit_field(L, limits, "bytes", 0);
+  }
+  return d;
+}
+// the current thread, if the running C function may yield to it
+static api::Thread* deserial_thread(lua_State* L)
+{
+  api::Thread* t = (api::Thread*) ilua::engine(L)->current_thread();
+  if (t && !t->locked && t->state() == L)
+    return t;
+  return NULL;
 }
 
 static int stream_serialize(lua_State* L)
@@ -648,20 +2372,78 @@ static int stream_serialize(lua_State* L)
   ilua::Stream* stream = ilua::checkobject<ilua::Stream>(L, 1, "stream");
   int n = lua_gettop(L);
   lua_newtable(L);
+  lua_pushnil(L);
+  SerialState s;
+  serial_begin(&s, L, stream, n + 1, 0, n + 2);
   for (int i = 2; i <= n; i++)
-    do_serialize(stream, L, i, n + 1);
+    do_serialize(&s, i);
+  serial_end(&s);
   lua_settop(L, 1);
   return 1;
 }
+// stack: stream, count, limits, cache, decoder state, values
+static int stream_deserialize_cont(lua_State* L)
+{
+  Deserializer* d = (Deserializer*) lua_touserdata(L, 5);
+  d->s.L = L;
+  while (!decode_run(d, DECODE_STEP))
+  {
+    api::Thread* t = deserial_thread(L);
+    if (t)
+      return t->yield(stream_deserialize_cont);
+  }
+  return lua_gettop(L) - 5;
+}
 static int stream_deserialize(lua_State* L)
 {
   ilua::Stream* stream = ilua::checkobject<ilua::Stream>(L, 1, "stream");
   int count = luaL_optint(L, 2, 1);
+  if (count < 0)
+    count = 0;
+  luaL_checkstack(L, count + 8, "too many values");
+  lua_settop(L, 3);
+  deserial_begin(L, stream, 3, count);
+  return stream_deserialize_cont(L);
+}
+
+// write the whole global state (globals, tables and Lua functions with their upvalues)
+static int stream_snapshot(lua_State* L)
+{
+  ilua::Stream* stream = ilua::checkobject<ilua::Stream>(L, 1, "stream");
+  lua_settop(L, 1);
   lua_newtable(L);
-  int cache = lua_gettop(L);
-  for (int i = 0; i < count; i++)
-    do_deserialize(stream, L, cache);
-  return count;
+  lua_getfield(L, LUA_REGISTRYINDEX, ILUA_TABLE_NATIVES);
+  if (!lua_istable(L, 3))
+    luaL_error(L, "native value table is missing");
+  lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+  lua_pushnil(L);
+  SerialState s;
+  serial_begin(&s, L, stream, 2, 3, 5);
+  uint32 magic = SNAPSHOT_MAGIC;
+  out_write(&s, &magic, 4);
+  do_serialize(&s, 4);
+  serial_end(&s);
+  lua_settop(L, 1);
+  return 1;
+}
+// load globals written by snapshot into the current state
+// modules used by the snapshot should be loaded beforehand
+// unlike deserialize, this never yields: other threads would see half-restored globals
+static int stream_restore(lua_State* L)
+{
+  ilua::Stream* stream = ilua::checkobject<ilua::Stream>(L, 1, "stream");
+  lua_settop(L, 2);
+  if (stream->read32() != SNAPSHOT_MAGIC)
+  {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  Deserializer* d = deserial_begin(L, stream, 2, 1);
+  while (!decode_run(d, DECODE_STEP))
+    ;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+  lua_pushboolean(L, lua_rawequal(L, -1, -2));
+  return 1;
 }
 
 static int stream_copy(lua_State* L)
@@ -671,40 +2453,271 @@ static int stream_copy(lua_State* L)
   stream->copy(from, luaL_optinteger(L, 3, 0));
   return 0;
 }
+// stream:printf(fmt, ...) formats like string.format, but writes straight into the stream in large
+// pieces instead of building a string; parsed formats are cached by their string
+#define PRINTF_CACHE      "ilua_printf"
+#define PRINTF_SPEC       16
+#define PRINTF_ITEM       512   // longest single conversion, as in lstrlib
+struct PrintfItem
+{
+  char conv;    // 0 for literal text
+  int start;    // literal text in the format string
+  int length;
+  char spec[PRINTF_SPEC];
+};
+struct PrintfFormat
+{
+  int count;
+  PrintfItem items[1];
+};
+static char const* printf_spec(lua_State* L, char const* p, PrintfItem* item)
+{
+  static char const flags[] = "-+ #0";
+  char const* start = p;
+  while (*p && strchr(flags, *p))
+    p++;
+  if (p - start > int(sizeof flags) - 1)
+    luaL_error(L, "invalid format (repeated flags)");
+  if (s_isdigit(*p)) p++;
+  if (s_isdigit(*p)) p++;
+  if (*p == '.')
+  {
+    p++;
+    if (s_isdigit(*p)) p++;
+    if (s_isdigit(*p)) p++;
+  }
+  if (s_isdigit(*p))
+    luaL_error(L, "invalid format (width or precision too long)");
+  if (*p == 0 || !strchr("cdiouxXeEfgGqs", *p))
+    luaL_error(L, "invalid option '%%%c' to 'format'", *p);
+  item->conv = *p;
+  item->start = 0;
+  item->length = 0;
+  char* spec = item->spec;
+  *spec++ = '%';
+  memcpy(spec, start, p - start);
+  spec += p - start;
+  if (strchr("diouxX", *p))
+  {
+    *spec++ = 'l';
+    *spec++ = 'l';
+  }
+  *spec++ = *p;
+  *spec = 0;
+  return p + 1;
+}
+// splits the format into literal runs and conversions; only counts them if `items' is NULL
+static int printf_parse(lua_State* L, char const* fmt, size_t length, PrintfItem* items)
+{
+  char const* end = fmt + length;
+  char const* p = fmt;
+  int count = 0;
+  while (p < end)
+  {
+    PrintfItem item;
+    if (*p != '%' || p[1] == '%')
+    {
+      char const* start = (*p == '%' ? p + 1 : p);
+      p = (char const*) memchr(start + 1, '%', end - start - 1);
+      if (p == NULL)
+        p = end;
+      item.conv = 0;
+      item.start = start - fmt;
+      item.length = p - start;
+    }
+    else
+      p = printf_spec(L, p + 1, &item);
+    if (items)
+      items[count] = item;
+    count++;
+  }
+  return count;
+}
+// leaves the parsed format on the stack
+static PrintfFormat* printf_compile(lua_State* L, int pos)
+{
+  size_t length;
+  char const* fmt = luaL_checklstring(L, pos, &length);
+  lua_getfield(L, LUA_REGISTRYINDEX, PRINTF_CACHE);
+  lua_pushvalue(L, pos);
+  lua_rawget(L, -2);
+  PrintfFormat* pf = (PrintfFormat*) lua_touserdata(L, -1);
+  if (pf == NULL)
+  {
+    lua_pop(L, 1);
+    int count = printf_parse(L, fmt, length, NULL);
+    pf = (PrintfFormat*) lua_newuserdata(L, sizeof(PrintfFormat) + (count ? count - 1 : 0) * sizeof(PrintfItem));
+    pf->count = printf_parse(L, fmt, length, pf->items);
+    lua_pushvalue(L, pos);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+  }
+  lua_remove(L, -2);
+  return pf;
+}
+static void printf_quoted(lua_State* L, PackOutput* out, int arg)
+{
+  size_t length;
+  char const* s = luaL_checklstring(L, arg, &length);
+  char const* end = s + length;
+  pack_write(out, "\"", 1);
+  while (s < end)
+  {
+    char const* run = s;
+    while (s < end && *s != '"' && *s != '\\' && *s != '\n' && *s != 0 && !s_iscntrl(*s))
+      s++;
+    if (s > run)
+      pack_write(out, run, s - run);
+    if (s >= end)
+      break;
+    char buf[8];
+    int len;
+    if (*s == '"' || *s == '\\' || *s == '\n')
+    {
+      buf[0] = '\\';
+      buf[1] = *s;
+      len = 2;
+    }
+    else if (s + 1 < end && s_isdigit(s[1]))
+      len = sprintf(buf, "\\%03d", int(uint8(*s)));
+    else
+      len = sprintf(buf, "\\%d", int(uint8(*s)));
+    pack_write(out, buf, len);
+    s++;
+  }
+  pack_write(out, "\"", 1);
+}
 static int stream_printf(lua_State* L)
 {
   ilua::Stream* stream = ilua::checkobject<ilua::Stream>(L, 1, "stream");
-  int nargs = lua_gettop(L) - 1;
-  lua_getglobal(L, "string");
-  lua_getfield(L, -1, "format");
-  lua_insert(L, 2);
-  lua_pop(L, 1);
-  ilua::lcall(L, nargs, 1);
-  size_t length;
-  char const* str = lua_tolstring(L, 2, &length);
-  stream->write(str, length);
+  int top = lua_gettop(L);
+  PrintfFormat* pf = printf_compile(L, 2);
+  char const* fmt = lua_tostring(L, 2);
+  PackOutput out;
+  out.stream = stream;
+  out.used = 0;
+  char buf[PRINTF_ITEM];
+  int arg = 2;
+  for (int i = 0; i < pf->count; i++)
+  {
+    PrintfItem* item = &pf->items[i];
+    if (item->conv == 0)
+    {
+      pack_write(&out, fmt + item->start, item->length);
+      continue;
+    }
+    if (++arg > top)
+      luaL_argerror(L, arg, "no value");
+    int len = 0;
+    switch (item->conv)
+    {
+    case 'c':
+      len = sprintf(buf, item->spec, luaL_checkint(L, arg));
+      break;
+    case 'd':
+    case 'i':
+      {
+        lua_Number n = luaL_checknumber(L, arg);
+        long long v = (long long) n;
+        luaL_argcheck(L, lua_Number(v) == n, arg, "not a number in proper range");
+        len = sprintf(buf, item->spec, v);
+      }
+      break;
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+      {
+        lua_Number n = luaL_checknumber(L, arg);
+        unsigned long long v = (unsigned long long) n;
+        luaL_argcheck(L, n >= 0 && lua_Number(v) == n, arg, "not a non-negative number in proper range");
+        len = sprintf(buf, item->spec, v);
+      }
+      break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'g':
+    case 'G':
+      len = sprintf(buf, item->spec, double(luaL_checknumber(L, arg)));
+      break;
+    case 'q':
+      printf_quoted(L, &out, arg);
+      break;
+    case 's':
+      {
+        size_t length;
+        char const* s = luaL_tolstring(L, arg, &length);
+        if (!strchr(item->spec, '.') && length >= 100)
+          pack_write(&out, s, length);
+        else
+        {
+          luaL_argcheck(L, length == strlen(s), arg, "string contains zeros");
+          len = sprintf(buf, item->spec, s);
+        }
+        lua_pop(L, 1);
+      }
+      break;
+    }
+    if (len > 0)
+      pack_write(&out, buf, len);
+  }
+  if (out.used)
+    stream->write(out.data, out.used);
   return 0;
 }
 
+// consume the second half of a \r\n or \n\r pair
+static void skip_eol(ilua::Stream* stream, int c)
+{
+  int64 pos = stream->tell();
+  int nc = stream->getc();
+  if ((nc != '\r' && nc != '\n') || nc == c)
+    stream->seek(pos, SEEK_SET);
+}
 static int stream_getline(lua_State* L)
 {
   ilua::Stream* stream = ilua::checkobject<ilua::Stream>(L, 1, "stream");
   int count = 0;
   luaL_Buffer b;
   luaL_buffinit(L, &b);
-  while (int c = stream->getc())
+  while (true)
   {
-    count++;
-    if (c != '\r' && c != '\n')
-      luaL_addchar(&b, c);
-    else
+    int avail;
+    char const* span = stream->peek(&avail);
+    if (span == NULL)
     {
-      int pos = stream->tell();
-      int nc = stream->getc();
-      if ((nc != '\r' && nc != '\n') || nc == c)
-        stream->seek(pos, SEEK_SET);
-      break;
+      int c = stream->getc();
+      if (c == 0)
+        break;
+      count++;
+      if (c != '\r' && c != '\n')
+        luaL_addchar(&b, c);
+      else
+      {
+        skip_eol(stream, c);
+        break;
+      }
+      continue;
+    }
+    int len = 0;
+    while (len < avail && span[len] != '\n' && span[len] != '\r' && span[len] != 0)
+      len++;
+    luaL_addlstring(&b, span, len);
+    count += len;
+    if (len == avail)
+    {
+      stream->seek(len, SEEK_CUR);
+      continue;
+    }
+    int c = span[len];
+    stream->seek(len + 1, SEEK_CUR);
+    if (c)
+    {
+      count++;
+      skip_eol(stream, c);
     }
+    break;
   }
   luaL_pushresult(&b);
   if (count == 0)
@@ -729,15 +2742,65 @@ static int stream_flush(lua_State* L)
   return 0;
 }
 
+// wrappers created from Lua keep the source referenced (in their user value) and pass pending
+// writes on when collected; the source is always collected after the wrapper
+class LuaBufferedStream : public ilua::BufferedStream
+{
+public:
+  LuaBufferedStream(ilua::Stream* stream, int readSize, int writeSize)
+    : ilua::BufferedStream(stream, readSize, writeSize)
+  {}
+  ~LuaBufferedStream()
+  {
+    flush();
+  }
+};
+static int stream_buffered(lua_State* L)
+{
+  ilua::Stream* stream = ilua::checkobject<ilua::Stream>(L, 1, "stream");
+  int readSize = luaL_optint(L, 2, 65536);
+  int writeSize = luaL_optint(L, 3, readSize);
+  new(L, "stream.buffered") LuaBufferedStream(stream, readSize, writeSize);
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_setuservalue(L, -2);
+  return 1;
+}
+static int buffered_source(lua_State* L)
+{
+  ilua::checkobject<LuaBufferedStream>(L, 1, "stream.buffered");
+  lua_getuservalue(L, 1);
+  lua_rawgeti(L, -1, 1);
+  return 1;
+}
+
 static void push_buffer(lua_State* L, void const* data, size_t length)
 {
   Buffer* buf = new(L, "buffer") Buffer(length);
+  if (!buf->reserve(length))
+    luaL_error(L, "not enough memory");
   memcpy(buf->m_data, data, length);
   buf->m_size = length;
 }
+static void push_shared(lua_State* L, ilua::SharedBlock* block)
+{
+  new(L, "shared.buffer") SharedBuffer(block);
+}
+static ilua::SharedBlock* to_shared(lua_State* L, int index)
+{
+  SharedBuffer* buf = ilua::toobject<SharedBuffer>(L, index, "shared.buffer");
+  return (buf ? buf->m_block : NULL);
+}
 
 void bind_stream(lua_State* L)
 {
+  lua_newtable(L);
+  lua_newtable(L);
+  ilua::settabss(L, "__mode", "kv");
+  lua_setmetatable(L, -2);
+  lua_setfield(L, LUA_REGISTRYINDEX, PRINTF_CACHE);
+
   ilua::newtype<ilua::Stream>(L, "stream", "object");
   ilua::bindmethod(L, "read", stream_read);
   ilua::bindmethod(L, "write", stream_write);
@@ -760,8 +2823,17 @@ void bind_stream(lua_State* L)
   ilua::bindmethod(L, "writedouble", stream_writedouble);
   ilua::bindmethod(L, "writestr", stream_writestr);
   ilua::bindmethod(L, "writebuf", stream_writebuf);
+  bind_arrayio(L, "read16array", "write16array", EL_16);
+  bind_arrayio(L, "read32array", "write32array", EL_32);
+  bind_arrayio(L, "read64array", "write64array", EL_64);
+  bind_arrayio(L, "readfloatarray", "writefloatarray", EL_FLOAT);
+  bind_arrayio(L, "readdoublearray", "writedoublearray", EL_DOUBLE);
+  ilua::bindmethod(L, "unpack", stream_unpack);
+  ilua::bindmethod(L, "pack", stream_pack);
   ilua::bindmethod(L, "serialize", stream_serialize);
   ilua::bindmethod(L, "deserialize", stream_deserialize);
+  ilua::bindmethod(L, "snapshot", stream_snapshot);
+  ilua::bindmethod(L, "restore", stream_restore);
   ilua::bindmethod(L, "copy", stream_copy);
   ilua::bindmethod(L, "printf", stream_printf);
   ilua::bindmethod(L, "getline", stream_getline);
@@ -771,17 +2843,61 @@ void bind_stream(lua_State* L)
 
   ilua::newtype<Buffer>(L, "buffer", "stream");
   ilua::bindmethod(L, "tostring", buf_tostring);
+  ilua::bindmethod(L, "reserve", buf_reserve);
+  ilua::bindmethod(L, "shrink", buf_shrink);
+  ilua::bindmethod(L, "capacity", buf_capacity);
+  ilua::bindmethod(L, "slice", buf_slice);
   lua_pop(L, 1);
   ilua::bindmethod(L, "__tostring", buf_tostring);
   ilua::bindmethod(L, "__concat", buf_concat);
   ilua::bindmethod(L, "__len", buf_length);
   lua_pop(L, 1);
 
+  ilua::newtype<BufferSlice>(L, "buffer.slice", "stream");
+  ilua::stream_nowrite(L);
+  ilua::bindmethod(L, "tostring", view_tostring);
+  ilua::bindmethod(L, "slice", buf_slice);
+  lua_pop(L, 1);
+  ilua::bindmethod(L, "__tostring", view_tostring);
+  ilua::bindmethod(L, "__concat", buf_concat);
+  ilua::bindmethod(L, "__len", buf_length);
+  lua_pop(L, 1);
+
+  ilua::newtype<MappedBuffer>(L, "buffer.mapped", "stream");
+  ilua::stream_nowrite(L);
+  ilua::bindmethod(L, "tostring", view_tostring);
+  lua_pop(L, 1);
+  ilua::bindmethod(L, "__tostring", view_tostring);
+  ilua::bindmethod(L, "__concat", buf_concat);
+  ilua::bindmethod(L, "__len", buf_length);
+  lua_pop(L, 1);
+
   ilua::openlib(L, "buffer");
   ilua::bindmethod(L, "create", buf_create);
+  ilua::bindmethod(L, "map", buf_map);
+  ilua::bindmethod(L, "poolstats", buf_poolstats);
+  ilua::bindmethod(L, "poollimit", buf_poollimit);
   lua_pop(L, 1);
 
+  ilua::newtype<SharedBuffer>(L, "shared.buffer", "stream");
+  ilua::stream_nowrite(L);
+  ilua::bindmethod(L, "tostring", view_tostring);
+  ilua::bindmethod(L, "refcount", shared_refcount);
+  lua_pop(L, 1);
+  ilua::bindmethod(L, "__tostring", view_tostring);
+  ilua::bindmethod(L, "__len", buf_length);
+  lua_pop(L, 1);
+
+  ilua::openlib(L, "shared");
+  ilua::bindmethod(L, "buffer", shared_create);
+  lua_pop(L, 1);
+
+  ilua::newtype<LuaBufferedStream>(L, "stream.buffered", "stream");
+  ilua::bindmethod(L, "source", buffered_source);
+  lua_pop(L, 2);
+
   ilua::openlib(L, "stream");
+  ilua::bindmethod(L, "buffered", stream_buffered);
   ilua::settabsi(L, "SEEK_SET", 0);
   ilua::settabsi(L, "SEEK_CUR", 1);
   ilua::settabsi(L, "SEEK_END", 2);
@@ -789,6 +2905,10 @@ void bind_stream(lua_State* L)
 
   lua_pushlightuserdata(L, push_buffer);
   lua_setfield(L, LUA_REGISTRYINDEX, "ilua_push_buffer");
+  lua_pushlightuserdata(L, push_shared);
+  lua_setfield(L, LUA_REGISTRYINDEX, "ilua_push_shared");
+  lua_pushlightuserdata(L, to_shared);
+  lua_setfield(L, LUA_REGISTRYINDEX, "ilua_to_shared");
 }
 
 }
@@ -37,13 +37,14 @@ static int sync_newevent(lua_State* L)
 }
 static int sync_wait(lua_State* L)
 {
+  Engine* e = engine(L);
   int count = lua_gettop(L);
   uint32 timeout = -1;
-  uint32 curtime = GetTickCount();
+  uint32 curtime = e->clock();
   if (lua_getctx(L, (int*) &timeout) != LUA_YIELD && lua_isnumber(L, count))
     timeout = curtime + uint32(lua_tonumber(L, count--) * 1000.0);
 
-  if (curtime < timeout)
+  if (curtime >= timeout)
   {
     lua_pushboolean(L, 0);
     return 1;
@@ -59,7 +60,7 @@ static int sync_wait(lua_State* L)
     if (!lua_toboolean(L, -1))
     {
       lua_settop(L, count);
-      return engine(L)->current_thread()->yield(sync_wait, timeout);
+      return e->current_thread()->wait(timeout, sync_wait, timeout);
     }
   }
   lua_pushboolean(L, 1);
@@ -0,0 +1,329 @@
+#include <windows.h>
+#include <lua/lua.hpp>
+#include "base/types.h"
+#include "base/gzmemory.h"
+#include "zlib/zlib.h"
+#include "ilua/ilua.h"
+#include "ilua/stream.h"
+
+namespace api
+{
+
+// compression filters: stream.deflate(s[, level[, format]]) compresses everything written to it
+// into s, stream.inflate(s[, format]) reads decompressed data from s; both work in fixed-size
+// pieces, so memory use does not depend on the amount of data
+// formats are "gzip", "zlib" and "raw" (deflate without framing); inflate detects gzip and zlib
+// by default. Filters keep their stream referenced and finish the data when closed or collected
+// inflate stops at the end of the compressed data and puts back what it read past it; sources
+// that cannot seek (pipes) keep those bytes, and inflate:rest() returns them
+
+#define ZBUFFER           0x10000
+#define DEFLATE_ARENA     270000    // deflate state with 32K window and default memLevel
+#define INFLATE_ARENA     48000
+
+// zlib allocates all of its state when a filter is created, so a gzmemory arena sized up front
+// serves it with a single allocation; the last released arena is kept for the next filter
+static gzmemory* volatile spare_arena = NULL;
+static gzmemory* arena_acquire(int need)
+{
+  gzmemory* arena = (gzmemory*) InterlockedExchangePointer((void* volatile*) &spare_arena, NULL);
+  if (arena == NULL)
+    arena = new gzmemory;
+  if (arena->count < need)
+    arena->count = need;
+  arena->reset();
+  return arena;
+}
+static void arena_release(gzmemory* arena)
+{
+  if (InterlockedCompareExchangePointer((void* volatile*) &spare_arena, arena, NULL) != NULL)
+    delete arena;
+}
+static void arena_init(z_stream* z, gzmemory* arena)
+{
+  memset(z, 0, sizeof(z_stream));
+  z->zalloc = gzalloc;
+  z->zfree = gzfree;
+  z->opaque = arena;
+}
+
+enum {ZF_GZIP, ZF_ZLIB, ZF_RAW, ZF_AUTO};
+static char const* const zformats[] = {"gzip", "zlib", "raw", "auto", NULL};
+static int const zwindow[] = {15 + 16, 15, -15, 15 + 32};
+
+class DeflateStream : public ilua::Stream
+{
+  ilua::Stream* m_target;
+  gzmemory* m_arena;
+  z_stream z;
+  int64 m_pos;
+  bool m_open;
+  Bytef m_out[ZBUFFER];
+
+  // run deflate once and pass its output on; returns the zlib result, Z_STREAM_ERROR if the
+  // target stopped accepting data
+  int pump(int flush)
+  {
+    z.next_out = m_out;
+    z.avail_out = ZBUFFER;
+    int res = ::deflate(&z, flush);
+    int have = ZBUFFER - z.avail_out;
+    if (have && m_target->write(m_out, have) != have)
+      return Z_STREAM_ERROR;
+    return res;
+  }
+public:
+  DeflateStream(ilua::Stream* target, int level, int format)
+    : m_target(target)
+    , m_pos(0)
+  {
+    m_arena = arena_acquire(DEFLATE_ARENA);
+    arena_init(&z, m_arena);
+    m_open = (deflateInit2(&z, level, Z_DEFLATED, zwindow[format], 8, Z_DEFAULT_STRATEGY) == Z_OK);
+  }
+  ~DeflateStream()
+  {
+    close();
+    arena_release(m_arena);
+  }
+  bool valid() const
+  {
+    return m_open;
+  }
+
+  int write(void const* buf, int count)
+  {
+    if (!m_open || count <= 0)
+      return 0;
+    z.next_in = (Bytef*) buf;
+    z.avail_in = count;
+    while (z.avail_in)
+      if (pump(Z_NO_FLUSH) != Z_OK)
+        break;
+    int done = count - z.avail_in;
+    z.avail_in = 0;
+    m_pos += done;
+    return done;
+  }
+  // everything written so far can be decompressed from the target
+  void flush()
+  {
+    if (!m_open)
+      return;
+    while (pump(Z_SYNC_FLUSH) == Z_OK && z.avail_out == 0)
+      ;
+    m_target->flush();
+  }
+  // write the end of the compressed data; further writes are ignored
+  void close()
+  {
+    if (!m_open)
+      return;
+    while (pump(Z_FINISH) == Z_OK)
+      ;
+    deflateEnd(&z);
+    m_open = false;
+    m_target->flush();
+  }
+
+  int64 tell() const
+  {
+    return m_pos;
+  }
+  int64 size() const
+  {
+    return m_pos;
+  }
+};
+
+class InflateStream : public ilua::Stream
+{
+  ilua::Stream* m_source;
+  gzmemory* m_arena;
+  z_stream z;
+  int64 m_pos;
+  bool m_open;
+  bool m_end;
+  Bytef m_in[ZBUFFER];
+public:
+  InflateStream(ilua::Stream* source, int format)
+    : m_source(source)
+    , m_pos(0)
+    , m_end(false)
+  {
+    m_arena = arena_acquire(INFLATE_ARENA);
+    arena_init(&z, m_arena);
+    m_open = (inflateInit2(&z, zwindow[format]) == Z_OK);
+    m_end = !m_open;
+  }
+  ~InflateStream()
+  {
+    if (m_open)
+      inflateEnd(&z);
+    arena_release(m_arena);
+  }
+  bool valid() const
+  {
+    return m_open;
+  }
+
+  int read(void* buf, int count)
+  {
+    if (m_end || count <= 0)
+      return 0;
+    z.next_out = (Bytef*) buf;
+    z.avail_out = count;
+    while (z.avail_out && !m_end)
+    {
+      // feed the source's memory directly when it has some, consuming only what was used
+      bool direct = false;
+      if (z.avail_in == 0)
+      {
+        int avail;
+        char const* span = m_source->peek(&avail);
+        if (span)
+        {
+          z.next_in = (Bytef*) span;
+          z.avail_in = avail;
+          direct = true;
+        }
+        else
+        {
+          int got = m_source->read(m_in, ZBUFFER);
+          // a source with nothing to read right now is not necessarily at its end
+          if (got <= 0)
+          {
+            if (m_source->eof())
+              m_end = true;
+            break;
+          }
+          z.next_in = m_in;
+          z.avail_in = got;
+        }
+      }
+      uInt in = z.avail_in;
+      uInt out = z.avail_out;
+      int res = ::inflate(&z, Z_NO_FLUSH);
+      if (direct)
+      {
+        m_source->seek(in - z.avail_in, SEEK_CUR);
+        z.avail_in = 0;
+      }
+      if (res == Z_STREAM_END)
+      {
+        // leave whatever follows the compressed data in the source, or keep it for rest()
+        if (z.avail_in)
+        {
+          int64 at = m_source->tell();
+          m_source->seek(-int64(z.avail_in), SEEK_CUR);
+          if (m_source->tell() != at)
+            z.avail_in = 0;
+        }
+        m_end = true;
+      }
+      else if ((res != Z_OK && res != Z_BUF_ERROR) || (in == z.avail_in && out == z.avail_out && !direct))
+      {
+        z.avail_in = 0;
+        m_end = true;
+      }
+    }
+    int done = count - z.avail_out;
+    m_pos += done;
+    return done;
+  }
+
+  int64 tell() const
+  {
+    return m_pos;
+  }
+  bool eof() const
+  {
+    return m_end;
+  }
+  // bytes past the compressed data that could not be put back into the source
+  char const* rest(int* count)
+  {
+    *count = (m_end ? int(z.avail_in) : 0);
+    return (char const*) z.next_in;
+  }
+};
+
+static void zstream_keep(lua_State* L, int source)
+{
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, source);
+  lua_rawseti(L, -2, 1);
+  lua_setuservalue(L, -2);
+}
+static int zs_deflate(lua_State* L)
+{
+  ilua::Stream* target = ilua::checkobject<ilua::Stream>(L, 1, "stream");
+  int level = luaL_optint(L, 2, Z_DEFAULT_COMPRESSION);
+  luaL_argcheck(L, level >= -1 && level <= 9, 2, "level must be between 0 and 9");
+  int format = ilua::checkoption(L, 3, "gzip", zformats);
+  luaL_argcheck(L, format != ZF_AUTO, 3, "format has to be specified");
+  DeflateStream* s = new(L, "stream.deflate") DeflateStream(target, level, format);
+  if (!s->valid())
+    luaL_error(L, "unable to initialize compression");
+  zstream_keep(L, 1);
+  return 1;
+}
+static int zs_inflate(lua_State* L)
+{
+  ilua::Stream* source = ilua::checkobject<ilua::Stream>(L, 1, "stream");
+  int format = ilua::checkoption(L, 2, "auto", zformats);
+  InflateStream* s = new(L, "stream.inflate") InflateStream(source, format);
+  if (!s->valid())
+    luaL_error(L, "unable to initialize decompression");
+  zstream_keep(L, 1);
+  return 1;
+}
+static int deflate_close(lua_State* L)
+{
+  DeflateStream* s = ilua::checkobject<DeflateStream>(L, 1, "stream.deflate");
+  s->close();
+  return 0;
+}
+static int inflate_rest(lua_State* L)
+{
+  InflateStream* s = ilua::checkobject<InflateStream>(L, 1, "stream.inflate");
+  int count;
+  char const* rest = s->rest(&count);
+  lua_pushlstring(L, rest, count);
+  return 1;
+}
+static int zs_source(lua_State* L)
+{
+  luaL_checktype(L, 1, LUA_TUSERDATA);
+  lua_getuservalue(L, 1);
+  if (!lua_istable(L, -1))
+    return 0;
+  lua_rawgeti(L, -1, 1);
+  return 1;
+}
+
+void bind_zstream(lua_State* L)
+{
+  ilua::newtype<DeflateStream>(L, "stream.deflate", "stream");
+  ilua::stream_noread(L);
+  ilua::settabsn(L, "seek");
+  ilua::settabsn(L, "resize");
+  ilua::bindmethod(L, "close", deflate_close);
+  ilua::bindmethod(L, "source", zs_source);
+  lua_pop(L, 2);
+
+  ilua::newtype<InflateStream>(L, "stream.inflate", "stream");
+  ilua::stream_nowrite(L);
+  ilua::settabsn(L, "seek");
+  ilua::settabsn(L, "size");
+  ilua::bindmethod(L, "source", zs_source);
+  ilua::bindmethod(L, "rest", inflate_rest);
+  lua_pop(L, 2);
+
+  ilua::openlib(L, "stream");
+  ilua::bindmethod(L, "deflate", zs_deflate);
+  ilua::bindmethod(L, "inflate", zs_inflate);
+  lua_pop(L, 1);
+}
+
+}
@@ -24,6 +24,7 @@ Application::Application(HINSTANCE _hInstance, HINSTANCE hPrevInstance, LPWSTR l
   ArgumentParser argParser;
   argParser.registerArgument(L"run", L"true");
   argParser.registerArgument(L"show", L"true");
+  argParser.registerArgument(L"vclock", L"true");
   ArgumentList args;
   argParser.parse(lpCmdLine, args);
 
@@ -38,6 +39,8 @@ Application::Application(HINSTANCE _hInstance, HINSTANCE hPrevInstance, LPWSTR l
 
   mainWindow = new MainWnd(&e);
   e.setHandler(mainWindow->getHandle());
+  if (args.hasArgument(L"vclock"))
+    e.setVirtualClock(args.getArgumentBool(L"vclock"));
 
   bool eRun = false;
   if (args.getFreeArgumentCount())
@@ -1,14 +1,294 @@
 #include "ilua/ilua.h"
 #include "file.h"
+#include <stdlib.h>
+#ifdef _WIN32
+#include "base/wstring.h"
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#endif
 
 const int64 viewSize     = 0x00010000;
 const int64 sizeGrow     = 0x00010000;
+const int64 growMax      = 0x40000000;
+// views can cover the whole file in a 64-bit address space
+const int64 viewMax      = (sizeof(void*) > 4 ? int64(1) << 40 : 0x01000000);
+const int64 bufferMax    = 0x00400000;
+const int64 mapMin       = 0x00100000;
+const int64 readAhead    = 0x00800000;
+
+#ifdef _WIN32
+
+// writes through mapped views are the tuned path here
+const bool mapWrites     = true;
+
+// PrefetchVirtualMemory is only available from Windows 8 on
+struct PrefetchRange
+{
+  void* address;
+  SIZE_T size;
+};
+typedef BOOL (WINAPI *PrefetchFunc)(HANDLE process, ULONG_PTR count, PrefetchRange* ranges, ULONG flags);
+static PrefetchFunc prefetch_func()
+{
+  static PrefetchFunc func = (PrefetchFunc) GetProcAddress(GetModuleHandleA("kernel32.dll"), "PrefetchVirtualMemory");
+  return func;
+}
+
+HANDLE SystemFile::open(char const* path, int mask)
+{
+  DWORD creation[4] = {OPEN_EXISTING, OPEN_EXISTING, CREATE_ALWAYS, OPEN_ALWAYS};
+  return CreateFile(WideString(path), GENERIC_READ | (mask ? GENERIC_WRITE : 0), FILE_SHARE_READ, NULL,
+    creation[mask & 4 ? 3 : mask & 3], FILE_ATTRIBUTE_NORMAL, NULL);
+}
+int64 SystemFile::ossize()
+{
+  fint size;
+  size.low = GetFileSize(hFile, &size.high);
+  return size.n;
+}
+bool SystemFile::ossetend(int64 size)
+{
+  return SetFilePointerEx(hFile, *(LARGE_INTEGER*) &size, NULL, FILE_BEGIN) && SetEndOfFile(hFile);
+}
+// SetEndOfFile already allocates the space
+bool SystemFile::osreserve(int64 size)
+{
+  return true;
+}
+void SystemFile::osadvise()
+{
+}
+void SystemFile::osclose()
+{
+  CloseHandle(hFile);
+}
+int SystemFile::osread(int64 offset, void* buf, int count)
+{
+  OVERLAPPED ov;
+  memset(&ov, 0, sizeof ov);
+  ov.Offset = DWORD(offset);
+  ov.OffsetHigh = DWORD(offset >> 32);
+  DWORD done = 0;
+  if (!ReadFile(hFile, buf, count, &done, &ov))
+    return 0;
+  return int(done);
+}
+int SystemFile::oswrite(int64 offset, void const* buf, int count)
+{
+  OVERLAPPED ov;
+  memset(&ov, 0, sizeof ov);
+  ov.Offset = DWORD(offset);
+  ov.OffsetHigh = DWORD(offset >> 32);
+  DWORD done = 0;
+  if (!WriteFile(hFile, buf, count, &done, &ov))
+    return 0;
+  return int(done);
+}
+// no kernel copy between handles; SystemFile::copy reads into the views instead
+int64 SystemFile::oscopy(HANDLE source, int64 from, int64 to, int64 count)
+{
+  return 0;
+}
+void SystemFile::openmap()
+{
+  if (realSize.n)
+    hMap = CreateFileMapping(hFile, NULL, mode == OPEN_READ ? PAGE_READONLY : PAGE_READWRITE,
+      0, 0, NULL);
+  else
+    hMap = NULL;
+}
+void SystemFile::closemap()
+{
+  if (hMap) CloseHandle(hMap);
+  hMap = NULL;
+}
+uint8* SystemFile::mapview(int64 start, int64 length)
+{
+  fint offset;
+  offset.n = start;
+  return (uint8*) MapViewOfFile(hMap, mode == OPEN_READ ? FILE_MAP_READ : FILE_MAP_ALL_ACCESS,
+    offset.high, offset.low, SIZE_T(length));
+}
+void SystemFile::unmapview(uint8* ptr, int64 length)
+{
+  UnmapViewOfFile(ptr);
+}
+bool SystemFile::flushview(uint8* ptr, int64 length)
+{
+  return FlushViewOfFile(ptr, SIZE_T(length)) != 0;
+}
+void SystemFile::prefetch(uint8* ptr, int64 length)
+{
+  if (prefetch_func())
+  {
+    PrefetchRange range;
+    range.address = ptr;
+    range.size = SIZE_T(length);
+    prefetch_func()(GetCurrentProcess(), 1, &range, 0);
+  }
+}
+
+#else
+
+// mapped writes fault in every page and have to remap as the file grows; large pwrite calls are
+// cheaper, and a file truncated by another process cannot fault a buffer
+const bool mapWrites     = false;
+
+HANDLE SystemFile::open(char const* path, int mask)
+{
+  int creation[4] = {0, 0, O_CREAT | O_TRUNC, O_CREAT};
+  return ::open(path, (mask & 2 ? O_RDWR : O_RDONLY) | creation[mask & 4 ? 3 : mask & 3], 0666);
+}
+int64 SystemFile::ossize()
+{
+  struct stat st;
+  return (fstat(hFile, &st) == 0 ? int64(st.st_size) : 0);
+}
+bool SystemFile::ossetend(int64 size)
+{
+  int result;
+  while ((result = ftruncate(hFile, off_t(size))) != 0 && errno == EINTR)
+    ;
+  return result == 0;
+}
+// ftruncate leaves a sparse file, so writes into it could still run out of space
+bool SystemFile::osreserve(int64 size)
+{
+  int result;
+  while ((result = posix_fallocate(hFile, 0, off_t(size))) == EINTR)
+    ;
+  return result == 0;
+}
+void SystemFile::osadvise()
+{
+  static int const hints[] = {POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM};
+  posix_fadvise(hFile, 0, 0, hints[advice]);
+}
+void SystemFile::osclose()
+{
+  ::close(hFile);
+}
+int SystemFile::osread(int64 offset, void* buf, int count)
+{
+  int done = 0;
+  while (done < count)
+  {
+    ssize_t got = pread(hFile, (char*) buf + done, count - done, off_t(offset + done));
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      break;
+    done += int(got);
+  }
+  return done;
+}
+int SystemFile::oswrite(int64 offset, void const* buf, int count)
+{
+  int done = 0;
+  while (done < count)
+  {
+    ssize_t put = pwrite(hFile, (char const*) buf + done, count - done, off_t(offset + done));
+    if (put < 0 && errno == EINTR)
+      continue;
+    if (put <= 0)
+      break;
+    done += int(put);
+  }
+  return done;
+}
+// copies `count' bytes from offset `from' of `source' to offset `to' inside the kernel; returns
+// the amount copied, 0 if the kernel cannot copy between these files
+int64 SystemFile::oscopy(HANDLE source, int64 from, int64 to, int64 count)
+{
+  int64 done = 0;
+#ifdef __linux__
+  while (done < count)
+  {
+    loff_t in = loff_t(from + done);
+    loff_t out = loff_t(to + done);
+    size_t chunk = size_t(count - done > 0x40000000 ? 0x40000000 : count - done);
+    ssize_t got = copy_file_range(source, &in, hFile, &out, chunk, 0);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      break;
+    done += got;
+  }
+  // kernels before 4.5, and before 5.3 across file systems: sendfile writes at the file offset,
+  // which is otherwise unused since all I/O here is positional
+  if (done == 0 && lseek(hFile, off_t(to), SEEK_SET) == off_t(to))
+  {
+    while (done < count)
+    {
+      off_t in = off_t(from + done);
+      size_t chunk = size_t(count - done > 0x40000000 ? 0x40000000 : count - done);
+      ssize_t got = sendfile(hFile, source, &in, chunk);
+      if (got < 0 && errno == EINTR)
+        continue;
+      if (got <= 0)
+        break;
+      done += got;
+    }
+  }
+#endif
+  return done;
+}
+// mappings need no object of their own
+void SystemFile::openmap()
+{
+}
+void SystemFile::closemap()
+{
+}
+uint8* SystemFile::mapview(int64 start, int64 length)
+{
+  static int const hints[] = {MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM};
+  void* ptr = mmap(NULL, size_t(length), PROT_READ | (mode == OPEN_READ ? 0 : PROT_WRITE),
+    MAP_SHARED, hFile, off_t(start));
+  if (ptr == MAP_FAILED)
+    return NULL;
+  if (advice != ADVISE_NORMAL)
+    madvise(ptr, size_t(length), hints[advice]);
+  return (uint8*) ptr;
+}
+void SystemFile::unmapview(uint8* ptr, int64 length)
+{
+  munmap(ptr, size_t(length));
+}
+bool SystemFile::flushview(uint8* ptr, int64 length)
+{
+  return msync(ptr, size_t(length), MS_ASYNC) == 0;
+}
+void SystemFile::prefetch(uint8* ptr, int64 length)
+{
+  madvise(ptr, size_t(length), MADV_WILLNEED);
+}
+
+#endif
 
 SystemFile::SystemFile(HANDLE file, uint32 m)
   : hFile(file)
+#ifdef _WIN32
   , hMap(NULL)
-  , view(NULL)
+#endif
   , mode(m)
+  , view(NULL)
+  , buffer(NULL)
+  , bufferSize(0)
+  , dirty(false)
+  , io(IO_MAP)
+  , iomode(IO_AUTO)
+  , viewLimit(viewSize)
+  , prefetched(0)
+  , advice(ADVISE_NORMAL)
+  , reserved(0)
+  , failed(false)
 {
   fileSize.n = 0;
   realSize.n = 0;
@@ -17,16 +297,19 @@ SystemFile::SystemFile(HANDLE file, uint32 m)
   viewEnd.n = 0;
   if (hFile != INVALID_HANDLE_VALUE)
   {
-    fileSize.low = GetFileSize(hFile, &fileSize.high);
-    if (fileSize.n > 0)
-      hMap = CreateFileMapping(hFile, NULL, mode == OPEN_READ ? PAGE_READONLY : PAGE_READWRITE,
-        0, 0, NULL);
+    fileSize.n = ossize();
     realSize.n = fileSize.n;
     if (mode == OPEN_APPEND)
     {
       pos.n = fileSize.n;
       mode = OPEN_WRITE;
     }
+    io = pickio();
+    // small read-only files are read whole with one call
+    if (io == IO_BUFFER && mode == OPEN_READ && fileSize.n < mapMin && fileSize.n > viewLimit)
+      viewLimit = fileSize.n;
+    if (io == IO_MAP)
+      openmap();
     setview(pos.n);
   }
 }
@@ -34,18 +317,18 @@ SystemFile::~SystemFile()
 {
   close();
 }
-void SystemFile::close()
+bool SystemFile::close()
 {
-  if (view) UnmapViewOfFile(view);
-  if (hMap) CloseHandle(hMap);
-  if (realSize.n > fileSize.n)
-  {
-    SetFilePointerEx(hFile, *(LARGE_INTEGER*) &fileSize.n, NULL, FILE_BEGIN);
-    SetEndOfFile(hFile);
-  }
-  if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
-  view = NULL;
-  hMap = NULL;
+  dropview();
+  if (io == IO_MAP) closemap();
+  if (realSize.n > fileSize.n && !ossetend(fileSize.n))
+    failed = true;
+  bool success = !failed;
+  failed = false;
+  if (hFile != INVALID_HANDLE_VALUE) osclose();
+  free(buffer);
+  buffer = NULL;
+  bufferSize = 0;
   hFile = INVALID_HANDLE_VALUE;
   fileSize.n = 0;
   realSize.n = 0;
@@ -53,53 +336,197 @@ void SystemFile::close()
   viewStart.n = 0;
   viewEnd.n = 0;
   mode = OPEN_READ;
+  return success;
 }
+// the reserved size is kept until the file is closed
 void SystemFile::flush()
 {
   if (mode == OPEN_READ) return;
-  if (realSize.n > fileSize.n)
+  int64 keep = (reserved > fileSize.n ? reserved : fileSize.n);
+  if (realSize.n > keep)
   {
-    UnmapViewOfFile(view);
-    CloseHandle(hMap);
-    view = NULL;
-    SetFilePointerEx(hFile, *(LARGE_INTEGER*) &fileSize.n, NULL, FILE_BEGIN);
-    SetEndOfFile(hFile);
-    realSize.n = fileSize.n;
-    hMap = CreateFileMapping(hFile, NULL, mode == OPEN_READ ? PAGE_READONLY : PAGE_READWRITE,
-      0, 0, NULL);
+    dropview();
+    if (io == IO_MAP) closemap();
+    if (ossetend(keep))
+      realSize.n = keep;
+    else
+      failed = true;
+    if (io == IO_MAP) openmap();
     setview(viewStart.n);
   }
+  else if (view && io == IO_MAP && !flushview(view, viewEnd.n - viewStart.n))
+    failed = true;
   else if (view)
-    FlushViewOfFile(view, viewEnd.n - viewStart.n);
+    writeback();
 }
 
+// automatic mode: files opened for writing use buffers unless the platform writes best through
+// mappings; read-only files are mapped unless they are small enough to read with one call, and
+// always with the random hint, where a mapping serves every seek without a read
+int SystemFile::pickio() const
+{
+  if (iomode != IO_AUTO)
+    return iomode;
+  if (mode != OPEN_READ)
+    return (mapWrites ? IO_MAP : IO_BUFFER);
+  if (advice == ADVISE_RANDOM)
+    return IO_MAP;
+  return (fileSize.n < mapMin ? IO_BUFFER : IO_MAP);
+}
+void SystemFile::setio(int newio)
+{
+  if (newio == io)
+    return;
+  dropview();
+  if (io == IO_MAP) closemap();
+  io = newio;
+  if (io == IO_MAP) openmap();
+  if (viewLimit > maxview())
+    viewLimit = maxview();
+  if (hFile != INVALID_HANDLE_VALUE)
+    setview(pos.n);
+}
+void SystemFile::setiomode(int newmode)
+{
+  iomode = newmode;
+  setio(pickio());
+}
+int64 SystemFile::maxview() const
+{
+  return (io == IO_MAP ? viewMax : bufferMax);
+}
+
+// views start at 64 KB; moving on from the end of one view doubles the next, so a sequential
+// scan remaps rarely and in a 64-bit process soon maps the whole file (buffers stop at 4 MB)
+// the sequential hint starts with the largest views and loads data ahead of the reader; the
+// random hint maps the whole file at once in a 64-bit process and keeps 64 KB views otherwise
 void SystemFile::setview(int64 pos)
 {
-  if (view) UnmapViewOfFile(view);
-  viewStart.n = pos;
-  viewEnd.n = (pos + viewSize < realSize.n ? pos + viewSize : realSize.n);
-  if (viewEnd.n > viewStart.n)
-    view = (uint8*) MapViewOfFile(hMap, mode == OPEN_READ ? FILE_MAP_READ : FILE_MAP_ALL_ACCESS,
-      viewStart.high, viewStart.low, viewEnd.n - viewStart.n);
-  else
-    view = NULL;
+  if (view && pos == viewEnd.n && advice == ADVISE_NORMAL && viewLimit < maxview())
+    viewLimit *= 2;
+  dropview();
+  // mapping offsets have to be a multiple of the allocation granularity
+  viewStart.n = pos & ~(viewSize - 1);
+  while (true)
+  {
+    viewEnd.n = (viewStart.n + viewLimit < realSize.n ? viewStart.n + viewLimit : realSize.n);
+    view = (viewEnd.n > viewStart.n ? loadview() : NULL);
+    // out of address space or memory: go back to small views
+    if (view || viewEnd.n <= viewStart.n || viewLimit <= viewSize)
+      break;
+    viewLimit = viewSize;
+  }
+  prefetched = pos;
+}
+uint8* SystemFile::loadview()
+{
+  int64 length = viewEnd.n - viewStart.n;
+  if (io == IO_MAP)
+    return mapview(viewStart.n, length);
+  if (length > bufferSize)
+  {
+    free(buffer);
+    buffer = (uint8*) malloc(size_t(length));
+    bufferSize = (buffer ? length : 0);
+    if (buffer == NULL)
+      return NULL;
+  }
+  // the part past the data is zero, like a mapping of the grown file
+  int64 have = (viewEnd.n < fileSize.n ? viewEnd.n : fileSize.n) - viewStart.n;
+  int got = (have > 0 ? osread(viewStart.n, buffer, int(have)) : 0);
+  memset(buffer + got, 0, size_t(length - got));
+  dirty = false;
+  return buffer;
 }
-void SystemFile::doresize(int64 newsize)
+void SystemFile::writeback()
 {
-  if (view) UnmapViewOfFile(view);
+  int64 end = (viewEnd.n < fileSize.n ? viewEnd.n : fileSize.n);
+  // buffered data goes to disk only here, so running out of space shows up here
+  if (dirty && end > viewStart.n && oswrite(viewStart.n, view, int(end - viewStart.n)) != end - viewStart.n)
+    failed = true;
+  dirty = false;
+}
+void SystemFile::dropview()
+{
+  if (view == NULL)
+    return;
+  if (io == IO_MAP)
+    unmapview(view, viewEnd.n - viewStart.n);
+  else
+    writeback();
   view = NULL;
-  if (hMap) CloseHandle(hMap);
-  SetFilePointerEx(hFile, *(LARGE_INTEGER*) &newsize, NULL, FILE_BEGIN);
-  SetEndOfFile(hFile);
-  realSize.n = newsize;
-  if (newsize)
+}
+void SystemFile::readahead()
+{
+  if (advice != ADVISE_SEQUENTIAL || io != IO_MAP || view == NULL || pos.n + readAhead / 2 < prefetched)
+    return;
+  int64 from = (prefetched > pos.n ? prefetched : pos.n) & ~(viewSize - 1);
+  int64 to = (pos.n + readAhead < viewEnd.n ? pos.n + readAhead : viewEnd.n);
+  if (to > from)
+    prefetch(view + (from - viewStart.n), to - from);
+  prefetched = to;
+}
+void SystemFile::advise(int hint)
+{
+  advice = hint;
+  osadvise();
+  setio(pickio());
+  if (hint == ADVISE_NORMAL)
+    return;
+  int64 limit = (hint == ADVISE_RANDOM && (io == IO_BUFFER || sizeof(void*) == 4) ? viewSize : maxview());
+  if (limit != viewLimit)
   {
-    hMap = CreateFileMapping(hFile, NULL, mode == OPEN_READ ? PAGE_READONLY : PAGE_READWRITE,
-      0, 0, NULL);
+    viewLimit = limit;
+    if (view)
+      setview(pos.n < viewEnd.n ? pos.n : viewStart.n);
+  }
+}
+// returns false (with the old size kept) if the file could not be resized
+bool SystemFile::doresize(int64 newsize)
+{
+  dropview();
+  if (io == IO_MAP) closemap();
+  bool success = ossetend(newsize);
+  if (success)
+    realSize.n = newsize;
+  if (io == IO_MAP) openmap();
+  if (realSize.n)
     setview(viewStart.n);
+  return success;
+}
+// writing past the end grows the file by half its size (64 KB to 1 GB at a time), or straight to
+// the reserved size, so long outputs remap only a few dozen times; flush trims the file back to
+// the data written or the reserved size, close to the data written
+// when the step does not fit, the file grows by just what is needed
+bool SystemFile::grow(int64 need)
+{
+  int64 step = realSize.n / 2;
+  if (step < sizeGrow) step = sizeGrow;
+  if (step > growMax) step = growMax;
+  int64 newsize = realSize.n + step;
+  if (newsize < need) newsize = need;
+  if (newsize < reserved) newsize = reserved;
+  return doresize(newsize) || (newsize > need && doresize(need));
+}
+bool SystemFile::reserve(int64 size)
+{
+  if (mode == OPEN_READ) return false;
+  if (size <= realSize.n)
+  {
+    reserved = size;
+    return true;
   }
-  else
-    hMap = NULL;
+  // out of space: go back to the old size rather than leave a sparse tail to fail later
+  int64 oldsize = realSize.n;
+  if (!doresize(size))
+    return false;
+  if (!osreserve(size))
+  {
+    doresize(oldsize);
+    return false;
+  }
+  reserved = size;
+  return true;
 }
 char SystemFile::getc()
 {
@@ -107,20 +534,39 @@ char SystemFile::getc()
     return 0;
   if (pos.n < viewStart.n || pos.n >= viewEnd.n)
     setview(pos.n);
+  if (view == NULL)
+    return 0;
   return view[(pos.n++) - viewStart.n];
 }
 int SystemFile::putc(char c)
 {
-  if (mode == OPEN_READ) return 0;
-  if (pos.n >= realSize.n)
-    doresize(realSize.n + sizeGrow);
+  if (mode == OPEN_READ || failed) return 0;
+  if (pos.n >= realSize.n && !grow(pos.n + 1))
+    return 0;
   if (pos.n < viewStart.n || pos.n >= viewEnd.n)
     setview(pos.n);
+  if (view == NULL)
+    return 0;
   view[(pos.n++) - viewStart.n] = c;
+  dirty = true;
   if (pos.n > fileSize.n)
     fileSize.n = pos.n;
   return 1;
 }
+char const* SystemFile::peek(int* count)
+{
+  *count = 0;
+  if (pos.n >= fileSize.n)
+    return NULL;
+  if (pos.n < viewStart.n || pos.n >= viewEnd.n)
+    setview(pos.n);
+  if (view == NULL)
+    return NULL;
+  readahead();
+  int64 avail = (viewEnd.n < fileSize.n ? viewEnd.n : fileSize.n) - pos.n;
+  *count = (avail > 0x7FFFFFFF ? 0x7FFFFFFF : int(avail));
+  return (char const*) view + (pos.n - viewStart.n);
+}
 int SystemFile::read(void* vbuf, int count)
 {
   if (pos.n + count > fileSize.n)
@@ -130,15 +576,20 @@ int SystemFile::read(void* vbuf, int count)
   int total = 0;
   if (pos.n < viewStart.n || pos.n >= viewEnd.n)
     setview(pos.n);
+  if (view == NULL)
+    return 0;
+  readahead();
   while (pos.n + count > viewEnd.n)
   {
-    int add = viewEnd.n - pos.n;
+    int add = int(viewEnd.n - pos.n);
     memcpy(buf, view + (pos.n - viewStart.n), add);
     total += add;
     count -= add;
     buf += add;
     pos.n = viewEnd.n;
     setview(pos.n);
+    if (view == NULL)
+      return total;
   }
   if (count)
   {
@@ -150,26 +601,33 @@ int SystemFile::read(void* vbuf, int count)
 }
 int SystemFile::write(void const* vbuf, int count)
 {
-  if (mode == OPEN_READ || count == 0) return 0;
+  if (mode == OPEN_READ || failed || count == 0) return 0;
   uint8 const* buf = (uint8*) vbuf;
-  if (pos.n + count > realSize.n)
-    doresize(pos.n + count > realSize.n + sizeGrow ? pos.n + count : realSize.n + sizeGrow);
+  if (pos.n + count > realSize.n && !grow(pos.n + count))
+    return 0;
   int total = 0;
   if (pos.n < viewStart.n || pos.n >= viewEnd.n)
     setview(pos.n);
+  if (view == NULL)
+    return 0;
   while (pos.n + count > viewEnd.n)
   {
-    int add = viewEnd.n - pos.n;
+    int add = int(viewEnd.n - pos.n);
     memcpy(view + (pos.n - viewStart.n), buf, add);
+    dirty = true;
     total += add;
     count -= add;
     buf += add;
     pos.n = viewEnd.n;
+    if (pos.n > fileSize.n) fileSize.n = pos.n;
     setview(pos.n);
+    if (view == NULL)
+      return total;
   }
   if (count)
   {
     memcpy(view + (pos.n - viewStart.n), buf, count);
+    dirty = true;
     total += count;
     pos.n += count;
   }
@@ -187,46 +645,158 @@ void SystemFile::seek(int64 offset, int rel)
 void SystemFile::resize(int64 newsize)
 {
   if (mode == OPEN_READ) return;
-  doresize(newsize);
+  if (!doresize(newsize))
+    return;
   fileSize.n = newsize;
   if (pos.n > fileSize.n)
     pos.n = fileSize.n;
 }
 int64 SystemFile::copy(ilua::Stream* stream, int64 count)
 {
-  if (mode == OPEN_READ || count == 0) return 0;
-  if (count == 0)
-    count = stream->size() - stream->tell();
-  if (pos.n + count > realSize.n)
-    doresize(pos.n + count > realSize.n + sizeGrow ? pos.n + count : realSize.n + sizeGrow);
+  if (mode == OPEN_READ || failed) return 0;
+  // sources of unknown size (and the file itself) go through the generic chunked copy
+  int64 avail = stream->size() - stream->tell();
+  if (stream == this || stream->size() <= 0)
+    return ilua::Stream::copy(stream, count);
+  if (count == 0 || count > avail)
+    count = avail;
+  if (count <= 0) return 0;
+  // size the file once, then read the source straight into the views
+  if (pos.n + count > realSize.n && !grow(pos.n + count))
+    return 0;
   int64 total = 0;
-  if (pos.n < viewStart.n || pos.n >= viewEnd.n)
-    setview(pos.n);
-  while (count)
+  // between two files the kernel copies without going through a view at all; the source's
+  // buffered changes are written out first, and this view is dropped so it cannot go stale
+  if (SystemFile* source = dynamic_cast<SystemFile*>(stream))
   {
-    int add = viewEnd.n - pos.n;
-    if (add > count) add = count;
-    add = stream->read(view + (pos.n - viewStart.n), add);
-    total += add;
-    count -= add;
-    pos.n += add;
-    if (count)
+    source->flush();
+    dropview();
+    total = oscopy(source->hFile, source->pos.n, pos.n, count);
+    source->pos.n += total;
+    count -= total;
+    pos.n += total;
+    if (pos.n > fileSize.n) fileSize.n = pos.n;
+  }
+  while (count > 0)
+  {
+    if (pos.n < viewStart.n || pos.n >= viewEnd.n)
       setview(pos.n);
+    if (view == NULL)
+      break;
+    int64 add = viewEnd.n - pos.n;
+    if (add > count) add = count;
+    if (add > 0x40000000) add = 0x40000000;
+    int got = stream->read(view + (pos.n - viewStart.n), int(add));
+    dirty = true;
+    total += got;
+    count -= got;
+    pos.n += got;
+    if (pos.n > fileSize.n) fileSize.n = pos.n;
+    if (got < add)
+      break;
   }
-  if (pos.n > fileSize.n) fileSize.n = pos.n;
   return total;
 }
 
+// file.open(path[, mode]) returns nil if the file could not be opened; "w" truncates the file,
+// "a" keeps its contents and starts writing at the end
+static int file_open(lua_State* L)
+{
+  char const* path = luaL_checkstring(L, 1);
+  char const* mode = luaL_optstring(L, 2, "r");
+  int mask = 0;
+  for (int i = 0; mode[i]; i++)
+  {
+    switch (mode[i])
+    {
+    case 'r':
+    case 'R':
+      mask |= 1;
+      break;
+    case 'a':
+    case 'A':
+      mask |= 4;
+    case 'w':
+    case 'W':
+      mask |= 2;
+      break;
+    }
+  }
+  HANDLE hFile = SystemFile::open(path, mask);
+  if (hFile != INVALID_HANDLE_VALUE)
+    new(L, "file") SystemFile(hFile, mask & 4 ? SystemFile::OPEN_APPEND : (mask & 2 ? SystemFile::OPEN_WRITE : SystemFile::OPEN_READ));
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
+// file:write(...), file:flush() and file:close() return false if a write failed since the file
+// was opened; buffered data only reaches the disk on flush, so errors such as a full disk may
+// show up there rather than in the write that caused them
+static int file_write(lua_State* L)
+{
+  SystemFile* file = ilua::checkobject<SystemFile>(L, 1, "file");
+  int n = lua_gettop(L);
+  for (int i = 2; i <= n; i++)
+  {
+    size_t count;
+    char const* str = ilua::checkbuffer(L, i, &count);
+    file->write(str, count);
+  }
+  lua_pushboolean(L, file->good());
+  return 1;
+}
+static int file_flush(lua_State* L)
+{
+  SystemFile* file = ilua::checkobject<SystemFile>(L, 1, "file");
+  file->flush();
+  lua_pushboolean(L, file->good());
+  return 1;
+}
 static int file_close(lua_State* L)
 {
   SystemFile* file = ilua::checkobject<SystemFile>(L, 1, "file");
-  file->close();
+  lua_pushboolean(L, file->close());
+  return 1;
+}
+
+// file:reserve(size) returns false if the space could not be allocated
+static int file_reserve(lua_State* L)
+{
+  SystemFile* file = ilua::checkobject<SystemFile>(L, 1, "file");
+  lua_pushboolean(L, file->reserve(int64(luaL_checknumber(L, 2))));
+  return 1;
+}
+// file:advise("normal"|"sequential"|"random")
+static int file_advise(lua_State* L)
+{
+  static char const* const hints[] = {"normal", "sequential", "random", NULL};
+  SystemFile* file = ilua::checkobject<SystemFile>(L, 1, "file");
+  file->advise(ilua::checkoption(L, 2, NULL, hints));
   return 0;
 }
+// file:iomode(["auto"|"map"|"buffer"]) returns the mode in use, "map" or "buffer"
+static int file_iomode(lua_State* L)
+{
+  static char const* const modes[] = {"auto", "map", "buffer", NULL};
+  SystemFile* file = ilua::checkobject<SystemFile>(L, 1, "file");
+  if (!lua_isnoneornil(L, 2))
+    file->setiomode(ilua::checkoption(L, 2, NULL, modes));
+  lua_pushstring(L, modes[file->getio()]);
+  return 1;
+}
 
 void SystemFile::bind(lua_State* L)
 {
   ilua::newtype<SystemFile>(L, "file", "stream");
+  ilua::bindmethod(L, "write", file_write);
+  ilua::bindmethod(L, "flush", file_flush);
   ilua::bindmethod(L, "close", file_close);
+  ilua::bindmethod(L, "advise", file_advise);
+  ilua::bindmethod(L, "reserve", file_reserve);
+  ilua::bindmethod(L, "iomode", file_iomode);
   lua_pop(L, 2);
+  ilua::openlib(L, "file");
+  ilua::bindmethod(L, "open", file_open);
+  lua_pop(L, 1);
 }
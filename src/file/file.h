@@ -4,11 +4,16 @@
 #include "ilua/stream.h"
 #include "base/types.h"
 #include <stdio.h>
+#ifdef _WIN32
 #include <Windows.h>
+#else
+#include <unistd.h>
+typedef int HANDLE;
+#define INVALID_HANDLE_VALUE  (-1)
+#endif
 
 class SystemFile : public ilua::Stream
 {
-  static const 
   union fint
   {
     struct
@@ -19,7 +24,9 @@ class SystemFile : public ilua::Stream
     int64 n;
   };
   HANDLE hFile;
+#ifdef _WIN32
   HANDLE hMap;
+#endif
   uint32 mode;
   fint realSize;
   fint fileSize;
@@ -27,10 +34,50 @@ class SystemFile : public ilua::Stream
   fint viewStart;
   fint viewEnd;
   uint8* view;
+  uint8* buffer;
+  int64 bufferSize;
+  bool dirty;
+  int io;
+  int iomode;
+  int64 viewLimit;
+  int64 prefetched;
+  int advice;
+  int64 reserved;
+  bool failed;                  // a write, flush or resize failed since the file was opened
   void setview(int64 pos);
-  void doresize(int64 newsize);
+  uint8* loadview();
+  void dropview();
+  void writeback();
+  bool doresize(int64 newsize);
+  bool grow(int64 need);
+  void readahead();
+  int64 maxview() const;
+  int pickio() const;
+  void setio(int newio);
+
+  // platform layer
+  int64 ossize();
+  bool ossetend(int64 size);
+  bool osreserve(int64 size);
+  void osadvise();
+  void osclose();
+  int osread(int64 offset, void* buf, int count);
+  int oswrite(int64 offset, void const* buf, int count);
+  int64 oscopy(HANDLE source, int64 from, int64 to, int64 count);
+  void openmap();
+  void closemap();
+  uint8* mapview(int64 start, int64 length);
+  void unmapview(uint8* ptr, int64 length);
+  bool flushview(uint8* ptr, int64 length);
+  void prefetch(uint8* ptr, int64 length);
 public:
   enum {OPEN_READ, OPEN_WRITE, OPEN_APPEND};
+  enum {ADVISE_NORMAL, ADVISE_SEQUENTIAL, ADVISE_RANDOM};
+  // views are either mapped from the file or read into a buffer; auto picks one by size and use
+  enum {IO_AUTO, IO_MAP, IO_BUFFER};
+
+  // opens `path' with the flags parsed by file.open (1 read, 2 write, 4 append)
+  static HANDLE open(char const* path, int mask);
 
   SystemFile(HANDLE file, uint32 mode);
   ~SystemFile();
@@ -39,6 +86,7 @@ public:
   int putc(char c);
 
   int read(void* buf, int count);
+  char const* peek(int* count);
   int write(void const* buf, int count);
 
   void seek(int64 pos, int rel);
@@ -51,14 +99,31 @@ public:
   {
     return pos.n >= fileSize.n;
   }
-  void close();
+  // both return false if any write failed since the file was opened; once one has, later
+  // writes fail as well
+  bool close();
   void flush();
+  bool good() const
+  {
+    return !failed;
+  }
 
   int64 size() const
   {
     return fileSize.n;
   }
   void resize(int64 newsize);
+  // make room for `size' bytes up front, so writes up to that size never remap
+  // returns false if the space could not be allocated
+  bool reserve(int64 size);
+  // access pattern hint, see setview
+  void advise(int hint);
+  // force an I/O mode, or go back to IO_AUTO
+  void setiomode(int newmode);
+  int getio() const
+  {
+    return io;
+  }
   
   static void bind(lua_State* L);
 
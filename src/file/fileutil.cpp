@@ -1,5 +1,6 @@
 #include "file.h"
 #include "fileutil.h"
+#include "walker.h"
 #include <shellapi.h>
 #include <shlwapi.h>
 #include <shlobj.h>
@@ -21,55 +22,171 @@ public:
     , m_to(to)
   {}
 
-  void run()
+  static int shell(uint32 func, wchar_t const* from, wchar_t const* to)
   {
     SHFILEOPSTRUCT fo;
     memset(&fo, 0, sizeof fo);
-    fo.wFunc = m_func;
-    fo.pFrom = m_from.c_str();
-    fo.pTo = m_to.c_str();
+    fo.wFunc = func;
+    fo.pFrom = from;
+    fo.pTo = to;
     fo.fFlags = FOF_NOCONFIRMATION | FOF_NOCONFIRMMKDIR | FOF_NOERRORUI | FOF_SILENT;
     if (fo.wFunc != FO_DELETE)
       fo.fFlags |= FOF_MULTIDESTFILES;
-    int result = SHFileOperation(&fo);
+    return SHFileOperation(&fo);
+  }
+  void run()
+  {
+    int result = shell(m_func, m_from.c_str(), m_to.c_str());
 
     lua_State* L = output_begin();
     lua_pushboolean(L, result == 0);
     output_end();
   }
 };
-
-static int file_open(lua_State* L)
-{
-  char const* path = luaL_checkstring(L, 1);
-  char const* mode = luaL_optstring(L, 2, "r");
-  int mask = 0;
-  for (int i = 0; mode[i]; i++)
+// zero-separated path list ending in an empty entry, as SHFileOperation takes it; built from plain
+// buffers, since the shared empty WideString is reference counted without interlocking
+struct PathList
+{
+  wchar_t* data;
+  size_t size;
+  size_t capacity;
+  PathList()
+    : data(NULL), size(0), capacity(0)
+  {}
+  ~PathList()
+  {
+    free(data);
+  }
+  bool put(wchar_t const* str, size_t len)
   {
-    switch (mode[i])
+    if (size + len + 2 > capacity)
     {
-    case 'r':
-    case 'R':
-      mask |= 1;
-      break;
-    case 'a':
-    case 'A':
-      mask |= 4;
-    case 'w':
-    case 'W':
-      mask |= 2;
-      break;
+      size_t grow = (capacity ? capacity : 1024);
+      while (size + len + 2 > grow)
+        grow *= 2;
+      wchar_t* grown = (wchar_t*) realloc(data, grow * sizeof(wchar_t));
+      if (grown == NULL)
+        return false;
+      data = grown;
+      capacity = grow;
     }
+    memcpy(data + size, str, len * sizeof(wchar_t));
+    size += len;
+    data[size] = 0;
+    return true;
   }
-  DWORD creation[4] = {OPEN_EXISTING, OPEN_EXISTING, CREATE_ALWAYS, OPEN_ALWAYS};
-  HANDLE hFile = CreateFile(WideString(path), GENERIC_READ | (mask ? GENERIC_WRITE : 0), FILE_SHARE_READ, NULL,
-    creation[mask & 3], FILE_ATTRIBUTE_NORMAL, NULL);
-  if (hFile != INVALID_HANDLE_VALUE)
-    new(L, "file") SystemFile(hFile, mask & 4 ? SystemFile::OPEN_APPEND : (mask & 2 ? SystemFile::OPEN_WRITE : SystemFile::OPEN_READ));
-  else
-    lua_pushnil(L);
-  return 1;
+  // append base\rel\name (empty parts are skipped) and return the new entry, valid until the next add;
+  // NULL if out of memory, leaving the list as it was
+  wchar_t const* add(wchar_t const* base, wchar_t const* rel, wchar_t const* name)
+  {
+    size_t start = size;
+    wchar_t const* parts[3] = {base, rel, name};
+    for (int i = 0; i < 3; i++)
+    {
+      if (*parts[i] == 0)
+        continue;
+      if ((size > start && data[size - 1] != '\\' && data[size - 1] != '/' && !put(L"\\", 1)) ||
+          !put(parts[i], wcslen(parts[i])))
+      {
+        size = start;
+        return NULL;
+      }
+    }
+    if (!put(L"", 0))
+    {
+      size = start;
+      return NULL;
+    }
+    size++;
+    return data + start;
+  }
+  wchar_t const* list()
+  {
+    static wchar_t const empty[2] = {0, 0};
+    if (data == NULL)
+      return empty;
+    data[size] = 0;
+    return data;
+  }
+};
+static wchar_t* wide_copy(wchar_t const* str)
+{
+  size_t size = (wcslen(str) + 1) * sizeof(wchar_t);
+  wchar_t* res = (wchar_t*) malloc(size);
+  memcpy(res, str, size);
+  return res;
 }
+// os.copytree without a callback: the tree is listed by a DirWalker and copied on a worker thread,
+// so the engine keeps running however large the tree is; each directory's files are copied as soon
+// as its batch arrives, which keeps the lists small and overlaps copying with the scan
+class CopyTreeOp : public ilua::SlowOperation
+{
+  wchar_t* m_from;
+  wchar_t* m_to;
+public:
+  CopyTreeOp(wchar_t const* from, wchar_t const* to)
+    : m_from(wide_copy(from))
+    , m_to(wide_copy(to))
+  {}
+  ~CopyTreeOp()
+  {
+    free(m_from);
+    free(m_to);
+  }
+
+  void run()
+  {
+    bool ok = true;
+    {
+      size_t base = wcslen(m_from);
+      wchar_t name[MAX_PATH];
+      CreateDirectory(m_to, NULL);
+      DirWalker walker(m_from, NULL, 0);
+      while (DirWalker::Batch* batch = walker.next())
+      {
+        wchar_t const* rel = batch->path + base;
+        while (*rel == '\\' || *rel == '/')
+          rel++;
+        if (!batch->complete)
+          ok = false;
+        char const* utf = batch->dirs.data;
+        for (int i = 0; i < batch->dirs.count; i++, utf += strlen(utf) + 1)
+        {
+          PathList dir;
+          wchar_t const* path = NULL;
+          if (MultiByteToWideChar(CP_UTF8, 0, utf, -1, name, MAX_PATH))
+            path = dir.add(m_to, rel, name);
+          if (path)
+            CreateDirectory(path, NULL);
+          else
+            ok = false;
+        }
+        PathList from;
+        PathList to;
+        bool listed = true;
+        utf = batch->files.data;
+        for (int i = 0; listed && i < batch->files.count; i++, utf += strlen(utf) + 1)
+        {
+          if (!MultiByteToWideChar(CP_UTF8, 0, utf, -1, name, MAX_PATH))
+            ok = false;
+          else if (!from.add(batch->path, L"", name) || !to.add(m_to, rel, name))
+            listed = false;
+        }
+        // the lists no longer line up once an entry is missing from one of them
+        if (!listed)
+          ok = false;
+        else if (from.size && FileOp::shell(FileOp::fCopy, from.list(), to.list()) != 0)
+          ok = false;
+        delete batch;
+      }
+    }
+
+    lua_State* L = output_begin();
+    lua_pushboolean(L, ok);
+    output_end();
+  }
+};
+
 static int file_copystat(lua_State* L)
 {
   char const* arg1 = luaL_checkstring(L, 1);
@@ -218,6 +335,8 @@ static int os_copytree(lua_State* L)
     return 1;
   }
   int callback = (lua_gettop(L) > 2 ? 3 : 0);
+  if (callback == 0)
+    return (new(L) CopyTreeOp(src.c_str(), dst.c_str()))->start(L);
   lua_settop(L, 3);
 
   CopyTreeData* cd = ilua::newstruct<CopyTreeData>(L);
@@ -575,7 +694,6 @@ static int file_settime(lua_State* L)
 void fileutil_bind(lua_State* L)
 {
   ilua::openlib(L, "file");
-  ilua::bindmethod(L, "open", file_open);
   ilua::bindmethod(L, "copy", file_copy);
   ilua::bindmethod(L, "copystat", file_copystat);
   ilua::bindmethod(L, "move", file_move);
@@ -617,4 +735,5 @@ void fileutil_bind(lua_State* L)
   lua_pop(L, 1);
 
   path_bind(L);
+  walker_bind(L);
 }
@@ -5,5 +5,6 @@
 
 void fileutil_bind(lua_State* L);
 void path_bind(lua_State* L);
+void walker_bind(lua_State* L);
 
 #endif // __CORE_FILEUTIL__
@@ -1,13 +1,29 @@
 #include "file.h"
 #include "fileutil.h"
 
-extern "C" __declspec(dllexport) void StartModule(lua_State* L)
+ILUA_MODULE(file)
 {
   SystemFile::bind(L);
+#ifdef _WIN32
   fileutil_bind(L);
+#endif
 }
 
+#ifndef ILUA_STATIC_MODULES
+#ifdef _WIN32
 BOOL WINAPI DllMain(HINSTANCE hInst, DWORD reason, LPVOID reserved)
 {
   return TRUE;
 }
+#else
+// entry point for require "file" from a plain Lua interpreter
+extern "C" ILUA_EXPORT int luaopen_file(lua_State* L)
+{
+  ilua::openbase(L);
+  ilua::openstream(L);
+  StartModule(L);
+  lua_getglobal(L, "file");
+  return 1;
+}
+#endif
+#endif
@@ -0,0 +1,330 @@
+#include "walker.h"
+#include "fileutil.h"
+#include "base/string.h"
+#include "base/wstring.h"
+#include <shlwapi.h>
+
+#define WALK_MAXWORKERS   8
+#define WALK_BACKLOG      1024
+
+// workers only use plain buffers: the shared empty String/WideString is reference counted
+// without interlocking
+static wchar_t* path_copy(wchar_t const* path)
+{
+  size_t size = (wcslen(path) + 1) * sizeof(wchar_t);
+  wchar_t* res = (wchar_t*) malloc(size);
+  memcpy(res, path, size);
+  return res;
+}
+static wchar_t* path_join(wchar_t const* path, wchar_t const* name)
+{
+  size_t plen = wcslen(path);
+  size_t nlen = wcslen(name);
+  wchar_t* res = (wchar_t*) malloc((plen + nlen + 2) * sizeof(wchar_t));
+  if (res == NULL)
+    return NULL;
+  memcpy(res, path, plen * sizeof(wchar_t));
+  if (plen && path[plen - 1] != '/' && path[plen - 1] != '\\')
+    res[plen++] = '\\';
+  memcpy(res + plen, name, (nlen + 1) * sizeof(wchar_t));
+  return res;
+}
+
+bool DirWalker::NameList::add(wchar_t const* name)
+{
+  int need = WideCharToMultiByte(CP_UTF8, 0, name, -1, NULL, 0, NULL, NULL);
+  if (need <= 0)
+    return false;
+  if (size + need > capacity)
+  {
+    size_t grow = (capacity ? capacity : 256);
+    while (grow < size + need)
+      grow *= 2;
+    char* grown = (char*) realloc(data, grow);
+    if (grown == NULL)
+      return false;
+    data = grown;
+    capacity = grow;
+  }
+  WideCharToMultiByte(CP_UTF8, 0, name, -1, data + size, need, NULL, NULL);
+  size += need;
+  count++;
+  return true;
+}
+
+DirWalker::DirWalker(wchar_t const* root, wchar_t const* filter, int workers)
+  : m_work(true)
+  , m_room(true)
+  , m_ready(false)
+  , m_first(NULL)
+  , m_last(NULL)
+  , m_batches(0)
+  , m_pending(1)
+  , m_stop(false)
+  , m_filter(filter ? path_copy(filter) : NULL)
+  , m_engine(NULL)
+  , m_waiter(NULL)
+{
+  m_queue.push(path_copy(root));
+  if (workers <= 0)
+  {
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    workers = si.dwNumberOfProcessors;
+  }
+  if (workers > WALK_MAXWORKERS)
+    workers = WALK_MAXWORKERS;
+  for (int i = 0; i < workers; i++)
+    m_threads.push(thread::create(this, &DirWalker::worker));
+}
+DirWalker::~DirWalker()
+{
+  m_lock.acquire();
+  m_stop = true;
+  m_work.set();
+  m_room.set();
+  m_lock.release();
+  for (int i = 0; i < m_threads.length(); i++)
+  {
+    WaitForSingleObject(m_threads[i], INFINITE);
+    CloseHandle(m_threads[i]);
+  }
+  for (int i = 0; i < m_queue.length(); i++)
+    free(m_queue[i]);
+  while (m_first)
+  {
+    Batch* batch = m_first;
+    m_first = batch->next;
+    delete batch;
+  }
+  if (m_waiter)
+    m_waiter->release();
+  free(m_filter);
+}
+
+int DirWalker::worker()
+{
+  while (true)
+  {
+    m_room.wait();
+    m_work.wait();
+    m_lock.acquire();
+    if (m_stop)
+    {
+      m_lock.release();
+      return 0;
+    }
+    wchar_t* path = NULL;
+    if (m_queue.length())
+    {
+      path = m_queue.top();
+      m_queue.pop();
+    }
+    if (m_queue.length() == 0)
+      m_work.reset();
+    m_lock.release();
+    if (path)
+      scan(path);
+  }
+}
+void DirWalker::scan(wchar_t* path)
+{
+  Batch* batch = new Batch(path);
+  Array<wchar_t*> subdirs;
+  WIN32_FIND_DATA data;
+  wchar_t* mask = path_join(path, L"*");
+  // skipping short names and fetching in large blocks saves round trips on big and remote
+  // directories; neither is supported before Windows 7
+  HANDLE hFind = INVALID_HANDLE_VALUE;
+  if (mask)
+  {
+    hFind = FindFirstFileEx(mask, FindExInfoBasic, &data, FindExSearchNameMatch, NULL,
+      FIND_FIRST_EX_LARGE_FETCH);
+    if (hFind == INVALID_HANDLE_VALUE && GetLastError() == ERROR_INVALID_PARAMETER)
+      hFind = FindFirstFile(mask, &data);
+    free(mask);
+  }
+  else
+    batch->complete = false;
+  BOOL success = (hFind != INVALID_HANDLE_VALUE);
+  while (success)
+  {
+    if (wcscmp(data.cFileName, L".") && wcscmp(data.cFileName, L".."))
+    {
+      if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+      {
+        wchar_t* sub = path_join(path, data.cFileName);
+        if (sub && batch->dirs.add(data.cFileName))
+          subdirs.push(sub);
+        else
+        {
+          free(sub);
+          batch->complete = false;
+        }
+      }
+      else if (m_filter == NULL || PathMatchSpec(data.cFileName, m_filter))
+      {
+        if (!batch->files.add(data.cFileName))
+          batch->complete = false;
+      }
+    }
+    success = FindNextFile(hFind, &data);
+  }
+  if (hFind != INVALID_HANDLE_VALUE)
+    FindClose(hFind);
+
+  m_lock.acquire();
+  // the batch goes out before its subdirectories are queued, so parents always come first
+  if (m_last)
+    m_last->next = batch;
+  else
+    m_first = batch;
+  m_last = batch;
+  if (++m_batches >= WALK_BACKLOG)
+    m_room.reset();
+  for (int i = 0; i < subdirs.length(); i++)
+    m_queue.push(subdirs[i]);
+  if (m_queue.length())
+    m_work.set();
+  m_pending += subdirs.length() - 1;
+  // all done: let the workers go
+  if (m_pending == 0)
+  {
+    m_stop = true;
+    m_work.set();
+    m_room.set();
+  }
+  m_ready.set();
+  ilua::Thread* wake = m_waiter;
+  m_waiter = NULL;
+  m_lock.release();
+  if (wake)
+  {
+    m_engine->lock();
+    wake->resume();
+    wake->release();
+    m_engine->unlock();
+  }
+}
+
+DirWalker::Batch* DirWalker::next(lua_State* L, bool* parked)
+{
+  while (true)
+  {
+    m_lock.acquire();
+    if (m_first)
+    {
+      Batch* batch = m_first;
+      m_first = batch->next;
+      if (m_first == NULL)
+      {
+        m_last = NULL;
+        if (m_pending)
+          m_ready.reset();
+      }
+      if (--m_batches < WALK_BACKLOG)
+        m_room.set();
+      m_lock.release();
+      return batch;
+    }
+    if (m_pending == 0)
+    {
+      m_lock.release();
+      return NULL;
+    }
+    // Lua threads are suspended until a worker delivers the next batch; anything else (the main
+    // chunk, a coroutine) waits, which is safe because workers only lock the engine to resume
+    ilua::Thread* t = (L && parked ? ilua::engine(L)->current_thread() : NULL);
+    if (t && t->state() == L && m_waiter == NULL)
+    {
+      m_engine = ilua::engine(L);
+      m_waiter = t;
+      t->addref();
+      t->suspend();
+      m_lock.release();
+      *parked = true;
+      return NULL;
+    }
+    m_lock.release();
+    m_ready.wait();
+  }
+}
+
+struct ScanData
+{
+  DirWalker* walker;
+  ScanData()
+    : walker(NULL)
+  {}
+  ~ScanData()
+  {
+    delete walker;
+  }
+};
+static void push_names(lua_State* L, DirWalker::NameList const& list)
+{
+  lua_createtable(L, list.count, 0);
+  char const* name = list.data;
+  for (int i = 1; i <= list.count; i++)
+  {
+    size_t len = strlen(name);
+    lua_pushlstring(L, name, len);
+    lua_rawseti(L, -2, i);
+    name += len + 1;
+  }
+}
+static int os_scan_iter(lua_State* L)
+{
+  ScanData* sd = ilua::tostruct<ScanData>(L, 1);
+  if (sd == NULL || sd->walker == NULL)
+  {
+    lua_pushnil(L);
+    return 1;
+  }
+  bool parked = false;
+  DirWalker::Batch* batch = sd->walker->next(L, &parked);
+  if (parked)
+    return lua_yieldk(L, 0, 0, os_scan_iter);
+  if (batch == NULL)
+  {
+    // stop the workers now rather than when the iterator is collected
+    delete sd->walker;
+    sd->walker = NULL;
+    lua_pushnil(L);
+    return 1;
+  }
+  if (!batch->complete)
+  {
+    delete batch;
+    luaL_error(L, "os.scan: not enough memory to list a directory");
+  }
+  lua_pushstring(L, String(batch->path));
+  push_names(L, batch->dirs);
+  push_names(L, batch->files);
+  delete batch;
+  return 3;
+}
+// os.scan(path[, filter[, workers]]) returns (path, dirs, files) for every directory in the tree
+// like os.walk, but lists the directories on a pool of worker threads while the caller runs
+// directories come parents first and otherwise in no particular order, and the dirs table cannot
+// prune the walk; `filter' is a wildcard list ("*.c;*.h") selecting the files to return, so the
+// rest never become Lua strings
+static int os_scan(lua_State* L)
+{
+  char const* arg1 = luaL_checkstring(L, 1);
+  WideString path = WideString::getFullPathName(WideString(arg1));
+  WideString filter(luaL_optstring(L, 2, ""));
+  int workers = luaL_optint(L, 3, 0);
+  lua_pushcfunction(L, os_scan_iter);
+  ScanData* sd = ilua::newstruct<ScanData>(L);
+  sd->walker = new DirWalker(path.c_str(), filter.length() ? filter.c_str() : NULL, workers);
+  lua_pushnil(L);
+  return 3;
+}
+
+void walker_bind(lua_State* L)
+{
+  ilua::openlib(L, "os");
+  ilua::bindmethod(L, "scan", os_scan);
+  lua_pop(L, 1);
+}
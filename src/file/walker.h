@@ -0,0 +1,79 @@
+#ifndef __FILE_WALKER__
+#define __FILE_WALKER__
+
+#include <windows.h>
+#include <stdlib.h>
+#include "base/thread.h"
+#include "base/array.h"
+#include "ilua/ilua.h"
+
+// parallel directory scanner: a pool of workers lists directories and queues their
+// subdirectories for each other; every listed directory becomes one batch
+// batches are handed out parents first, otherwise in no particular order
+class DirWalker
+{
+public:
+  // zero-separated UTF-8 names
+  struct NameList
+  {
+    char* data;
+    size_t size;
+    size_t capacity;
+    int count;
+    NameList()
+      : data(NULL), size(0), capacity(0), count(0)
+    {}
+    ~NameList()
+    {
+      free(data);
+    }
+    // false if the name was dropped for lack of memory
+    bool add(wchar_t const* name);
+  };
+  struct Batch
+  {
+    Batch* next;
+    wchar_t* path;
+    NameList dirs;
+    NameList files;
+    bool complete;              // false if entries were dropped for lack of memory
+    Batch(wchar_t* p)
+      : next(NULL), path(p), complete(true)
+    {}
+    ~Batch()
+    {
+      free(path);
+    }
+  };
+
+  // `filter' is a wildcard list ("*.c;*.h") applied to file names, NULL for all files;
+  // `workers' of 0 picks one per processor
+  DirWalker(wchar_t const* root, wchar_t const* filter, int workers);
+  ~DirWalker();
+
+  // next batch, or NULL once everything was scanned; the caller deletes the batch
+  // from a Lua thread this parks the thread and returns NULL with `*parked' set instead of
+  // waiting; the caller should yield and try again when resumed
+  Batch* next(lua_State* L = NULL, bool* parked = NULL);
+
+private:
+  thread::Lock m_lock;
+  thread::Event m_work;         // set while directories are queued or the walk is stopping
+  thread::Event m_room;         // set while fewer than WALK_BACKLOG batches are waiting
+  thread::Event m_ready;        // set while batches are waiting or the walk is over
+  Array<wchar_t*> m_queue;
+  Batch* m_first;
+  Batch* m_last;
+  int m_batches;
+  int m_pending;                // directories queued or being scanned
+  bool m_stop;
+  wchar_t* m_filter;
+  Array<HANDLE> m_threads;
+  ilua::Engine* m_engine;
+  ilua::Thread* m_waiter;
+
+  int worker();
+  void scan(wchar_t* path);
+};
+
+#endif // __FILE_WALKER__
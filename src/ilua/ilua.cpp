@@ -1,16 +1,32 @@
 #include "ilua.h"
 #include "base/types.h"
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <stdio.h>
+#define InterlockedIncrement(p)   __sync_add_and_fetch(p, 1)
+#define InterlockedDecrement(p)   __sync_sub_and_fetch(p, 1)
+#endif
+#include <ctype.h>
+#include <string.h>
 
 void luaL_printf(luaL_Buffer *B, const char *fmt, ...)
 {
   va_list ap;
   va_start(ap, fmt);
 
+#ifdef _MSC_VER
   size_t size = _vscprintf(fmt, ap);
+#else
+  va_list aq;
+  va_copy(aq, ap);
+  size_t size = vsnprintf(NULL, 0, fmt, aq);
+  va_end(aq);
+#endif
   char* buf = luaL_prepbuffsize(B, size + 1);
   vsprintf(buf, fmt, ap);
   luaL_addsize(B, size);
+  va_end(ap);
 }
 
 namespace ilua
@@ -80,12 +96,12 @@ static int nilpairs(lua_State* L)
 }
 static int pairsiter(lua_State* L)
 {
-  luaL_checktype(L, 1, LUA_TTABLE);
-  lua_settop(L, 2);
-  if (lua_next(L, 1))
-    return 2;
-  lua_pushnil(L);
-  return 1;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 2);
+  if (lua_next(L, 1))
+    return 2;
+  lua_pushnil(L);
+  return 1;
 }
 static int __pairs(lua_State* L)
 {
@@ -302,6 +318,75 @@ Engine* engine(lua_State* L)
   return e;
 }
 
+void openbase(lua_State* L)
+{
+  lua_getfield(L, LUA_REGISTRYINDEX, ILUA_TABLE_META);
+  bool present = lua_istable(L, -1);
+  lua_pop(L, 1);
+  if (present)
+    return;
+
+  lua_newtable(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, ILUA_TABLE_META);
+  lua_newtable(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, ILUA_TABLE_BASIC);
+  lua_newtable(L);
+  lua_newtable(L);
+  lua_pushstring(L, "v");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_setfield(L, LUA_REGISTRYINDEX, ILUA_TABLE_BIND);
+  lua_newtable(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, ILUA_TABLE_XREF);
+  lua_newtable(L);
+  lua_newtable(L);
+  lua_pushstring(L, "k");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_setfield(L, LUA_REGISTRYINDEX, ILUA_TABLE_EXTRA);
+
+  newtype<Object>(L, "object");
+  lua_pop(L, 2);
+}
+
+StaticModule* StaticModule::first = NULL;
+
+StaticModule::StaticModule(char const* n, ModuleEntry f, char const* en)
+  : name(n)
+  , entry(en)
+  , func(f)
+  , next(first)
+{
+  first = this;
+}
+static bool modnameeq(char const* a, char const* b, int blen)
+{
+  for (int i = 0; i < blen; i++)
+    if (a[i] == 0 || tolower((unsigned char) a[i]) != tolower((unsigned char) b[i]))
+      return false;
+  return a[blen] == 0;
+}
+ModuleEntry StaticModule::find(char const* path, char const* entry)
+{
+  char const* title = path;
+  for (char const* p = path; *p; p++)
+    if (*p == '/' || *p == '\\' || *p == ':')
+      title = p + 1;
+  int len = strlen(title);
+  for (int i = len - 1; i > 0; i--)
+  {
+    if (title[i] == '.')
+    {
+      len = i;
+      break;
+    }
+  }
+  for (StaticModule* m = first; m; m = m->next)
+    if (modnameeq(m->name, title, len) && (entry == NULL || !strcmp(entry, m->entry)))
+      return m->func;
+  return NULL;
+}
+
 }
 
 void* operator new(size_t count, lua_State* L, char const* name)
@@ -11,6 +11,31 @@
 #define ILUA_TABLE_XREF   "ilua_xref"
 #define ILUA_TABLE_EXTRA  "ilua_xtra"
 
+#ifdef _WIN32
+#define ILUA_EXPORT       __declspec(dllexport)
+#else
+#define ILUA_EXPORT       __attribute__((visibility("default")))
+#endif
+
+// declare the module entry point
+// use: ILUA_MODULE(file) { bind functions here }
+// with ILUA_STATIC_MODULES defined the module is registered with the engine
+// instead of being exported, so it can be linked into the executable
+// the linker drops library objects nothing refers to, so an executable linking modules from
+// static libraries names each of them once at file scope: ILUA_USE_MODULE(file)
+// (linking the libraries with /WHOLEARCHIVE or --whole-archive works as well)
+#ifdef ILUA_STATIC_MODULES
+#define ILUA_MODULE(name) \
+  static void StartModule_##name(lua_State* L); \
+  ilua::StaticModule ilua_module_##name(#name, StartModule_##name); \
+  static void StartModule_##name(lua_State* L)
+#define ILUA_USE_MODULE(name) \
+  extern ilua::StaticModule ilua_module_##name; \
+  ilua::StaticModule* ilua_use_module_##name = &ilua_module_##name
+#else
+#define ILUA_MODULE(name) extern "C" ILUA_EXPORT void StartModule(lua_State* L)
+#endif
+
 // no idea why it doesn't exist in the original lauxlib
 void luaL_printf(luaL_Buffer *B, const char *fmt, ...);
 
@@ -299,6 +324,30 @@ public:
   virtual void exit(int code) = 0;
 };
 
+////////////////////////////////////// MODULES ////////////////////////////////
+
+typedef void (*ModuleEntry)(lua_State* L);
+
+// modules loaded with require by a plain Lua interpreter have no engine; this creates the
+// registry tables and the "object" type the engine sets up, and does nothing under the engine
+void openbase(lua_State* L);
+
+// modules linked directly into the executable register themselves during static
+// initialization; Engine::load_module checks this list before searching for files
+class StaticModule
+{
+  char const* name;
+  char const* entry;
+  ModuleEntry func;
+  StaticModule* next;
+  static StaticModule* first;
+public:
+  StaticModule(char const* name, ModuleEntry func, char const* entry = "StartModule");
+
+  // `name' may include a path and extension, only the file title is compared
+  static ModuleEntry find(char const* name, char const* entry = NULL);
+};
+
 // get engine associated with the state
 Engine* engine(lua_State* L);
 
@@ -1,23 +1,55 @@
 #include "stream.h"
+#include <stdlib.h>
 
 namespace ilua
 {
 
+// staging buffer for sources that do not expose their memory; allocated per call so that
+// streams can be copied from several OS threads at once
+#define COPY_BUFFER     0x100000
+
 int64 Stream::copy(Stream* stream, int64 count)
 {
-  static unsigned char buf[4096];
+  unsigned char local[4096];
+  unsigned char* buf = NULL;
+  int bufsize = 0;
   int64 done = 0;
   while (count == 0 || done < count)
   {
-    int64 to = sizeof buf;
-    if (count != 0 && done + to > count)
-      to = count - done;
+    int64 want = (count ? count - done : COPY_BUFFER);
+    // write straight from the source's memory when it has some
+    int avail;
+    char const* span = (stream != this ? stream->peek(&avail) : NULL);
+    if (span)
+    {
+      if (avail > want)
+        avail = int(want);
+      int written = write(span, avail);
+      stream->seek(written, SEEK_CUR);
+      done += written;
+      if (written < avail)
+        break;
+      continue;
+    }
+    if (buf == NULL)
+    {
+      bufsize = COPY_BUFFER;
+      buf = (unsigned char*) malloc(bufsize);
+      if (buf == NULL)
+      {
+        buf = local;
+        bufsize = sizeof local;
+      }
+    }
+    int to = (want > bufsize ? bufsize : int(want));
     to = stream->read(buf, to);
     if (to == 0)
       break;
     write(buf, to);
     done += to;
   }
+  if (buf != local)
+    free(buf);
   return done;
 }
 void Stream::serialize(lua_State* L, int index)
@@ -39,6 +71,140 @@ void Stream::deserialize(lua_State* L)
   lua_pop(L, 1);
 }
 
+BufferedStream::BufferedStream(Stream* s, int readSize, int writeSize)
+  : stream(s)
+  , rbuf(NULL)
+  , rsize(readSize > 0 ? readSize : 0)
+  , rpos(0)
+  , rcount(0)
+  , wbuf(NULL)
+  , wsize(writeSize > 0 ? writeSize : 0)
+  , wcount(0)
+{
+}
+BufferedStream::~BufferedStream()
+{
+  free(rbuf);
+  free(wbuf);
+}
+// read the next block of the source; false if there is nothing left (or no read buffer)
+bool BufferedStream::fill()
+{
+  if (rsize == 0)
+    return false;
+  if (rbuf == NULL && (rbuf = (char*) malloc(rsize)) == NULL)
+  {
+    rsize = 0;
+    return false;
+  }
+  rpos = 0;
+  rcount = stream->read(rbuf, rsize);
+  return rcount > 0;
+}
+// forget the read-ahead, moving the source back to the logical position
+void BufferedStream::dropread()
+{
+  if (rpos < rcount)
+    stream->seek(rpos - rcount, SEEK_CUR);
+  rpos = rcount = 0;
+}
+bool BufferedStream::flushwrite()
+{
+  if (wcount == 0)
+    return true;
+  int done = stream->write(wbuf, wcount);
+  if (done > 0 && done < wcount)
+    memmove(wbuf, wbuf + done, wcount - done);
+  wcount -= (done > 0 ? done : 0);
+  return wcount == 0;
+}
+
+int BufferedStream::read(void* vbuf, int count)
+{
+  if (!flushwrite())
+    return 0;
+  char* buf = (char*) vbuf;
+  int total = 0;
+  while (count > 0)
+  {
+    if (rpos < rcount)
+    {
+      int add = (count < rcount - rpos ? count : rcount - rpos);
+      memcpy(buf, rbuf + rpos, add);
+      rpos += add;
+      buf += add;
+      count -= add;
+      total += add;
+    }
+    else if (count >= rsize)
+    {
+      // large reads bypass the buffer
+      total += stream->read(buf, count);
+      break;
+    }
+    else if (!fill())
+      break;
+  }
+  return total;
+}
+int BufferedStream::write(void const* vbuf, int count)
+{
+  dropread();
+  if (wcount + count > wsize && !flushwrite())
+    return 0;
+  if (count >= wsize)
+    return stream->write(vbuf, count);
+  if (wbuf == NULL && (wbuf = (char*) malloc(wsize)) == NULL)
+  {
+    wsize = 0;
+    return stream->write(vbuf, count);
+  }
+  memcpy(wbuf + wcount, vbuf, count);
+  wcount += count;
+  return count;
+}
+char const* BufferedStream::peek(int* count)
+{
+  *count = 0;
+  if (!flushwrite())
+    return NULL;
+  if (rpos == rcount)
+  {
+    // the source's own memory is better than a copy of it
+    char const* span = stream->peek(count);
+    if (span || !fill())
+      return span;
+  }
+  *count = rcount - rpos;
+  return rbuf + rpos;
+}
+
+void BufferedStream::seek(int64 pos, int rel)
+{
+  flushwrite();
+  // moving within the read-ahead works on streams that cannot seek
+  if (rel == SEEK_CUR && pos >= -rpos && pos <= rcount - rpos)
+  {
+    rpos += int(pos);
+    return;
+  }
+  if (rel == SEEK_CUR)
+    pos -= rcount - rpos;
+  rpos = rcount = 0;
+  stream->seek(pos, rel);
+}
+void BufferedStream::resize(int64 newsize)
+{
+  flushwrite();
+  dropread();
+  stream->resize(newsize);
+}
+void BufferedStream::flush()
+{
+  flushwrite();
+  stream->flush();
+}
+
 int isbuffer(lua_State* L, int index)
 {
   return (iskindof(L, index, "stream") || lua_isstring(L, index));
@@ -68,6 +234,26 @@ char const* optbuffer(lua_State* L, int index, char const* d, size_t* len)
   return luaL_optlstring(L, index, d, len);
 }
 
+// blocks are freed by the module that allocated them
+static void destroy_block(SharedBlock* block)
+{
+  free(block);
+}
+SharedBlock* SharedBlock::create(void const* data, size_t length)
+{
+  if (length > size_t(-1) - sizeof(SharedBlock))
+    return NULL;
+  SharedBlock* block = (SharedBlock*) malloc(sizeof(SharedBlock) + length);
+  if (block == NULL)
+    return NULL;
+  block->ref = 1;
+  block->length = length;
+  block->destroy = destroy_block;
+  if (data)
+    memcpy(block + 1, data, length);
+  return block;
+}
+
 typedef void (*push_buffer_type)(lua_State*, void const*, size_t);
 void pushbuffer(lua_State* L, void const* data, size_t length)
 {
@@ -80,6 +266,27 @@ void pushbuffer(lua_State* L, void const* data, size_t length)
     lua_pushnil(L);
 }
 
+typedef void (*push_shared_type)(lua_State*, SharedBlock*);
+void pushshared(lua_State* L, SharedBlock* block)
+{
+  lua_getfield(L, LUA_REGISTRYINDEX, "ilua_push_shared");
+  push_shared_type pf = (push_shared_type) lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (pf && block)
+    pf(L, block);
+  else
+    lua_pushnil(L);
+}
+typedef SharedBlock* (*to_shared_type)(lua_State*, int);
+SharedBlock* toshared(lua_State* L, int index)
+{
+  index = lua_absindex(L, index);
+  lua_getfield(L, LUA_REGISTRYINDEX, "ilua_to_shared");
+  to_shared_type tf = (to_shared_type) lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return (tf ? tf(L, index) : NULL);
+}
+
 void stream_noseek(lua_State* L)
 {
   ilua::settabsn(L, "seek");
@@ -98,7 +305,14 @@ void stream_noread(lua_State* L)
   ilua::settabsn(L, "readdouble");
   ilua::settabsn(L, "readstr");
   ilua::settabsn(L, "readbuf");
+  ilua::settabsn(L, "read16array");
+  ilua::settabsn(L, "read32array");
+  ilua::settabsn(L, "read64array");
+  ilua::settabsn(L, "readfloatarray");
+  ilua::settabsn(L, "readdoublearray");
+  ilua::settabsn(L, "unpack");
   ilua::settabsn(L, "deserialize");
+  ilua::settabsn(L, "restore");
   ilua::settabsn(L, "getline");
   ilua::settabsn(L, "lines");
 }
@@ -113,10 +327,103 @@ void stream_nowrite(lua_State* L)
   ilua::settabsn(L, "writedouble");
   ilua::settabsn(L, "writestr");
   ilua::settabsn(L, "writebuf");
+  ilua::settabsn(L, "write16array");
+  ilua::settabsn(L, "write32array");
+  ilua::settabsn(L, "write64array");
+  ilua::settabsn(L, "writefloatarray");
+  ilua::settabsn(L, "writedoublearray");
+  ilua::settabsn(L, "pack");
   ilua::settabsn(L, "serialize");
+  ilua::settabsn(L, "snapshot");
   ilua::settabsn(L, "copy");
   ilua::settabsn(L, "printf");
   ilua::settabsn(L, "flush");
 }
 
+static int basic_read(lua_State* L)
+{
+  Stream* stream = checkobject<Stream>(L, 1, "stream");
+  int n = lua_gettop(L);
+  for (int i = 2; i <= n; i++)
+  {
+    int count = luaL_checkint(L, i);
+    luaL_Buffer b;
+    char* p = luaL_buffinitsize(L, &b, count);
+    int got = stream->read(p, count);
+    luaL_pushresultsize(&b, got);
+    if (got == 0)
+    {
+      lua_pop(L, 1);
+      lua_pushnil(L);
+    }
+  }
+  return n - 1;
+}
+static int basic_write(lua_State* L)
+{
+  Stream* stream = checkobject<Stream>(L, 1, "stream");
+  int n = lua_gettop(L);
+  for (int i = 2; i <= n; i++)
+  {
+    size_t count;
+    char const* str = checkbuffer(L, i, &count);
+    stream->write(str, count);
+  }
+  return 0;
+}
+static int basic_seek(lua_State* L)
+{
+  static int modes[] = {SEEK_SET, SEEK_CUR, SEEK_END};
+  static char const* modenames[] = {"set", "cur", "end", NULL};
+  Stream* stream = checkobject<Stream>(L, 1, "stream");
+  int64 offset = int64(luaL_checknumber(L, 2));
+  stream->seek(offset, modes[checkoption(L, 3, "set", modenames)]);
+  return 0;
+}
+static int basic_tell(lua_State* L)
+{
+  lua_pushnumber(L, (lua_Number) checkobject<Stream>(L, 1, "stream")->tell());
+  return 1;
+}
+static int basic_size(lua_State* L)
+{
+  lua_pushnumber(L, (lua_Number) checkobject<Stream>(L, 1, "stream")->size());
+  return 1;
+}
+static int basic_eof(lua_State* L)
+{
+  lua_pushboolean(L, checkobject<Stream>(L, 1, "stream")->eof());
+  return 1;
+}
+static int basic_resize(lua_State* L)
+{
+  checkobject<Stream>(L, 1, "stream")->resize((int64) luaL_checknumber(L, 2));
+  return 0;
+}
+static int basic_flush(lua_State* L)
+{
+  checkobject<Stream>(L, 1, "stream")->flush();
+  return 0;
+}
+void openstream(lua_State* L)
+{
+  lua_getfield(L, LUA_REGISTRYINDEX, ILUA_TABLE_META);
+  lua_getfield(L, -1, "stream");
+  bool present = lua_istable(L, -1);
+  lua_pop(L, 2);
+  if (present)
+    return;
+
+  newtype<Stream>(L, "stream", "object");
+  bindmethod(L, "read", basic_read);
+  bindmethod(L, "write", basic_write);
+  bindmethod(L, "seek", basic_seek);
+  bindmethod(L, "tell", basic_tell);
+  bindmethod(L, "size", basic_size);
+  bindmethod(L, "eof", basic_eof);
+  bindmethod(L, "resize", basic_resize);
+  bindmethod(L, "flush", basic_flush);
+  lua_pop(L, 2);
+}
+
 }
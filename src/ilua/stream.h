@@ -3,7 +3,14 @@
 
 #include "ilua.h"
 #include <string.h>
+#include <stdio.h>
+#ifdef _MSC_VER
 #include <intrin.h>
+#else
+#define _byteswap_ushort  __builtin_bswap16
+#define _byteswap_ulong   __builtin_bswap32
+#define _byteswap_uint64  __builtin_bswap64
+#endif
 
 typedef long long int64;
 
@@ -19,6 +26,12 @@ public:
   virtual int read(void* buf, int count) {return 0;}
   virtual int write(void const* buf, int count) {return 0;}
 
+  // direct access to the bytes at the current position, without advancing it
+  // returns NULL if the stream cannot expose its data or there is nothing left to read,
+  // otherwise sets `count' to the number of contiguous bytes available (at least one)
+  // the pointer is only valid until the next call to any other stream method; consume with seek(n, SEEK_CUR)
+  virtual char const* peek(int* count) {*count = 0; return NULL;}
+
   virtual void seek(int64 pos, int rel) {}
   virtual int64 tell() const {return 0;}
 
@@ -46,7 +59,21 @@ public:
   int readstr(char* str, int size)
   {
     int count = 0;
-    while (count < size && (*str++ = getc()))
+    int avail;
+    char const* span;
+    while (count < size && (span = peek(&avail)) != NULL)
+    {
+      if (avail > size - count)
+        avail = size - count;
+      char const* end = (char const*) memchr(span, 0, avail);
+      int len = (end ? end - span + 1 : avail);
+      memcpy(str + count, span, len);
+      seek(len, SEEK_CUR);
+      if (end)
+        return count + len - 1;
+      count += len;
+    }
+    while (count < size && (str[count] = getc()))
       count++;
     return count;
   }
@@ -67,23 +94,30 @@ public:
 
   float readfloat(bool big = false)
   {
-    unsigned long res = read32(big);
-    return *(float*) &res;
+    unsigned int res = (unsigned int) read32(big);
+    float f;
+    memcpy(&f, &res, 4);
+    return f;
   }
   double readdouble(bool big = false)
   {
     unsigned long long res = 0;
     read(&res, 8);
     if (big) res = _byteswap_uint64(res);
-    return *(double*) &res;
+    double f;
+    memcpy(&f, &res, 8);
+    return f;
   }
   void writefloat(float f, bool big = false)
   {
-    write32(*(unsigned long*) &f, big);
+    unsigned int res;
+    memcpy(&res, &f, 4);
+    write32(res, big);
   }
   void writedouble(double f, bool big = false)
   {
-    unsigned long long res = *(unsigned long long*) &f;
+    unsigned long long res;
+    memcpy(&res, &f, 8);
     if (big) res = _byteswap_uint64(res);
     write(&res, 8);
   }
@@ -91,6 +125,7 @@ public:
   void serialize(lua_State* L, int index);
   void deserialize(lua_State* L);
 
+  // copy `count' bytes (0 = until the end) from `stream' at its current position
   virtual int64 copy(Stream* stream, int64 count = 0);
 
   virtual const char* tolstring(size_t* len)
@@ -99,11 +134,130 @@ public:
   }
 };
 
+// read-ahead and write-behind buffering on top of another stream
+// the wrapped stream is not owned and has to outlive the wrapper; pending writes are only
+// passed on by flush (or when the buffer fills up), the destructor drops them
+// mixing reads and writes requires a seekable stream
+class BufferedStream : public Stream
+{
+  Stream* stream;
+  char* rbuf;
+  int rsize;
+  int rpos;     // unread data is rbuf[rpos..rcount)
+  int rcount;
+  char* wbuf;
+  int wsize;
+  int wcount;
+
+  bool fill();
+  void dropread();
+  bool flushwrite();
+public:
+  // a size of 0 disables buffering in that direction
+  BufferedStream(Stream* stream, int readSize = 65536, int writeSize = 65536);
+  ~BufferedStream();
+
+  Stream* source()
+  {
+    return stream;
+  }
+
+  char getc()
+  {
+    if (rpos < rcount || (wcount == 0 && fill()))
+      return rbuf[rpos++];
+    return Stream::getc();
+  }
+  int putc(char c)
+  {
+    if (wbuf && rpos == rcount && wcount < wsize)
+    {
+      wbuf[wcount++] = c;
+      return 1;
+    }
+    return write(&c, 1);
+  }
+
+  int read(void* buf, int count);
+  int write(void const* buf, int count);
+  char const* peek(int* count);
+
+  void seek(int64 pos, int rel);
+  int64 tell() const
+  {
+    return stream->tell() - (rcount - rpos) + wcount;
+  }
+  int64 size() const
+  {
+    int64 end = stream->tell() + wcount;
+    int64 size = stream->size();
+    return (end > size ? end : size);
+  }
+  bool eof() const
+  {
+    if (rpos < rcount)
+      return false;
+    return (wcount ? tell() >= size() : stream->eof());
+  }
+  void resize(int64 newsize);
+  void flush();
+};
+
+// immutable block of bytes with an atomic reference count
+// not bound to any engine, so it can be handed to other states or OS threads without copying
+class SharedBlock
+{
+  volatile long ref;
+  size_t length;
+  void (*destroy)(SharedBlock* block);
+  SharedBlock() {}
+public:
+  // returns a block with one reference owned by the caller
+  static SharedBlock* create(void const* data, size_t length);
+
+  long addref()
+  {
+#ifdef _MSC_VER
+    return _InterlockedIncrement(&ref);
+#else
+    return __sync_add_and_fetch(&ref, 1);
+#endif
+  }
+  long release()
+  {
+#ifdef _MSC_VER
+    long result = _InterlockedDecrement(&ref);
+#else
+    long result = __sync_sub_and_fetch(&ref, 1);
+#endif
+    if (result == 0)
+      destroy(this);
+    return result;
+  }
+  long refcount() const
+  {
+    return ref;
+  }
+
+  char const* data() const
+  {
+    return (char const*) (this + 1);
+  }
+  size_t size() const
+  {
+    return length;
+  }
+};
+
 // remove seek, read or write methods from metatable
 void stream_noseek(lua_State* L);
 void stream_noread(lua_State* L);
 void stream_nowrite(lua_State* L);
 
+// without the engine (see openbase) there is no "stream" type to derive from; this binds one
+// with just read, write, seek, tell, size, eof, resize and flush, and does nothing under the engine
+void openstream(lua_State* L);
+
 int isbuffer(lua_State* L, int index);
 char const* tobuffer(lua_State* L, int index, size_t* len);
 char const* checkbuffer(lua_State* L, int index, size_t* len);
@@ -112,6 +266,11 @@ char const* optbuffer(lua_State* L, int index, char const* d, size_t* len);
 // create a buffer on stack; position is set to beginning
 void pushbuffer(lua_State* L, void const* data, size_t length);
 
+// create a shared.buffer on stack referencing `block'; position is set to beginning
+void pushshared(lua_State* L, SharedBlock* block);
+// block referenced by the shared.buffer at `index' (does not add a reference), or NULL
+SharedBlock* toshared(lua_State* L, int index);
+
 }
 
 #endif // __ILUA_STREAM__
@@ -362,7 +362,7 @@ static int input_waitdown(lua_State* L)
   return 1;
 }
 
-extern "C" __declspec(dllexport) void StartModule(lua_State* L)
+ILUA_MODULE(input)
 {
   ilua::newtype<InputModule>(L, MODULENAME, "object");
   lua_pop(L, 2);
@@ -434,7 +434,9 @@ extern "C" __declspec(dllexport) void StartModule(lua_State* L)
   lua_setfield(L, LUA_REGISTRYINDEX, MODULENAME);
 }
 
+#ifndef ILUA_STATIC_MODULES
 BOOL WINAPI DllMain(HINSTANCE hInst, DWORD reason, LPVOID reserved)
 {
   return TRUE;
 }
+#endif
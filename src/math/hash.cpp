@@ -2,6 +2,7 @@
 #include <intrin.h>
 #include <stdlib.h>
 #include "ilua/ilua.h"
+#include "ilua/stream.h"
 
 static void memflip(void* ptr, uint32 length, uint32 word)
 {
@@ -136,7 +137,7 @@ static int hs_update(lua_State* L)
 {
   HashState* state = ilua::checkobject<HashState>(L, 1, "hash");
   size_t length;
-  char const* str = luaL_checklstring(L, 2, &length);
+  char const* str = ilua::checkbuffer(L, 2, &length);
   hash_update(state, str, length);
   return 0;
 }
@@ -183,7 +184,7 @@ static int hf_init(lua_State* L)
 static int hf_digest(lua_State* L)
 {
   size_t length;
-  char const* msg = luaL_checklstring(L, 1, &length);
+  char const* msg = ilua::checkbuffer(L, 1, &length);
   char const* alg = luaL_optstring(L, 2, "MD5");
   int id = hash_algorithm_by_name(alg);
   if (id == 0) luaL_argerror(L, 2, "unknown algorithm");
@@ -201,7 +202,7 @@ static int hf_digest(lua_State* L)
 static int hf_digest_up(lua_State* L)
 {
   size_t length;
-  char const* msg = luaL_checklstring(L, 1, &length);
+  char const* msg = ilua::checkbuffer(L, 1, &length);
   int id = lua_tointeger(L, lua_upvalueindex(1));
 
   HashState* state = hash_init(NULL, id);
@@ -220,6 +221,141 @@ static void hf_regalg(lua_State* L, char const* name, int id)
   lua_pushcclosure(L, hf_digest_up, 1);
   lua_setfield(L, -2, name);
 }
+// stream.hashing(s[, alg]) passes reads and writes through to s and hashes every byte on the way,
+// so data can be verified while it is copied; :digest() returns the hash of the bytes so far
+// seeks are passed through as well, but only consuming peeked data is hashed; any other move
+// leaves bytes out of the hash, and :digest() raises an error from then on
+class HashingStream : public ilua::Stream
+{
+  ilua::Stream* m_stream;
+  int m_algorithm;
+  HashState* m_state;
+  char const* m_span;
+  int m_avail;
+  bool m_skipped;
+public:
+  HashingStream(ilua::Stream* stream, int algorithm)
+    : m_stream(stream)
+    , m_algorithm(algorithm)
+    , m_span(NULL)
+    , m_avail(0)
+    , m_skipped(false)
+  {
+    m_state = hash_init(NULL, algorithm);
+  }
+  ~HashingStream()
+  {
+    hash_free(m_state);
+  }
+  HashState* state()
+  {
+    return m_state;
+  }
+  int algorithm() const
+  {
+    return m_algorithm;
+  }
+  bool skipped() const
+  {
+    return m_skipped;
+  }
+
+  int read(void* buf, int count)
+  {
+    m_span = NULL;
+    int got = m_stream->read(buf, count);
+    if (got > 0)
+      hash_update(m_state, buf, got);
+    return got;
+  }
+  int write(void const* buf, int count)
+  {
+    m_span = NULL;
+    int done = m_stream->write(buf, count);
+    if (done > 0)
+      hash_update(m_state, buf, done);
+    return done;
+  }
+  // peeked bytes are hashed when they are consumed, without copying them
+  char const* peek(int* count)
+  {
+    m_span = m_stream->peek(&m_avail);
+    *count = m_avail;
+    return m_span;
+  }
+  void seek(int64 pos, int rel)
+  {
+    if (rel == SEEK_CUR && m_span && pos >= 0 && pos <= m_avail)
+    {
+      hash_update(m_state, m_span, uint32(pos));
+      m_stream->seek(pos, SEEK_CUR);
+      m_span = NULL;
+      return;
+    }
+    m_span = NULL;
+    int64 before = m_stream->tell();
+    m_stream->seek(pos, rel);
+    if (m_stream->tell() != before)
+      m_skipped = true;
+  }
+  int64 tell() const
+  {
+    return m_stream->tell();
+  }
+  int64 size() const
+  {
+    return m_stream->size();
+  }
+  bool eof() const
+  {
+    return m_stream->eof();
+  }
+  void flush()
+  {
+    m_stream->flush();
+  }
+};
+static int hs_stream(lua_State* L)
+{
+  ilua::Stream* stream = ilua::checkobject<ilua::Stream>(L, 1, "stream");
+  int id = hash_algorithm_by_name(luaL_optstring(L, 2, "MD5"));
+  if (id == 0) luaL_argerror(L, 2, "unknown algorithm");
+  new(L, "stream.hashing") HashingStream(stream, id);
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_setuservalue(L, -2);
+  return 1;
+}
+// finishes a copy of the state, so hashing can go on
+static int hs_digest(lua_State* L)
+{
+  HashingStream* stream = ilua::checkobject<HashingStream>(L, 1, "stream.hashing");
+  if (stream->skipped())
+    luaL_error(L, "stream position was moved, the digest does not cover the data");
+  HashState* state = stream->state();
+  uint32 space = hash_space(stream->algorithm());
+  HashState* copy = (HashState*) malloc(space);
+  if (copy == NULL)
+    luaL_error(L, "not enough memory");
+  memcpy(copy, state, space);
+  copy->state = (uint8*) (copy + 1);
+  copy->buffer = copy->state + copy->algorithm->stateSize;
+  luaL_Buffer b;
+  char* ptr = luaL_buffinitsize(L, &b, copy->algorithm->outputSize);
+  hash_finish(copy, ptr);
+  luaL_pushresultsize(&b, copy->algorithm->outputSize);
+  hash_free(copy);
+  return 1;
+}
+static int hs_source(lua_State* L)
+{
+  ilua::checkobject<HashingStream>(L, 1, "stream.hashing");
+  lua_getuservalue(L, 1);
+  lua_rawgeti(L, -1, 1);
+  return 1;
+}
+
 void hash_bind(lua_State* L)
 {
   ilua::newtype<HashState>(L, "hash");
@@ -240,6 +376,19 @@ void hash_bind(lua_State* L)
   hf_regalg(L, "sha384", HashAlgorithm::SHA384);
   hf_regalg(L, "sha512", HashAlgorithm::SHA512);
   lua_pop(L, 1);
+
+  ilua::newtype<HashingStream>(L, "stream.hashing", "stream");
+  ilua::settabsn(L, "seek");
+  ilua::settabsn(L, "resize");
+  ilua::settabsn(L, "getline");
+  ilua::settabsn(L, "lines");
+  ilua::bindmethod(L, "digest", hs_digest);
+  ilua::bindmethod(L, "source", hs_source);
+  lua_pop(L, 2);
+
+  ilua::openlib(L, "stream");
+  ilua::bindmethod(L, "hashing", hs_stream);
+  lua_pop(L, 1);
 }
 
 /////////////////////////////////////////////////////////////////////////
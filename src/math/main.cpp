@@ -7,7 +7,7 @@
 
 void bignum_bind(lua_State* L);
 
-extern "C" __declspec(dllexport) void StartModule(lua_State* L)
+ILUA_MODULE(math)
 {
   bignum_bind(L);
   hash_bind(L);
@@ -15,7 +15,9 @@ extern "C" __declspec(dllexport) void StartModule(lua_State* L)
   random_bind(L);
 }
 
+#ifndef ILUA_STATIC_MODULES
 BOOL WINAPI DllMain(HINSTANCE hInst, DWORD reason, LPVOID reserved)
 {
   return TRUE;
 }
+#endif
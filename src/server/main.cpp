@@ -40,14 +40,29 @@ public:
     LeaveCriticalSection(&lock);
   }
 };
+// passes everything written to it on as response data
+class ResponseSink : public ilua::Stream
+{
+  mg_connection* con;
+public:
+  ResponseSink(mg_connection* c)
+    : con(c)
+  {}
+  int write(void const* buf, int count)
+  {
+    mg_send_data(con, buf, count);
+    return count;
+  }
+};
+
 class Connection : public ilua::Stream
 {
   ilua::Engine* e;
   mg_connection* con;
   ilua::Thread* thread;
-  enum {bufSize = 256};
-  char buffer[bufSize];
-  int bufCount;
+  enum {bufSize = 4096};
+  ResponseSink sink;
+  ilua::BufferedStream out;
   bool written;
 public:
   Connection(lua_State* L, mg_connection* c);
@@ -79,7 +94,8 @@ public:
 Connection::Connection(lua_State* L, mg_connection* c)
   : con(c)
   , thread(NULL)
-  , bufCount(0)
+  , sink(c)
+  , out(&sink, 0, bufSize)
   , e(ilua::engine(L))
   , written(false)
 {
@@ -130,35 +146,11 @@ int Connection::onEvent(mg_event ev)
 int Connection::write(void const* buf, int count)
 {
   written = true;
-  char const* cbuf = (char const*) buf;
-  int add = 0;
-  if (bufCount)
-  {
-    add = bufSize - bufCount;
-    if (add > count) add = count;
-    memcpy(buffer + bufCount, cbuf, add);
-    bufCount += add;
-    cbuf += add;
-    count -= add;
-    if (bufCount >= bufSize)
-      flush();
-  }
-  if (bufCount + count >= bufSize)
-    mg_send_data(con, cbuf, count);
-  else
-  {
-    memcpy(buffer + bufCount, cbuf, count);
-    bufCount += count;
-  }
-  return add + count;
+  return out.write(buf, count);
 }
 void Connection::flush()
 {
-  if (bufCount)
-  {
-    mg_send_data(con, buffer, bufCount);
-    bufCount = 0;
-  }
+  out.flush();
 }
 
 int Server::mgHandler(mg_connection* con, mg_event ev)
@@ -397,7 +389,7 @@ static int server_redirect(lua_State* L)
   return 1;
 }
 
-extern "C" __declspec(dllexport) void StartModule(lua_State* L)
+ILUA_MODULE(server)
 {
   ilua::newtype<Server>(L, "server", "object");
   ilua::bindmethod(L, "shutdown", server_shutdown);
@@ -418,7 +410,9 @@ extern "C" __declspec(dllexport) void StartModule(lua_State* L)
   lua_pop(L, 1);
 }
 
+#ifndef ILUA_STATIC_MODULES
 BOOL WINAPI DllMain(HINSTANCE hInst, DWORD reason, LPVOID reserved)
 {
   return TRUE;
 }
+#endif
@@ -0,0 +1,202 @@
+-- typed arrays: the vector kernels against plain Lua, and the stream methods inherited from buffer
+-- run in the engine: iLua -run tests/array.lua
+
+local failed = 0
+local function test(name, func)
+  local ok, err = pcall(func)
+  if not ok then
+    failed = failed + 1
+    print(string.format("FAIL %s: %s", name, tostring(err)))
+  end
+end
+
+-- lengths around the vector width, so that both the vector loops and their tails run
+local lengths = {0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 33, 100}
+
+-- small integers and halves: exact in f32, so the results do not depend on summation order
+local function values(n, seed)
+  local t = {}
+  for i = 1, n do
+    t[i] = ((i * 37 + seed) % 41 - 20) / 2
+  end
+  return t
+end
+
+local function check(got, want, what)
+  assert(got == want, string.format("%s: got %s, want %s", what, tostring(got), tostring(want)))
+end
+
+test("sum", function()
+  for _, ty in ipairs({"f32", "f64", "i32"}) do
+    for _, n in ipairs(lengths) do
+      local t = values(n, 3)
+      if ty == "i32" then
+        for i = 1, n do t[i] = math.floor(t[i]) end
+      end
+      local want = 0
+      for i = 1, n do want = want + t[i] end
+      check(array.new(ty, t):sum(), want, ty .. " sum of " .. n)
+    end
+  end
+end)
+
+test("range", function()
+  for _, ty in ipairs({"f32", "f64"}) do
+    for _, n in ipairs(lengths) do
+      local t = values(n, 5)
+      local a = array.new(ty, t)
+      if n == 0 then
+        assert(a:min() == nil and a:max() == nil)
+      else
+        local lo, hi = math.huge, -math.huge
+        for i = 1, n do
+          lo = math.min(lo, t[i])
+          hi = math.max(hi, t[i])
+        end
+        local rlo, rhi = a:range()
+        check(rlo, lo, ty .. " min of " .. n)
+        check(rhi, hi, ty .. " max of " .. n)
+        check(a:min(), lo, ty .. " min()")
+        check(a:max(), hi, ty .. " max()")
+      end
+    end
+  end
+end)
+
+test("scale", function()
+  for _, ty in ipairs({"f32", "f64"}) do
+    for _, n in ipairs(lengths) do
+      local t = values(n, 7)
+      local a = array.new(ty, t):scale(0.5, 1)
+      for i = 1, n do
+        check(a:get(i), t[i] * 0.5 + 1, ty .. " scale element " .. i .. " of " .. n)
+      end
+      a:add(2)
+      for i = 1, n do
+        check(a:get(i), t[i] * 0.5 + 3, ty .. " add element " .. i .. " of " .. n)
+      end
+    end
+  end
+end)
+
+test("add and dot", function()
+  for _, ty in ipairs({"f32", "f64"}) do
+    for _, n in ipairs(lengths) do
+      local x, y = values(n, 11), values(n, 13)
+      local a, b = array.new(ty, x), array.new(ty, y)
+      local dot = 0
+      for i = 1, n do dot = dot + x[i] * y[i] end
+      check(a:dot(b), dot, ty .. " dot of " .. n)
+      a:add(b, 2)
+      for i = 1, n do
+        check(a:get(i), x[i] + y[i] * 2, ty .. " add element " .. i .. " of " .. n)
+      end
+    end
+  end
+  -- unequal lengths use the shorter one
+  local a, b = array.new("f64", {1, 2, 3}), array.new("f64", {10, 20})
+  check(a:dot(b), 50, "dot of unequal")
+  a:add(b)
+  check(a:get(3), 3, "add leaves the tail")
+end)
+
+test("convert", function()
+  for _, n in ipairs(lengths) do
+    local t = values(n, 17)
+    local d = array.new("f64", t):convert("f32")
+    check(d:type(), "f32", "convert type")
+    check(d:count(), n, "convert count")
+    for i = 1, n do
+      check(d:get(i), t[i], "f64 to f32 element " .. i .. " of " .. n)
+    end
+    local back = array.new("i16", t):convert("f64")
+    for i = 1, n do
+      check(back:get(i), t[i] < 0 and math.ceil(t[i]) or math.floor(t[i]), "i16 to f64 element " .. i)
+    end
+  end
+end)
+
+test("byteswap", function()
+  for _, ty in ipairs({"u16", "u32", "f64"}) do
+    for _, n in ipairs(lengths) do
+      local a = array.new(ty, n)
+      for i = 1, n do a:set(i, i) end
+      local raw = a:tostring()
+      local size = #raw / math.max(n, 1)
+      a:byteswap()
+      local swapped = a:tostring()
+      for i = 0, n - 1 do
+        local elem = raw:sub(i * size + 1, (i + 1) * size)
+        check(swapped:sub(i * size + 1, (i + 1) * size), elem:reverse(), ty .. " byteswap element " .. i)
+      end
+      a:byteswap()
+      check(a:tostring(), raw, ty .. " byteswap twice")
+    end
+  end
+end)
+
+test("whole elements", function()
+  local a = array.new("i32", {1, 2, 3})
+  a:seek(5)
+  check(a:tell(), 4, "seek rounds down")
+  a:seek(0, "end")
+  a:write("abcdef")
+  check(#a, 4, "write keeps whole elements")
+  check(a:size(), 16, "write size")
+  a:write8(120)
+  check(a:size(), 16, "write8 on a wide array")
+  a:resize(27)
+  check(a:size(), 24, "resize rounds down")
+  check(a:count(), 6, "resize count")
+
+  local b = array.new("u8", 0)
+  b:write8(120)
+  check(b:count(), 1, "write8 on a byte array")
+end)
+
+test("read into", function()
+  local src = buffer.create()
+  src:write("0123456789")
+  src:seek(0)
+  local a = array.new("i32", 4)
+  check(src:read(a), 8, "read whole elements")
+  check(a:tell(), 8, "read position")
+  -- the bytes of the partial element were consumed
+  check(src:read(1), nil, "source drained")
+
+  src:seek(0)
+  local c = array.new("u16", 0)
+  c:copy(src)
+  check(c:size(), 10, "copy even length")
+  src:seek(1)
+  local d = array.new("u16", 0)
+  d:copy(src)
+  check(d:size(), 8, "copy drops the partial element")
+  check(d:tell(), 8, "copy position")
+end)
+
+test("serialize keeps the type", function()
+  for _, ty in ipairs({"i8", "u8", "i16", "u16", "i32", "u32", "f32", "f64"}) do
+    local a = array.new(ty, {1, 2, 3, 100, 0})
+    local b = buffer.create()
+    b:serialize(a, "after")
+    b:seek(0)
+    local r, after = b:deserialize(2)
+    check(r:type(), ty, "restored type")
+    check(r:count(), 5, "restored count")
+    check(r:get(4), 100, ty .. " restored element")
+    check(after, "after", "value after the array")
+  end
+  local b = buffer.create()
+  local v = buffer.create()
+  v:write("plain")
+  b:serialize(v)
+  b:seek(0)
+  local r = b:deserialize()
+  assert(r.type == nil, "a buffer stays a buffer")
+end)
+
+if failed > 0 then
+  error(failed .. " array test(s) failed", 0)
+end
+print("array tests passed")
@@ -0,0 +1,153 @@
+-- file module suite; the first argument selects the view mode ("map" or "buffer")
+-- run from a directory where require "file" finds the built module, e.g. linux/ after make
+
+local file = require "file"
+local mode = arg and arg[1] or "buffer"
+
+local failed = 0
+local function test(name, func)
+  local ok, err = pcall(func)
+  if not ok then
+    failed = failed + 1
+    print(string.format("FAIL %s [%s]: %s", name, mode, tostring(err)))
+  end
+end
+
+local function open(path, how)
+  local f = assert(file.open(path, how))
+  assert(f:iomode(mode) == mode, "iomode not applied")
+  return f
+end
+
+-- bytes that differ at every position and across view boundaries
+local function pattern(size, seed)
+  local parts = {}
+  local chunk = {}
+  for i = 1, 256 do
+    chunk[i] = string.char((i * 7 + seed) % 256)
+  end
+  chunk = table.concat(chunk)
+  for i = 1, math.ceil(size / 256) do
+    parts[i] = chunk
+  end
+  return table.concat(parts):sub(1, size)
+end
+
+local function slurp(path)
+  local f = open(path, "r")
+  local data = f:read(f:size()) or ""
+  f:close()
+  return data
+end
+
+local path = os.tmpname()
+
+test("open missing", function()
+  assert(file.open(path .. ".missing/x", "r") == nil)
+end)
+
+test("empty", function()
+  local f = open(path, "w")
+  assert(f:size() == 0)
+  assert(f:read(16) == nil)
+  assert(f:eof())
+  assert(f:close() == true)
+  assert(slurp(path) == "")
+end)
+
+test("write and read back", function()
+  local f = open(path, "w")
+  assert(f:write("hello", " ", "world") == true)
+  assert(f:tell() == 11 and f:size() == 11)
+  f:seek(0)
+  assert(f:read(5) == "hello")
+  f:seek(-5, "end")
+  assert(f:read(100) == "world")
+  assert(f:read(1) == nil)
+  assert(f:close() == true)
+  assert(slurp(path) == "hello world")
+end)
+
+test("overwrite in the middle", function()
+  local f = open(path, "w")
+  f:write(pattern(1000, 1))
+  f:seek(100)
+  f:write("XYZ")
+  f:seek(0)
+  local data = f:read(1000)
+  assert(f:close() == true)
+  local want = pattern(1000, 1)
+  assert(data == want:sub(1, 100) .. "XYZ" .. want:sub(104))
+  assert(slurp(path) == data)
+end)
+
+test("large across views", function()
+  -- several times the initial view size, not a multiple of it
+  local size = 5 * 0x10000 + 12345
+  local data = pattern(size, 3)
+  local f = open(path, "w")
+  for i = 1, size, 4000 do
+    f:write(data:sub(i, i + 3999))
+  end
+  assert(f:size() == size)
+  assert(f:close() == true)
+  assert(slurp(path) == data)
+
+  f = open(path, "r")
+  f:seek(0x10000 - 3)
+  assert(f:read(6) == data:sub(0x10000 - 2, 0x10000 + 3))
+  f:seek(3 * 0x10000 + 77)
+  assert(f:read(1000) == data:sub(3 * 0x10000 + 78, 3 * 0x10000 + 1077))
+  f:close()
+end)
+
+test("append", function()
+  local f = open(path, "w")
+  f:write("head")
+  f:close()
+  f = open(path, "a")
+  f:write("tail")
+  assert(f:close() == true)
+  assert(slurp(path) == "headtail")
+end)
+
+test("resize", function()
+  local f = open(path, "w")
+  f:write(pattern(5000, 5))
+  f:resize(100)
+  assert(f:size() == 100 and f:tell() == 100)
+  f:resize(300)
+  assert(f:size() == 300)
+  f:seek(0)
+  assert(f:read(100) == pattern(100, 5))
+  assert(f:close() == true)
+  assert(#slurp(path) == 300)
+end)
+
+test("reserve survives flush", function()
+  local f = open(path, "w")
+  assert(f:reserve(0x100000) == true)
+  f:write("abc")
+  assert(f:flush() == true)
+  assert(f:size() == 3)
+  f:write(pattern(0x20000, 9))
+  assert(f:close() == true)
+  assert(slurp(path) == "abc" .. pattern(0x20000, 9))
+end)
+
+test("read only", function()
+  local f = open(path, "w")
+  f:write("fixed")
+  f:close()
+  f = open(path, "r")
+  f:write("changed")
+  f:close()
+  assert(slurp(path) == "fixed")
+end)
+
+os.remove(path)
+
+if failed > 0 then
+  error(failed .. " file test(s) failed in " .. mode .. " mode", 0)
+end
+print("file tests passed in " .. mode .. " mode")
@@ -0,0 +1,58 @@
+-- buffer.map: read-only file mappings; run in the engine: iLua -run tests/map.lua
+-- the scratch file is created in the current directory with the file module
+
+require "file"
+
+local failed = 0
+local function test(name, func)
+  local ok, err = pcall(func)
+  if not ok then
+    failed = failed + 1
+    print(string.format("FAIL %s: %s", name, tostring(err)))
+  end
+end
+
+local path = "map_test.tmp"
+local function put(data)
+  local f = assert(file.open(path, "w"))
+  f:write(data)
+  f:close()
+end
+
+test("contents", function()
+  local data = string.rep("mapped\0", 10000)
+  put(data)
+  local m = assert(buffer.map(path))
+  assert(m:size() == #data)
+  assert(tostring(m) == data and m:tostring() == data)
+  assert(m:read(6) == "mapped")
+  m:seek(-7, "end")
+  assert(m:read(100) == "mapped\0")
+  assert(m:read(1) == nil and m:eof())
+  assert(m.write == nil, "mappings are read-only")
+  assert(#m == #data)
+  assert(tostring(m .. "!") == data .. "!")
+end)
+
+test("empty file", function()
+  put("")
+  local m = assert(buffer.map(path), "an empty file maps to an empty buffer")
+  assert(m:size() == 0)
+  assert(tostring(m) == "" and m:tostring() == "")
+  assert(m:read(1) == nil)
+  assert(m:eof())
+end)
+
+test("unreadable", function()
+  file.remove(path)
+  assert(buffer.map(path) == nil, "missing file")
+  assert(buffer.map(path .. "/nested") == nil, "missing directory")
+  assert(buffer.map(".") == nil, "directory")
+end)
+
+file.remove(path)
+
+if failed > 0 then
+  error(failed .. " map test(s) failed", 0)
+end
+print("map tests passed")
@@ -0,0 +1,161 @@
+-- stream:pack and stream:unpack; run in the engine: iLua -run tests/pack.lua
+
+local failed = 0
+local function test(name, func)
+  local ok, err = pcall(func)
+  if not ok then
+    failed = failed + 1
+    print(string.format("FAIL %s: %s", name, tostring(err)))
+  end
+end
+
+local unpack = table.unpack or unpack
+
+local function check(got, want, what)
+  assert(got == want, string.format("%s: got %s, want %s", what, tostring(got), tostring(want)))
+end
+
+local function packed(fmt, ...)
+  local b = buffer.create()
+  b:pack(fmt, ...)
+  return b
+end
+local function bytes(b)
+  return (tostring(b):gsub(".", function(c) return string.format("%02x", c:byte()) end))
+end
+
+test("integer limits", function()
+  local cases = {
+    b = {-128, -1, 0, 127}, B = {0, 1, 255},
+    h = {-32768, -1, 0, 32767}, H = {0, 65535},
+    i = {-2147483648, -1, 0, 2147483647}, I = {0, 1, 4294967295},
+    q = {-2^53, -1, 0, 2^53}, Q = {0, 2^53, 2^63},
+  }
+  for code, values in pairs(cases) do
+    for _, endian in ipairs({"<", ">"}) do
+      local fmt = endian .. code
+      local b = packed(fmt, unpack(values))
+      b:seek(0)
+      for _, v in ipairs(values) do
+        check(b:unpack(fmt), v, fmt .. " " .. v)
+      end
+      assert(b:eof(), fmt .. " consumed everything")
+    end
+  end
+end)
+
+test("byte order", function()
+  check(bytes(packed("<hiq", 0x0102, 0x01020304, 0x0102030405)), "0201" .. "04030201" .. "0504030201000000", "little")
+  check(bytes(packed(">hiq", 0x0102, 0x01020304, 0x0102030405)), "0102" .. "01020304" .. "0000000102030405", "big")
+  check(bytes(packed("<f>f", 1, 1)), "0000803f" .. "3f800000", "float")
+  check(bytes(packed(">d", -2)), "c000000000000000", "double")
+end)
+
+test("floats", function()
+  local b = packed("fd>f>d", 0.5, 1 / 3, -1e10, 1e300)
+  b:seek(0)
+  local f, d, bf, bd = b:unpack("fd>f>d")
+  check(f, 0.5, "float")
+  check(d, 1 / 3, "double")
+  check(bf, -1e10, "big float")
+  check(bd, 1e300, "big double")
+end)
+
+test("strings", function()
+  local b = packed("zs>sc", "zero", "len\0gth", "big", "fixed")
+  check(b:size(), 5 + 4 + 7 + 4 + 3 + 1, "sizes")
+  b:seek(0)
+  local z, s, bs, c = b:unpack("zs>sc")
+  check(z, "zero", "z")
+  check(s, "len\0gth", "s")
+  check(bs, "big", "big s")
+  check(c, "f", "c of length 1")
+end)
+
+test("fixed strings pad and truncate", function()
+  local b = packed("5c3c40c", "ab", "abcdef", "x")
+  check(b:size(), 48, "size")
+  check(tostring(b):sub(1, 8), "ab\0\0\0abc", "contents")
+  b:seek(0)
+  local a, c, long = b:unpack("5c3c40c")
+  check(a, "ab\0\0\0", "padded")
+  check(c, "abc", "truncated")
+  check(long, "x" .. string.rep("\0", 39), "padded past the zero block")
+end)
+
+test("padding and repeats", function()
+  local b = packed("B2xH3B", 1, 2, 3, 4, 5)
+  check(bytes(b), "01" .. "0000" .. "0200" .. "030405", "layout")
+  b:seek(0)
+  local v = {b:unpack("B2xH3B")}
+  check(#v, 5, "fields")
+  check(v[1] + v[2] + v[3] + v[4] + v[5], 15, "values")
+end)
+
+test("records", function()
+  -- the format repeats while arguments remain
+  local b = packed("<hB", 1, 2, 3, 4, 5, 6)
+  check(b:size(), 9, "three records")
+  b:seek(0)
+  local t, n = b:unpack("<hB", 10)
+  check(n, 3, "count")
+  check(t[2][1], 3, "record 2 field 1")
+  check(t[3][2], 6, "record 3 field 2")
+
+  local flat = buffer.create()
+  flat:pack("i", 10, 20, 30, 40)
+  flat:seek(0)
+  local values, k = flat:unpack("i", 3)
+  check(k, 3, "flat count")
+  check(values[3], 30, "single field records are values")
+  local rest = {}
+  local more, j = flat:unpack("i", 5, rest)
+  assert(more == rest, "fills the given table")
+  check(j, 1, "what is left")
+  check(rest[1], 40, "last value")
+end)
+
+test("variable records", function()
+  local b = buffer.create()
+  for i = 1, 100 do
+    b:pack("zI", string.rep("n", i % 7), i)
+  end
+  b:seek(0)
+  local t, n = b:unpack("zI", 1000)
+  check(n, 100, "count")
+  check(t[50][1], string.rep("n", 50 % 7), "string")
+  check(t[50][2], 50, "number")
+end)
+
+test("short input", function()
+  local b = buffer.create()
+  b:write("\1\2\3")
+  b:seek(0)
+  -- a fixed-size record comes back whole or not at all
+  check(b:unpack("Bi"), nil, "short fixed record")
+  b:seek(2)
+  local x, y = b:unpack("Bz")
+  check(x, 3, "fields before the end")
+  check(y, nil, "nil marks the end")
+  b:write("\0\0\0\0\0")
+  b:seek(0)
+  local t, n = b:unpack("I", 10)
+  check(n, 2, "whole records only")
+
+  local s = buffer.create()
+  s:write("\255\0\0\0abc")
+  s:seek(0)
+  check(s:unpack("s"), nil, "length past the end")
+end)
+
+test("bad formats", function()
+  local b = buffer.create()
+  assert(not pcall(b.pack, b, "y", 1), "unknown code")
+  assert(not pcall(b.pack, b, "99999999i", 1), "count too large")
+  assert(not pcall(b.unpack, b, string.rep("i", 100)), "too many items")
+end)
+
+if failed > 0 then
+  error(failed .. " pack test(s) failed", 0)
+end
+print("pack tests passed")
@@ -0,0 +1,146 @@
+-- stream.pipe between engine threads; run in the engine: iLua -run tests/pipe.lua
+-- the script runs as an engine thread, so its pipe reads and writes suspend instead of blocking
+
+local failed = 0
+local function test(name, func)
+  local ok, err = pcall(func)
+  if not ok then
+    failed = failed + 1
+    print(string.format("FAIL %s: %s", name, tostring(err)))
+  end
+end
+
+local function check(got, want, what)
+  if type(got) == "string" and type(want) == "string" and #got + #want > 64 then
+    assert(got == want, string.format("%s: got %d bytes, want %d", what, #got, #want))
+    return
+  end
+  assert(got == want, string.format("%s: got %s, want %s", what, tostring(got), tostring(want)))
+end
+
+local function readall(r, piece)
+  local parts = {}
+  while true do
+    local chunk = r:read(piece)
+    if chunk == nil then
+      break
+    end
+    parts[#parts + 1] = chunk
+  end
+  return table.concat(parts)
+end
+
+test("producer and consumer", function()
+  -- far more data than the pipe holds, in pieces that do not line up with its capacity
+  local r, w = stream.pipe(16)
+  local want = {}
+  for i = 1, 200 do
+    want[i] = string.rep(string.char(65 + i % 26), i % 37 + 1)
+  end
+  thread.create(function()
+    for i = 1, #want do
+      assert(w:write(want[i]) == true)
+    end
+    w:close()
+  end)
+  check(readall(r, 7), table.concat(want), "contents")
+  check(r:read(), nil, "stays at the end")
+  assert(r:eof())
+end)
+
+test("writes larger than the capacity", function()
+  local r, w = stream.pipe(100)
+  local data = string.rep("0123456789", 1000)
+  thread.create(function()
+    w:write(data, "|", data)
+    w:close()
+  end)
+  check(readall(r), data .. "|" .. data, "contents")
+end)
+
+test("closed reader", function()
+  local r, w = stream.pipe(8)
+  r:close()
+  check(w:write("more than eight bytes"), false, "write to a closed reader")
+
+  -- a writer waiting for room is woken up when the reader goes away
+  r, w = stream.pipe(8)
+  local result
+  thread.create(function()
+    result = w:write(string.rep("x", 100))
+  end)
+  check(r:read(4), "xxxx", "first bytes")
+  r:close()
+  while result == nil do
+    thread.yield()
+  end
+  check(result, false, "suspended writer")
+end)
+
+test("collected writer", function()
+  local r = stream.pipe(8)
+  collectgarbage()
+  collectgarbage()
+  check(r:read(), nil, "reading after the writer is gone")
+end)
+
+test("wait and available", function()
+  local r, w = stream.pipe(64)
+  check(w:available(), 64, "room")
+  check(r:available(), 0, "data")
+  thread.create(function()
+    for i = 1, 10 do
+      w:write("a")
+      thread.yield()
+    end
+  end)
+  check(r:wait(10), 10, "waited for ten bytes")
+  check(r:read(100), string.rep("a", 10), "contents")
+  check(w:available(), 64, "room again")
+end)
+
+test("stream methods do not return short counts", function()
+  local r, w = stream.pipe(8)
+  -- the whole request fits, so these complete without waiting
+  w:write32(0x01020304)
+  check(r:read32(), 0x01020304, "read32")
+  -- nothing to read and the writer is open: an error instead of a value that looks like the end
+  local ok, err = pcall(r.read32, r)
+  assert(not ok and tostring(err):find("would block"), tostring(err))
+  w:close()
+  check(r:read8(), nil, "at the end")
+end)
+
+test("inflate from a pipe", function()
+  local b = buffer.create()
+  local d = stream.deflate(b)
+  d:write(string.rep("compressed through a pipe ", 50))
+  d:close()
+  local r, w = stream.pipe(b:size())
+  w:write(tostring(b))
+  w:close()
+  check(readall(stream.inflate(r), 100), string.rep("compressed through a pipe ", 50), "contents")
+end)
+
+test("serialize through a pipe", function()
+  local r, w = stream.pipe(4096)
+  local t = {1, 2, 3, name = "pipe", nested = {true}}
+  w:serialize(t, "after")
+  w:close()
+  local v, after = r:deserialize(2)
+  check(v.name, "pipe", "field")
+  check(v.nested[1], true, "nested")
+  check(after, "after", "second value")
+end)
+
+test("arguments", function()
+  assert(not pcall(stream.pipe, 0), "capacity must be positive")
+  local r, w = stream.pipe()
+  assert(not pcall(r.read, r, 0), "count must be positive")
+  assert(r.write == nil and w.read == nil, "one direction per end")
+end)
+
+if failed > 0 then
+  error(failed .. " pipe test(s) failed", 0)
+end
+print("pipe tests passed")
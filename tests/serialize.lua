@@ -0,0 +1,193 @@
+-- serialize/deserialize round trips; run in the engine: iLua -run tests/serialize.lua
+
+local failed = 0
+local function test(name, func)
+  local ok, err = pcall(func)
+  if not ok then
+    failed = failed + 1
+    print(string.format("FAIL %s: %s", name, tostring(err)))
+  end
+end
+
+local function same(a, b, seen)
+  if type(a) ~= type(b) then
+    return false
+  end
+  if type(a) ~= "table" then
+    return a == b
+  end
+  seen = seen or {}
+  if seen[a] then
+    return seen[a] == b
+  end
+  seen[a] = b
+  for k, v in pairs(a) do
+    if not same(v, b[k], seen) then
+      return false
+    end
+  end
+  for k in pairs(b) do
+    if a[k] == nil then
+      return false
+    end
+  end
+  return true
+end
+
+local function roundtrip(...)
+  local b = buffer.create()
+  b:serialize(...)
+  b:seek(0)
+  return b:deserialize(select("#", ...))
+end
+
+test("scalars", function()
+  local values = {true, false, 0, 1, -1, 127, 128, -129, 2^31, -2^31 - 1, 2^53, 0.5, -1e300, "", "a\0b"}
+  for i, v in ipairs(values) do
+    local r = roundtrip(v)
+    assert(r == v, "value " .. i)
+  end
+  local a, b, c = roundtrip(nil, 5, nil)
+  assert(a == nil and b == 5 and c == nil)
+end)
+
+test("long string", function()
+  local s = string.rep("0123456789abcdef", 0x2000)
+  assert(roundtrip(s) == s)
+end)
+
+test("tables", function()
+  local t = {1, 2, 3, x = "y", [10] = 10, [-1] = "neg", [0.5] = "half", nested = {a = {b = {}}}}
+  assert(same(roundtrip(t), t))
+  assert(same(roundtrip({}), {}))
+end)
+
+test("many pairs", function()
+  -- pair counts that need one, two and three varint bytes
+  for _, n in ipairs({127, 128, 300, 20000}) do
+    local t = {}
+    for i = 1, n do
+      t["k" .. i] = i
+    end
+    local r = roundtrip(t, "after")
+    assert(same(r, t), n .. " pairs")
+  end
+  local t = {}
+  for i = 1, 200 do
+    t["k" .. i] = i
+  end
+  local x, y = roundtrip(t, "after")
+  assert(y == "after")
+end)
+
+test("shared and cyclic", function()
+  local shared = {"s"}
+  local t = {a = shared, b = shared}
+  t.self = t
+  local r = roundtrip(t)
+  assert(r.a == r.b and r.a[1] == "s")
+  assert(r.self == r)
+  local x, y = roundtrip(shared, shared)
+  assert(x == y)
+end)
+
+test("functions", function()
+  local function f(n, k)
+    local t = {}
+    for i = 1, n do
+      t[i] = i * k
+    end
+    local sum = 0
+    for i = 1, #t do
+      sum = sum + t[i]
+    end
+    return #t, sum, string.format("%d/%d", n, k)
+  end
+  local g, tail = roundtrip(f, "tail")
+  assert(tail == "tail")
+  local a, b, c = g(10, 3)
+  assert(a == 10 and b == 165 and c == "10/3")
+end)
+
+test("buffers", function()
+  local v = buffer.create()
+  v:write("payload\0bytes")
+  local r = roundtrip(v)
+  assert(tostring(r) == "payload\0bytes")
+end)
+
+test("shared buffers", function()
+  local v = shared.buffer("shared\0bytes")
+  local r = roundtrip(v)
+  assert(tostring(r) == "shared\0bytes")
+  assert(r:size() == 12)
+end)
+
+test("appends to a buffer", function()
+  local b = buffer.create()
+  b:write("head")
+  b:serialize({1, 2})
+  b:seek(4)
+  assert(same(b:deserialize(), {1, 2}))
+end)
+
+test("large output in pieces", function()
+  -- the destination is not at its end, so the output is staged and passed on in pieces
+  local b = buffer.create()
+  b:write("xxxx")
+  b:seek(0)
+  local t = {}
+  for i = 1, 2000 do
+    t[i] = string.rep(string.char(65 + i % 26), 100 + i % 50)
+  end
+  local big = string.rep("z", 0x30000)
+  local function f(a) return a .. "!" end
+  b:serialize(t, big, f, t)
+  b:seek(0)
+  local rt, rbig, rf, rt2 = b:deserialize(4)
+  assert(same(rt, t))
+  assert(rbig == big)
+  assert(rf("ok") == "ok!")
+  assert(rt2 ~= nil and same(rt2, t))
+end)
+
+test("snapshot and restore", function()
+  local counter = 0
+  snap_value = {list = {1, 2, 3}, name = "kept"}
+  snap_alias = snap_value
+  function snap_count()
+    counter = counter + 1
+    return counter
+  end
+  snap_count()
+  local rep = string.rep
+  local b = buffer.create()
+  b:snapshot()
+  snap_value, snap_alias, snap_count = nil, nil, nil
+  b:seek(0)
+  assert(b:restore() == true)
+  assert(snap_value.name == "kept" and snap_value.list[3] == 3)
+  assert(snap_alias == snap_value)
+  -- the function comes back with the value its upvalue had
+  assert(snap_count() == 2)
+  -- library tables and C functions are written by path and keep their identity
+  assert(string.rep == rep)
+  snap_value, snap_alias, snap_count = nil, nil, nil
+
+  local bad = buffer.create()
+  bad:write("not a snapshot")
+  bad:seek(0)
+  assert(bad:restore() == false)
+end)
+
+test("short write", function()
+  local d = stream.deflate(buffer.create())
+  d:close()
+  local ok, err = pcall(d.serialize, d, "value")
+  assert(not ok and tostring(err):find("write failed"), tostring(err))
+end)
+
+if failed > 0 then
+  error(failed .. " serialize test(s) failed", 0)
+end
+print("serialize tests passed")
@@ -0,0 +1,203 @@
+-- stream.deflate and stream.inflate; run in the engine: iLua -run tests/zstream.lua
+
+local failed = 0
+local function test(name, func)
+  local ok, err = pcall(func)
+  if not ok then
+    failed = failed + 1
+    print(string.format("FAIL %s: %s", name, tostring(err)))
+  end
+end
+
+local function check(got, want, what)
+  if type(got) == "string" and type(want) == "string" and #got + #want > 64 then
+    assert(got == want, string.format("%s: got %d bytes, want %d", what, #got, #want))
+    return
+  end
+  assert(got == want, string.format("%s: got %s, want %s", what, tostring(got), tostring(want)))
+end
+
+-- bytes that do not compress, so the data spans many of the filters' internal pieces
+local function noise(size, seed)
+  local t = {}
+  local x = seed
+  for i = 1, size do
+    x = (x * 1103515245 + 12345) % 2147483648
+    t[i] = string.char(math.floor(x / 65536) % 256)
+  end
+  return table.concat(t)
+end
+
+local function compress(data, level, format)
+  local b = buffer.create()
+  local d = stream.deflate(b, level, format)
+  d:write(data)
+  d:close()
+  b:seek(0)
+  return b
+end
+local function readall(s, piece)
+  local parts = {}
+  while true do
+    local chunk = s:read(piece or 0x10000)
+    if chunk == nil then
+      break
+    end
+    parts[#parts + 1] = chunk
+  end
+  return table.concat(parts)
+end
+
+test("round trip", function()
+  local inputs = {"", "a", string.rep("compressible ", 1000), noise(300000, 7)}
+  for _, format in ipairs({"gzip", "zlib", "raw"}) do
+    for _, level in ipairs({0, 1, 9}) do
+      for i, data in ipairs(inputs) do
+        local what = string.format("%s level %d input %d", format, level, i)
+        local z = stream.inflate(compress(data, level, format), format)
+        check(readall(z), data, what)
+        assert(z:eof(), what .. " eof")
+        check(z:tell(), #data, what .. " tell")
+      end
+    end
+  end
+end)
+
+test("headers and detection", function()
+  local data = string.rep("header ", 100)
+  local gz = compress(data, 6, "gzip")
+  check(tostring(gz):sub(1, 2), "\31\139", "gzip magic")
+  local zl = compress(data, 6, "zlib")
+  check(tostring(zl):byte(1), 0x78, "zlib header")
+  check(readall(stream.inflate(gz)), data, "gzip detected")
+  check(readall(stream.inflate(zl)), data, "zlib detected")
+  -- raw data has no header to detect
+  check(readall(stream.inflate(compress(data, 6, "raw"))), "", "raw is not detected")
+end)
+
+test("small reads", function()
+  local data = noise(70000, 3)
+  local z = stream.inflate(compress(data))
+  check(readall(z, 7), data, "7-byte reads")
+end)
+
+test("many small writes", function()
+  local data = noise(50000, 5)
+  local b = buffer.create()
+  local d = stream.deflate(b)
+  for i = 1, #data, 13 do
+    d:write(data:sub(i, i + 12))
+  end
+  check(d:tell(), #data, "uncompressed position")
+  d:close()
+  b:seek(0)
+  check(readall(stream.inflate(b)), data, "contents")
+end)
+
+test("flush", function()
+  local b = buffer.create()
+  local d = stream.deflate(b, 6, "zlib")
+  d:write("first part")
+  d:flush()
+  -- everything written so far can be read back before the data is finished
+  local copy = buffer.create()
+  copy:write(tostring(b))
+  copy:seek(0)
+  check(stream.inflate(copy, "zlib"):read(100), "first part", "flushed data")
+  d:write(", second part")
+  d:close()
+  b:seek(0)
+  check(readall(stream.inflate(b, "zlib")), "first part, second part", "after flush")
+end)
+
+test("closed on collect", function()
+  local b = buffer.create()
+  do
+    local d = stream.deflate(b)
+    d:write("finished by the collector")
+  end
+  collectgarbage()
+  collectgarbage()
+  b:seek(0)
+  check(readall(stream.inflate(b)), "finished by the collector", "contents")
+end)
+
+test("writes after close", function()
+  local b = buffer.create()
+  local d = stream.deflate(b)
+  d:write("data")
+  d:close()
+  local size = b:size()
+  d:write("more")
+  d:close()
+  check(b:size(), size, "nothing written after close")
+end)
+
+test("trailing data stays in the source", function()
+  local b = compress("payload")
+  b:seek(0, "end")
+  b:write("TAIL")
+  b:seek(0)
+  local z = stream.inflate(b)
+  check(readall(z), "payload", "contents")
+  check(b:read(100), "TAIL", "source continues after the compressed data")
+  check(z:rest(), "", "nothing kept")
+
+  -- two members back to back
+  local two = buffer.create()
+  two:write(tostring(compress("one")), tostring(compress("two")))
+  two:seek(0)
+  check(readall(stream.inflate(two)), "one", "first member")
+  check(readall(stream.inflate(two)), "two", "second member")
+end)
+
+test("rest of a source that cannot seek", function()
+  -- an inflate stream is itself a source that cannot seek back
+  local inner = compress("inner", 6, "zlib")
+  local outer = compress(tostring(inner) .. "TAIL" .. string.rep("t", 5000), 6, "gzip")
+  local z = stream.inflate(stream.inflate(outer), "zlib")
+  check(readall(z), "inner", "contents")
+  local rest = z:rest()
+  check(rest:sub(1, 4), "TAIL", "kept bytes")
+  local source = z:source()
+  check(rest .. readall(source), "TAIL" .. string.rep("t", 5000), "rest and source together")
+end)
+
+test("corrupt data", function()
+  local good = tostring(compress(noise(20000, 9)))
+  local bad = buffer.create()
+  bad:write(good:sub(1, 100), string.rep("\255", 200), good:sub(301))
+  bad:seek(0)
+  local z = stream.inflate(bad)
+  readall(z)
+  assert(z:eof(), "stops at the error")
+
+  local cut = buffer.create()
+  cut:write(good:sub(1, math.floor(#good / 2)))
+  cut:seek(0)
+  z = stream.inflate(cut)
+  local got = readall(z)
+  assert(#got < 20000 and z:eof(), "truncated data ends early")
+
+  local garbage = buffer.create()
+  garbage:write("not compressed at all")
+  garbage:seek(0)
+  check(stream.inflate(garbage):read(10), nil, "garbage")
+end)
+
+test("arguments", function()
+  local b = buffer.create()
+  assert(not pcall(stream.deflate, b, 10), "level out of range")
+  assert(not pcall(stream.deflate, b, 6, "auto"), "deflate needs a format")
+  assert(not pcall(stream.inflate, b, "zip"), "unknown format")
+  local d = stream.deflate(b)
+  assert(d:source() == b, "deflate source")
+  assert(d.read == nil and d.seek == nil, "deflate is write-only")
+  local z = stream.inflate(b)
+  assert(z.write == nil and z.seek == nil, "inflate is read-only")
+end)
+
+if failed > 0 then
+  error(failed .. " zstream test(s) failed", 0)
+end
+print("zstream tests passed")